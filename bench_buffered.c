@@ -0,0 +1,361 @@
+#define _GNU_SOURCE  //for getc_unlocked/putc_unlocked
+#include "buffered_open.h"
+#include "buffered_table.h"
+#include "buffered_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BENCH_FILE "bench_output.txt"
+#define DEFAULT_SIZE_MB 64
+#define DEFAULT_TABLE_FILES 2000
+#define DEFAULT_TABLE_OPEN 256
+#define TABLE_WRITES 200000
+#define DEFAULT_PSCAN_THREADS 8
+#define DEFAULT_FOOTPRINT_HANDLES 10000
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *label, size_t bytes, double seconds) {
+    printf("%-28s %10.2f ns/byte %10.1f MB/s\n", label, seconds * 1e9 / bytes, bytes / seconds / (1024 * 1024));
+}
+
+// Byte-at-a-time reads and writes: stdio's unlocked getc/putc against our inline fast paths
+// and against one buffered_read/buffered_write call per byte
+static int bench_bytes(size_t size) {
+    unsigned long sum = 0;
+    double t;
+
+    // stdio writes the reference file
+    FILE *fp = fopen(BENCH_FILE, "w");
+    if (!fp) { perror("fopen"); return 1; }
+    t = now_sec();
+    for (size_t i = 0; i < size; i++) putc_unlocked('a' + (i % 26), fp);
+    if (fclose(fp) == EOF) { perror("fclose"); return 1; }
+    report("putc_unlocked", size, now_sec() - t);
+
+    buffered_file_t *bf = buffered_open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!bf) return 1;
+    t = now_sec();
+    for (size_t i = 0; i < size; i++) {
+        if (buffered_putc(bf, 'a' + (i % 26)) == -1) { buffered_close(bf); return 1; }
+    }
+    if (buffered_close(bf) == -1) return 1;
+    report("buffered_putc", size, now_sec() - t);
+
+    bf = buffered_open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!bf) return 1;
+    t = now_sec();
+    for (size_t i = 0; i < size; i++) {
+        char c = 'a' + (i % 26);
+        if (buffered_write(bf, &c, 1) != 1) { buffered_close(bf); return 1; }
+    }
+    if (buffered_close(bf) == -1) return 1;
+    report("buffered_write (1 byte)", size, now_sec() - t);
+
+    fp = fopen(BENCH_FILE, "r");
+    if (!fp) { perror("fopen"); return 1; }
+    t = now_sec();
+    for (int c; (c = getc_unlocked(fp)) != EOF; ) sum += c;
+    report("getc_unlocked", size, now_sec() - t);
+    fclose(fp);
+
+    bf = buffered_open(BENCH_FILE, O_RDONLY);
+    if (!bf) return 1;
+    t = now_sec();
+    for (int c; (c = buffered_getc(bf)) != -1; ) sum += c;
+    report("buffered_getc", size, now_sec() - t);
+    buffered_close(bf);
+
+    bf = buffered_open(BENCH_FILE, O_RDONLY);
+    if (!bf) return 1;
+    t = now_sec();
+    for (unsigned char c; buffered_read(bf, &c, 1) == 1; ) sum += c;
+    report("buffered_read (1 byte)", size, now_sec() - t);
+    buffered_close(bf);
+
+    printf("(checksum %lu)\n", sum);
+    return 0;
+}
+
+// Fraction of the file's pages in the page cache
+static double cached_fraction(const char *path, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page, resident = 0;
+    unsigned char *vec = malloc(pages);
+    if (vec && mincore(map, size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++) resident += vec[i] & 1;
+    }
+    free(vec);
+    munmap(map, size);
+    return (double)resident / pages;
+}
+
+// Push the file out of the page cache so the next scan starts cold
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Streaming write and cold-cache sequential scan, plain 4 KiB read()/write() against the buffered
+// handle with and without its hints (readahead for the reader, dropping written pages behind the writer)
+static int bench_scan(size_t size) {
+    char block[BUFFER_SIZE];
+    memset(block, 'x', sizeof(block));
+    unsigned long sum = 0;
+    double t;
+
+    int fd = open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) { perror("open"); return 1; }
+    t = now_sec();
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) { perror("write"); close(fd); return 1; }
+    }
+    fdatasync(fd);
+    close(fd);
+    report("write()", size, now_sec() - t);
+    printf("%-28s %9.1f%% of the file cached\n", "", 100 * cached_fraction(BENCH_FILE, size));
+
+    for (int hints = 0; hints <= 1; hints++) {
+        buffered_file_t *bf = buffered_open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC | (hints ? 0 : O_NOHINTS), 0644);
+        if (!bf) return 1;
+        t = now_sec();
+        for (size_t done = 0; done < size; done += sizeof(block)) {
+            if (buffered_write(bf, block, sizeof(block)) != (ssize_t)sizeof(block)) { buffered_close(bf); return 1; }
+        }
+        buffered_flush(bf);
+        fdatasync(bf->fd);
+        if (buffered_close(bf) == -1) return 1;
+        report(hints ? "buffered_write" : "buffered_write O_NOHINTS", size, now_sec() - t);
+        printf("%-28s %9.1f%% of the file cached\n", "", 100 * cached_fraction(BENCH_FILE, size));
+    }
+
+    drop_cache(BENCH_FILE);
+    fd = open(BENCH_FILE, O_RDONLY);
+    if (fd == -1) { perror("open"); return 1; }
+    t = now_sec();
+    for (ssize_t n; (n = read(fd, block, sizeof(block))) > 0; ) sum += block[n - 1];
+    report("read() cold", size, now_sec() - t);
+    close(fd);
+
+    for (int hints = 0; hints <= 1; hints++) {
+        drop_cache(BENCH_FILE);
+        buffered_file_t *bf = buffered_open(BENCH_FILE, O_RDONLY | (hints ? 0 : O_NOHINTS));
+        if (!bf) return 1;
+        t = now_sec();
+        for (ssize_t n; (n = buffered_read(bf, block, sizeof(block))) > 0; ) sum += block[n - 1];
+        report(hints ? "buffered_read cold" : "buffered_read cold O_NOHINTS", size, now_sec() - t);
+        buffered_close(bf);
+    }
+
+    printf("(checksum %lu)\n", sum);
+    return 0;
+}
+
+static int count_newlines(const char *data, size_t len, off_t offset, int worker, void *arg) {
+    (void)offset;
+    (void)worker;
+    unsigned long n = 0;
+    for (const char *p = data, *end = data + len; (p = memchr(p, '\n', end - p)) != NULL; p++) n++;
+    __atomic_add_fetch((unsigned long *)arg, n, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Counting the lines of one file: a single buffered_read cursor against buffered_parallel_scan with
+// 1, 2, 4, ... workers, warm cache so the numbers show the CPU side rather than the disk
+static int bench_pscan(size_t size, int max_threads) {
+    FILE *fp = fopen(BENCH_FILE, "w");
+    if (!fp) { perror("fopen"); return 1; }
+    for (size_t done = 0, i = 0; done < size; i++) {
+        int n = fprintf(fp, "%zu,record,%zu\n", i, i * 7919 % 100000);
+        if (n < 0) { perror("fprintf"); fclose(fp); return 1; }
+        done += n;
+    }
+    if (fclose(fp) == EOF) { perror("fclose"); return 1; }
+
+    static char chunk[64 * 1024];
+    unsigned long lines = 0;
+    double t;
+    for (int pass = 0; pass < 2; pass++) {//the first pass only brings the file into the cache
+        buffered_file_t *bf = buffered_open(BENCH_FILE, O_RDONLY);
+        if (!bf) return 1;
+        lines = 0;
+        t = now_sec();
+        for (ssize_t n; (n = buffered_read(bf, chunk, sizeof(chunk))) > 0; ) {
+            count_newlines(chunk, n, 0, 0, &lines);
+        }
+        buffered_close(bf);
+    }
+    report("buffered_read", size, now_sec() - t);
+    unsigned long expected = lines;
+
+    char label[64];
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        lines = 0;
+        t = now_sec();
+        if (buffered_parallel_scan(BENCH_FILE, threads, '\n', count_newlines, &lines) != 0) {
+            perror("buffered_parallel_scan");
+            return 1;
+        }
+        snprintf(label, sizeof(label), "buffered_parallel_scan x%d", threads);
+        report(label, size, now_sec() - t);
+        if (lines != expected) {
+            fprintf(stderr, "line count %lu, expected %lu\n", lines, expected);
+            return 1;
+        }
+    }
+    printf("(%lu lines, %ld CPUs online)\n", expected, sysconf(_SC_NPROCESSORS_ONLN));
+    return 0;
+}
+
+// Many partition writers through a handle table with few fds; 80% of the writes go to 10% of the files
+static int bench_table(int num_files, int max_open) {
+    buffered_table_t *t = buffered_table_create(max_open);
+    int *handles = malloc(num_files * sizeof(int));
+    if (!t || !handles) { perror("bench_table"); return 1; }
+    char name[64];
+    for (int f = 0; f < num_files; f++) {
+        snprintf(name, sizeof(name), "bench_table_%d.txt", f);
+        handles[f] = buffered_table_open(t, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (handles[f] == -1) return 1;
+    }
+    unsigned int seed = 1;
+    int hot = num_files / 10 > 0 ? num_files / 10 : 1;
+    double t0 = now_sec();
+    for (int i = 0; i < TABLE_WRITES; i++) {
+        int f = rand_r(&seed) % 10 < 8 ? rand_r(&seed) % hot : rand_r(&seed) % num_files;
+        if (buffered_table_write(t, handles[f], "record\n", 7) != 7) return 1;
+    }
+    double seconds = now_sec() - t0;
+    buffered_table_stats_t stats;
+    buffered_table_stats(t, &stats);
+    printf("%d files, %d fds: %lu accesses, %.1f%% hits, %lu reopens (%.0f/s), %lu evictions, %.2f us/write\n",
+           num_files, max_open, stats.accesses, 100.0 * stats.hits / stats.accesses, stats.reopens,
+           stats.reopens / seconds, stats.evictions, seconds * 1e6 / TABLE_WRITES);
+    int res = buffered_table_destroy(t) == -1 ? 1 : 0;
+    for (int f = 0; f < num_files; f++) {
+        snprintf(name, sizeof(name), "bench_table_%d.txt", f);
+        remove(name);
+    }
+    free(handles);
+    return res;
+}
+
+//resident set of this process in bytes
+static long rss_bytes(void) {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) return -1;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(fp);
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+// Memory held by many idle handles: each file is written, flushed and read back to its end, which
+// leaves a default handle with both buffers and an O_LOWMEM one with none. Each mode runs in a
+// child of its own so the heap of one does not hide the other's
+static int bench_footprint(int num_handles) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)num_handles + 16) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)num_handles + 16) {
+            fprintf(stderr, "footprint: needs %d fds, the limit is %lu\n", num_handles + 16, (unsigned long)rl.rlim_cur);
+            return 1;
+        }
+    }
+    const int modes[] = { 0, O_LOWMEM };
+    const char *labels[] = { "default buffers", "O_LOWMEM" };
+    char name[64];
+    for (int m = 0; m < 2; m++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            buffered_file_t **handles = calloc(num_handles, sizeof(buffered_file_t *));
+            char line[100];
+            memset(line, 'x', sizeof(line));
+            if (!handles) _exit(1);
+            long before = rss_bytes();
+            for (int i = 0; i < num_handles; i++) {
+                snprintf(name, sizeof(name), "bench_footprint_%d.txt", i);
+                handles[i] = buffered_open(name, O_RDWR | O_CREAT | O_TRUNC | modes[m], 0644);
+                if (!handles[i] || buffered_write(handles[i], line, sizeof(line)) != sizeof(line) ||
+                    buffered_flush(handles[i]) == -1 || buffered_seek(handles[i], 0, SEEK_SET) != 0 ||
+                    buffered_read(handles[i], line, sizeof(line) + 1) != sizeof(line)) {
+                    perror("footprint");
+                    _exit(1);
+                }
+            }
+            long after = rss_bytes();
+            size_t lent = 0, kept = 0;
+            buffered_pool_stats(&lent, &kept);
+            printf("%-28s %10.1f MB RSS per 10k handles %8.0f bytes/handle (pool: %zu lent, %zu kept)\n",
+                   labels[m], (after - before) * 10000.0 / num_handles / (1024 * 1024),
+                   (double)(after - before) / num_handles, lent, kept);
+            fflush(stdout);
+            for (int i = 0; i < num_handles; i++) buffered_close(handles[i]);
+            _exit(0);
+        }
+        int status;
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            return 1;
+        }
+    }
+    printf("(%d handles, struct %zu bytes, buffer %d bytes)\n", num_handles, sizeof(buffered_file_t), BUFFER_SIZE);
+    for (int i = 0; i < num_handles; i++) {
+        snprintf(name, sizeof(name), "bench_footprint_%d.txt", i);
+        remove(name);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s bytes [size_mb]\n", prog);
+    fprintf(stderr, "       %s scan [size_mb]\n", prog);
+    fprintf(stderr, "       %s table [files] [max_open]\n", prog);
+    fprintf(stderr, "       %s pscan [size_mb] [max_threads]\n", prog);
+    fprintf(stderr, "       %s footprint [handles]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    size_t size_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_SIZE_MB;
+    size_t size = size_mb * 1024 * 1024;
+    int res;
+    if (strcmp(argv[1], "bytes") == 0) {
+        res = bench_bytes(size);
+    } else if (strcmp(argv[1], "scan") == 0) {
+        res = bench_scan(size);
+    } else if (strcmp(argv[1], "table") == 0) {
+        res = bench_table(argc > 2 ? atoi(argv[2]) : DEFAULT_TABLE_FILES,
+                          argc > 3 ? atoi(argv[3]) : DEFAULT_TABLE_OPEN);
+    } else if (strcmp(argv[1], "pscan") == 0) {
+        res = bench_pscan(size, argc > 3 ? atoi(argv[3]) : DEFAULT_PSCAN_THREADS);
+    } else if (strcmp(argv[1], "footprint") == 0) {
+        res = bench_footprint(argc > 2 ? atoi(argv[2]) : DEFAULT_FOOTPRINT_HANDLES);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    remove(BENCH_FILE);
+    return res;
+}
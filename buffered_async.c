@@ -0,0 +1,249 @@
+#include "buffered_async.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+enum async_op { ASYNC_READ, ASYNC_WRITE, ASYNC_FLUSH };
+
+typedef struct async_req {
+    buffered_token_t token;
+    enum async_op op;
+    buffered_file_t *bf;
+    void *buf;
+    size_t count;
+    buffered_async_cb cb;
+    void *arg;
+    ssize_t result;
+    int error;
+    struct async_req *next;
+} async_req_t;
+
+//a FIFO of requests with the lock and condition that guard it
+typedef struct {
+    async_req_t *head;
+    async_req_t *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} async_queue_t;
+
+//every handle (every file, for handles sharing one) maps to one worker, so its requests run one at a time and in order
+typedef struct {
+    pthread_t thread;
+    async_queue_t queue;
+    int stop;
+} async_worker_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static async_worker_t *workers = NULL;
+static int num_workers = 0;
+static async_queue_t completions = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static buffered_token_t next_token = 1;
+
+static void queue_push(async_queue_t *q, async_req_t *req) {
+    req->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = req;
+    else q->head = req;
+    q->tail = req;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *worker_main(void *p) {
+    async_worker_t *w = p;
+    for (;;) {
+        pthread_mutex_lock(&w->queue.lock);
+        while (w->queue.head == NULL && !w->stop) {
+            pthread_cond_wait(&w->queue.ready, &w->queue.lock);
+        }
+        async_req_t *req = w->queue.head;
+        if (req == NULL) {//stopping and drained
+            pthread_mutex_unlock(&w->queue.lock);
+            return NULL;
+        }
+        w->queue.head = req->next;
+        if (w->queue.head == NULL) w->queue.tail = NULL;
+        pthread_mutex_unlock(&w->queue.lock);
+
+        errno = 0;
+        switch (req->op) {
+        case ASYNC_READ: req->result = buffered_read(req->bf, req->buf, req->count); break;
+        case ASYNC_WRITE: req->result = buffered_write(req->bf, req->buf, req->count); break;
+        case ASYNC_FLUSH: req->result = buffered_flush(req->bf); break;
+        }
+        req->error = req->result == -1 ? errno : 0;
+        queue_push(&completions, req);
+    }
+}
+
+//stops, joins and frees the first count workers, pool_lock held
+static void pool_stop(int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&workers[i].queue.lock);
+        workers[i].stop = 1;
+        pthread_cond_signal(&workers[i].queue.ready);
+        pthread_mutex_unlock(&workers[i].queue.lock);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].queue.lock);
+        pthread_cond_destroy(&workers[i].queue.ready);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+static int pool_start(int count) {
+    workers = calloc(count, sizeof(async_worker_t));
+    if (workers == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&workers[i].queue.lock, NULL);
+        pthread_cond_init(&workers[i].queue.ready, NULL);
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            pthread_mutex_destroy(&workers[i].queue.lock);
+            pthread_cond_destroy(&workers[i].queue.ready);
+            pool_stop(i);
+            errno = err;
+            return -1;
+        }
+    }
+    num_workers = count;
+    return 0;
+}
+
+int buffered_async_init(int count) {
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    int res = workers ? 0 : pool_start(count);
+    pthread_mutex_unlock(&pool_lock);
+    return res;
+}
+
+static buffered_token_t submit(enum async_op op, buffered_file_t *bf, void *buf, size_t count,
+                               buffered_async_cb cb, void *arg) {
+    if (bf == NULL || (op != ASYNC_FLUSH && buf == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    async_req_t *req = malloc(sizeof(async_req_t));
+    if (req == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (workers == NULL && pool_start(BUFFERED_ASYNC_WORKERS) == -1) {
+        pthread_mutex_unlock(&pool_lock);
+        free(req);
+        return -1;
+    }
+    req->token = next_token++;
+    //handles on the same file share state, so they go to the same worker as well
+    void *key = bf->inode ? (void *)bf->inode : (void *)bf;
+    async_worker_t *w = &workers[((uintptr_t)key >> 4) % num_workers];
+    pthread_mutex_unlock(&pool_lock);
+
+    req->op = op;
+    req->bf = bf;
+    req->buf = buf;
+    req->count = count;
+    req->cb = cb;
+    req->arg = arg;
+    buffered_token_t token = req->token;
+    queue_push(&w->queue, req);
+    return token;
+}
+
+buffered_token_t buffered_read_async(buffered_file_t *bf, void *buf, size_t count, buffered_async_cb cb, void *arg) {
+    return submit(ASYNC_READ, bf, buf, count, cb, arg);
+}
+
+buffered_token_t buffered_write_async(buffered_file_t *bf, const void *buf, size_t count, buffered_async_cb cb, void *arg) {
+    return submit(ASYNC_WRITE, bf, (void *)buf, count, cb, arg);
+}
+
+buffered_token_t buffered_flush_async(buffered_file_t *bf, buffered_async_cb cb, void *arg) {
+    return submit(ASYNC_FLUSH, bf, NULL, 0, cb, arg);
+}
+
+int buffered_poll(buffered_completion_t *done, int max, int timeout_ms) {
+    if (max <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&completions.lock);
+    if (completions.head == NULL && timeout_ms != 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (completions.head == NULL) {
+            int err = timeout_ms < 0 ? pthread_cond_wait(&completions.ready, &completions.lock)
+                                     : pthread_cond_timedwait(&completions.ready, &completions.lock, &deadline);
+            if (err == ETIMEDOUT) break;
+        }
+    }
+    //detach up to max completions, then run the callbacks without holding the lock
+    async_req_t *batch = completions.head;
+    async_req_t *last = NULL;
+    int reaped = 0;
+    for (async_req_t *req = batch; req != NULL && reaped < max; req = req->next) {
+        last = req;
+        reaped++;
+    }
+    if (last) {
+        completions.head = last->next;
+        if (completions.head == NULL) completions.tail = NULL;
+        last->next = NULL;
+    }
+    pthread_mutex_unlock(&completions.lock);
+
+    int i = 0;
+    while (batch != NULL) {
+        async_req_t *req = batch;
+        batch = req->next;
+        if (done) {
+            done[i].token = req->token;
+            done[i].bf = req->bf;
+            done[i].result = req->result;
+            done[i].error = req->error;
+            done[i].arg = req->arg;
+        }
+        if (req->cb) {
+            req->cb(req->bf, req->result, req->error, req->arg);
+        }
+        free(req);
+        i++;
+    }
+    return reaped;
+}
+
+void buffered_async_shutdown(void) {
+    pthread_mutex_lock(&pool_lock);
+    if (workers) pool_stop(num_workers);
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_mutex_lock(&completions.lock);
+    while (completions.head != NULL) {
+        async_req_t *req = completions.head;
+        completions.head = req->next;
+        free(req);
+    }
+    completions.tail = NULL;
+    pthread_mutex_unlock(&completions.lock);
+}
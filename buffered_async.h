@@ -0,0 +1,43 @@
+#ifndef BUFFERED_ASYNC_H
+#define BUFFERED_ASYNC_H
+
+#include "buffered_open.h"
+
+// Default number of worker threads when buffered_async_init was not called
+#define BUFFERED_ASYNC_WORKERS 4
+
+// Identifies one submitted request, always > 0
+typedef long buffered_token_t;
+
+// Callback run from buffered_poll in the polling thread, error is the errno when result is -1
+typedef void (*buffered_async_cb)(buffered_file_t *bf, ssize_t result, int error, void *arg);
+
+// One reaped completion
+typedef struct {
+    buffered_token_t token;     // Token returned when the request was submitted
+    buffered_file_t *bf;        // Handle the request ran on
+    ssize_t result;             // What the synchronous call returned
+    int error;                  // errno when result is -1, 0 otherwise
+    void *arg;                  // Caller's argument, as submitted
+} buffered_completion_t;
+
+// Function to start the worker pool, optional, the first submit starts a default sized pool
+int buffered_async_init(int workers);
+
+// Function to queue a buffered_read, buf must stay valid until the request completes; returns a token or -1
+buffered_token_t buffered_read_async(buffered_file_t *bf, void *buf, size_t count, buffered_async_cb cb, void *arg);
+
+// Function to queue a buffered_write, buf must stay valid until the request completes; returns a token or -1
+buffered_token_t buffered_write_async(buffered_file_t *bf, const void *buf, size_t count, buffered_async_cb cb, void *arg);
+
+// Function to queue a buffered_flush; returns a token or -1
+buffered_token_t buffered_flush_async(buffered_file_t *bf, buffered_async_cb cb, void *arg);
+
+// Function to reap up to max completions, waiting up to timeout_ms (-1 = forever, 0 = don't wait) for the
+// first one. Runs the callbacks and copies the completions into done (may be NULL). Returns how many were reaped.
+int buffered_poll(buffered_completion_t *done, int max, int timeout_ms);
+
+// Function to finish every queued request and stop the pool, completions not yet reaped are dropped
+void buffered_async_shutdown(void);
+
+#endif // BUFFERED_ASYNC_H
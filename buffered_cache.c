@@ -0,0 +1,264 @@
+#include "buffered_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+
+//one cached block; seq is odd while a writer owns the slot, the other fields are only valid when it is even
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t len;
+    _Atomic uint32_t file_gen;      //the file's and the region's generation when the block was read
+    _Atomic uint32_t region_gen;
+    _Atomic uint64_t dev;
+    _Atomic uint64_t ino;           //0 = empty slot
+    _Atomic uint64_t born;          //tells the file from an earlier one with the same inode number
+    _Atomic uint64_t block;
+    _Atomic uint64_t stamp;         //insertion order, the oldest of a set is replaced
+    char data[CACHE_BLOCK_SIZE];
+} cache_slot_t;
+
+//start of the shared object, followed by the slots
+typedef struct {
+    _Atomic uint64_t magic;         //stored last by the creator, the others wait for it
+    uint64_t sets;
+    _Atomic uint64_t clock;
+    _Atomic uint32_t file_gens[CACHE_FILE_GENS];
+    _Atomic uint32_t region_gens[CACHE_REGION_GENS];
+} cache_header_t;
+
+struct buffered_cache {
+    cache_header_t *header;
+    cache_slot_t *slots;
+    size_t map_size;
+    atomic_ulong hits;
+    atomic_ulong misses;
+};
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t file_hash(dev_t dev, ino_t ino) {
+    return mix((uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)ino);
+}
+
+static _Atomic uint32_t *file_gen(buffered_cache_t *c, dev_t dev, ino_t ino) {
+    return &c->header->file_gens[file_hash(dev, ino) % CACHE_FILE_GENS];
+}
+
+static _Atomic uint32_t *region_gen(buffered_cache_t *c, dev_t dev, ino_t ino, off_t block) {
+    uint64_t region = (uint64_t)block * CACHE_BLOCK_SIZE / CACHE_REGION_SIZE;
+    return &c->header->region_gens[mix(file_hash(dev, ino) + region) % CACHE_REGION_GENS];
+}
+
+static cache_slot_t *cache_set(buffered_cache_t *c, dev_t dev, ino_t ino, off_t block) {
+    return &c->slots[mix(file_hash(dev, ino) + (uint64_t)block) % c->header->sets * CACHE_WAYS];
+}
+
+buffered_cache_t *buffered_cache_attach(const char *name, size_t size) {
+    buffered_cache_t *c = calloc(1, sizeof(buffered_cache_t));
+    if (c == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t sets = size / (CACHE_WAYS * sizeof(cache_slot_t));
+    if (sets == 0) sets = 1;
+    size_t map_size = sizeof(cache_header_t) + sets * CACHE_WAYS * sizeof(cache_slot_t);
+
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd == -1) {
+        free(c);
+        return NULL;
+    }
+    if (created) {
+        //a fresh object is zero filled: every slot empty, every generation 0
+        if (ftruncate(fd, map_size) == -1) {
+            int saved = errno;
+            close(fd);
+            shm_unlink(name);
+            free(c);
+            errno = saved;
+            return NULL;
+        }
+    } else {
+        //the creator may still be sizing it
+        struct stat st;
+        for (int tries = 0; ; tries++) {
+            if (fstat(fd, &st) == -1) {
+                int saved = errno;
+                close(fd);
+                free(c);
+                errno = saved;
+                return NULL;
+            }
+            if ((size_t)st.st_size >= sizeof(cache_header_t) || tries == 1000) break;
+            usleep(1000);
+        }
+        map_size = st.st_size;
+    }
+    void *map = map_size >= sizeof(cache_header_t)
+                ? mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int saved = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(c);
+        errno = map_size >= sizeof(cache_header_t) ? saved : EINVAL;
+        return NULL;
+    }
+    c->header = map;
+    c->slots = (cache_slot_t *)((char *)map + sizeof(cache_header_t));
+    c->map_size = map_size;
+
+    if (created) {
+        c->header->sets = sets;
+        atomic_store_explicit(&c->header->magic, CACHE_MAGIC, memory_order_release);
+    } else {
+        for (int tries = 0; atomic_load_explicit(&c->header->magic, memory_order_acquire) != CACHE_MAGIC; tries++) {
+            if (tries == 1000) {
+                munmap(map, map_size);
+                free(c);
+                errno = EINVAL;
+                return NULL;
+            }
+            usleep(1000);
+        }
+        if (sizeof(cache_header_t) + c->header->sets * CACHE_WAYS * sizeof(cache_slot_t) > map_size) {
+            munmap(map, map_size);
+            free(c);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    return c;
+}
+
+int buffered_cache_detach(buffered_cache_t *cache) {
+    if (cache == NULL) return 0;
+    int res = munmap(cache->header, cache->map_size);
+    free(cache);
+    return res;
+}
+
+int buffered_cache_unlink(const char *name) {
+    return shm_unlink(name);
+}
+
+void buffered_cache_stats(buffered_cache_t *cache, unsigned long *hits, unsigned long *misses) {
+    if (hits) *hits = atomic_load(&cache->hits);
+    if (misses) *misses = atomic_load(&cache->misses);
+}
+
+cache_version_t buffered_cache_version(buffered_cache_t *cache, dev_t dev, ino_t ino, off_t block) {
+    cache_version_t v;
+    v.file_gen = atomic_load_explicit(file_gen(cache, dev, ino), memory_order_acquire);
+    v.region_gen = atomic_load_explicit(region_gen(cache, dev, ino, block), memory_order_acquire);
+    return v;
+}
+
+ssize_t buffered_cache_lookup(buffered_cache_t *cache, dev_t dev, ino_t ino, uint64_t born, off_t block, char *dst) {
+    cache_version_t v = buffered_cache_version(cache, dev, ino, block);
+    cache_slot_t *set = cache_set(cache, dev, ino, block);
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        cache_slot_t *s = &set[w];
+        uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq & 1) continue;
+        if (atomic_load_explicit(&s->ino, memory_order_relaxed) != (uint64_t)ino ||
+            atomic_load_explicit(&s->dev, memory_order_relaxed) != (uint64_t)dev ||
+            atomic_load_explicit(&s->block, memory_order_relaxed) != (uint64_t)block) {
+            continue;
+        }
+        //the block of a deleted file whose inode number was given to this one
+        if (atomic_load_explicit(&s->born, memory_order_relaxed) != born) {
+            break;
+        }
+        //a block read before the last write to its file or region is stale
+        if (atomic_load_explicit(&s->file_gen, memory_order_relaxed) != v.file_gen ||
+            atomic_load_explicit(&s->region_gen, memory_order_relaxed) != v.region_gen) {
+            break;
+        }
+        uint32_t len = atomic_load_explicit(&s->len, memory_order_relaxed);
+        if (len > CACHE_BLOCK_SIZE) break;
+        memcpy(dst, s->data, len);
+        //the copy counts only if no writer took the slot meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) break;
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return len;
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return -1;
+}
+
+void buffered_cache_insert(buffered_cache_t *cache, dev_t dev, ino_t ino, uint64_t born, off_t block,
+                           cache_version_t version, const char *src, size_t len) {
+    //written since it was read: caching it would bring back what the writer invalidated
+    cache_version_t now = buffered_cache_version(cache, dev, ino, block);
+    if (now.file_gen != version.file_gen || now.region_gen != version.region_gen || len > CACHE_BLOCK_SIZE) {
+        return;
+    }
+    cache_slot_t *set = cache_set(cache, dev, ino, block);
+    cache_slot_t *victim = NULL;
+    uint64_t oldest = UINT64_MAX;
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        cache_slot_t *s = &set[w];
+        uint64_t stamp = atomic_load_explicit(&s->stamp, memory_order_relaxed);
+        if (atomic_load_explicit(&s->ino, memory_order_relaxed) == (uint64_t)ino &&
+            atomic_load_explicit(&s->dev, memory_order_relaxed) == (uint64_t)dev &&
+            atomic_load_explicit(&s->block, memory_order_relaxed) == (uint64_t)block) {
+            victim = s;
+            break;
+        }
+        if (stamp < oldest) {
+            oldest = stamp;
+            victim = s;
+        }
+    }
+    //a slot another process is rewriting is left to it
+    uint32_t seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&victim->seq, &seq, seq + 1,
+                                                              memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&victim->dev, (uint64_t)dev, memory_order_relaxed);
+    atomic_store_explicit(&victim->ino, (uint64_t)ino, memory_order_relaxed);
+    atomic_store_explicit(&victim->born, born, memory_order_relaxed);
+    atomic_store_explicit(&victim->block, (uint64_t)block, memory_order_relaxed);
+    atomic_store_explicit(&victim->len, (uint32_t)len, memory_order_relaxed);
+    atomic_store_explicit(&victim->file_gen, version.file_gen, memory_order_relaxed);
+    atomic_store_explicit(&victim->region_gen, version.region_gen, memory_order_relaxed);
+    atomic_store_explicit(&victim->stamp, atomic_fetch_add_explicit(&cache->header->clock, 1, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    memcpy(victim->data, src, len);
+    atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+}
+
+void buffered_cache_invalidate(buffered_cache_t *cache, dev_t dev, ino_t ino, off_t start, off_t len) {
+    off_t first = start / CACHE_REGION_SIZE;
+    off_t last = len > 0 ? (start + len - 1) / CACHE_REGION_SIZE : first;
+    //a wide write is cheaper to handle as a write to the whole file
+    if (len <= 0 || last - first >= 64) {
+        atomic_fetch_add_explicit(file_gen(cache, dev, ino), 1, memory_order_release);
+        return;
+    }
+    for (off_t region = first; region <= last; region++) {
+        off_t block = region * (CACHE_REGION_SIZE / CACHE_BLOCK_SIZE);
+        atomic_fetch_add_explicit(region_gen(cache, dev, ino, block), 1, memory_order_release);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef BUFFERED_CACHE_H
+#define BUFFERED_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block cache in a POSIX shared memory object, shared by every process that attaches it by name.
+// Handles given one with buffered_set_cache refill their read window from it, block aligned, and
+// pread only the blocks missing from it. Lookups take no lock: each slot carries a sequence number
+// that is odd while the slot is rewritten, and a reader whose copy raced a rewrite treats it as a miss.
+// Flushes through a handle with the cache invalidate what they overwrote. Writers that bypass it
+// (other programs, handles without the cache) are not seen, so it is meant for read-mostly files.
+// Blocks are keyed by device, inode number and the file's birth time, so a file deleted and created
+// again under a reused inode number does not get the old file's blocks.
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_WAYS 4                 // Slots a block can be cached in, the oldest of them is replaced
+#define CACHE_REGION_SIZE (1 << 20)  // Writes invalidate whole regions of this size
+#define CACHE_FILE_GENS 1024         // Generation counters for files and regions, hashed
+#define CACHE_REGION_GENS 65536
+#define CACHE_MAGIC 0x3245484341434642ULL // "BFCACHE2"
+
+typedef struct buffered_cache buffered_cache_t;
+
+// Function to attach the cache called name ("/name" as for shm_open), creating it with room for
+// size bytes of blocks if it does not exist yet; size is ignored when attaching an existing one
+buffered_cache_t *buffered_cache_attach(const char *name, size_t size);
+
+// Function to detach this process from the cache, handles still using it must be closed first
+int buffered_cache_detach(buffered_cache_t *cache);
+
+// Function to remove the cache's name, processes attached to it keep using it
+int buffered_cache_unlink(const char *name);
+
+// Function to read this process's hit and miss counts (in blocks)
+void buffered_cache_stats(buffered_cache_t *cache, unsigned long *hits, unsigned long *misses);
+
+// Used by buffered_open.c: the versions a block is checked against, taken before reading it from the file
+typedef struct {
+    uint32_t file_gen;
+    uint32_t region_gen;
+} cache_version_t;
+
+// Function to copy a cached block into dst, returns its length (short at end of file) or -1 on a miss;
+// born is the file's birth time (its ctime where the filesystem keeps none), as for insert
+ssize_t buffered_cache_lookup(buffered_cache_t *cache, dev_t dev, ino_t ino, uint64_t born, off_t block, char *dst);
+
+// Function to read the versions of a block before reading it from the file
+cache_version_t buffered_cache_version(buffered_cache_t *cache, dev_t dev, ino_t ino, off_t block);
+
+// Function to cache a block read from the file, dropped if the file was written since version was taken
+void buffered_cache_insert(buffered_cache_t *cache, dev_t dev, ino_t ino, uint64_t born, off_t block,
+                           cache_version_t version, const char *src, size_t len);
+
+// Function to invalidate the blocks of [start, start + len) after writing them, len 0 = the whole file
+void buffered_cache_invalidate(buffered_cache_t *cache, dev_t dev, ino_t ino, off_t start, off_t len);
+
+#endif // BUFFERED_CACHE_H
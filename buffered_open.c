@@ -1,5 +1,7 @@
 #define _GNU_SOURCE  //for O_TMPFILE not sure if it's really needed
 #include "buffered_open.h"
+#include "buffered_trace.h"
+#include "buffered_cache.h"
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -9,53 +11,297 @@
 #include <unistd.h>     
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <libgen.h>
+#include <time.h>
 
-buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
-    // 1.handle mode argument for O_CREAT/O_TMPFILE
-    mode_t mode = 0;
-    if (flags & (O_CREAT | O_TMPFILE)) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+//a single byte far past any real data; writers hold it while they wait, which keeps new readers out
+#define LOCK_GATE_OFFSET ((off_t)LLONG_MAX - 1)
+
+static int mmap_setup(buffered_file_t *bf);
+static int flush_write_buffer(buffered_file_t *bf);
+static void hint_written(buffered_file_t *bf, off_t start, size_t len);
+static void group_enter(buffered_file_t *bf);
+static int group_pending(buffered_file_t *bf);
+static int group_flush(buffered_file_t *bf);
+static int group_flush_overlapping(buffered_file_t *bf);
+static ssize_t txn_write(buffered_file_t *bf, const char *src, size_t count);
+static ssize_t read_call(buffered_file_t *bf, void *buf, size_t count);
+static ssize_t write_call(buffered_file_t *bf, const void *buf, size_t count);
+static int flush_call(buffered_file_t *bf);
+static void txn_free(struct buffered_txn *txn);
+static int policy_detach(buffered_file_t *bf);
+static size_t write_limit(buffered_file_t *bf);
+
+//one staged write: data[at, at + len) goes to offset, the end of file or the front, per the handle's mode
+typedef struct {
+    off_t offset;
+    size_t at;
+    size_t len;
+} txn_entry_t;
+
+//the writes of committed transactions not yet published, followed by those of the open one
+struct buffered_txn {
+    int active;             //between buffered_begin and buffered_commit/buffered_abort
+    int batch;              //publish after this many commits
+    int commits;            //committed transactions waiting to be published
+    txn_entry_t *entries;
+    size_t num_entries, cap_entries;
+    char *data;
+    size_t data_len, data_cap;
+    size_t begin_entries;   //log length when the open transaction began, abort cuts back to it
+    size_t begin_data;
+    off_t begin_offset;     //file_offset when it began
+};
+
+//buffer size for new handles, and the counter that gives each handle its trace id
+static size_t default_buffer_size = BUFFER_SIZE;
+static unsigned int next_trace_id = 0;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+
+int buffered_set_buffer_size(size_t size) {
+    if (size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    default_buffer_size = size;
+    return 0;
+}
+
+//the buffers of O_LOWMEM handles: lent while a handle is active, the returned ones of the default size
+//kept for reuse in a list linked through their first bytes
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_returned = PTHREAD_COND_INITIALIZER;
+static size_t pool_limit = 0;           //bytes that may be lent at once, 0 = no cap
+static int pool_wait_ms = 0;
+static size_t pool_lent = 0;
+static char *pool_kept = NULL;
+static size_t pool_kept_count = 0;
+
+int buffered_set_pool_limit(size_t max_bytes, int wait_ms) {
+    if (wait_ms < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_limit = max_bytes;
+    pool_wait_ms = wait_ms;
+    pthread_cond_broadcast(&pool_returned);//a higher cap may let waiters through
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+void buffered_pool_stats(size_t *lent, size_t *kept) {
+    pthread_mutex_lock(&pool_lock);
+    if (lent) *lent = pool_lent;
+    if (kept) *kept = pool_kept_count * BUFFER_SIZE;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+//a buffer of size bytes, waiting at the cap for one to come back. NULL with ENOBUFS or ENOMEM
+static char *pool_get(size_t size) {
+    pthread_mutex_lock(&pool_lock);
+    struct timespec deadline;
+    int waited = 0;
+    while (pool_limit > 0 && pool_lent + size > pool_limit) {
+        if (!waited) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += pool_wait_ms / 1000;
+            deadline.tv_nsec += (long)(pool_wait_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            waited = 1;
+        }
+        if (pool_wait_ms == 0 || pthread_cond_timedwait(&pool_returned, &pool_lock, &deadline) == ETIMEDOUT) {
+            //one more check, the buffer may have come back just as the wait ran out
+            if (pool_limit == 0 || pool_lent + size <= pool_limit) break;
+            pthread_mutex_unlock(&pool_lock);
+            errno = ENOBUFS;
+            return NULL;
+        }
+    }
+    pool_lent += size;
+    char *buf = NULL;
+    if (size == BUFFER_SIZE && pool_kept != NULL) {
+        buf = pool_kept;
+        memcpy(&pool_kept, buf, sizeof(char *));
+        pool_kept_count--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (buf == NULL && (buf = malloc(size)) == NULL) {
+        pthread_mutex_lock(&pool_lock);
+        pool_lent -= size;
+        pthread_cond_broadcast(&pool_returned);
+        pthread_mutex_unlock(&pool_lock);
+        errno = ENOMEM;
     }
-    // 2.allocate buffered_file_t
+    return buf;
+}
+
+static void pool_put(char *buf, size_t size) {
+    pthread_mutex_lock(&pool_lock);
+    pool_lent -= size;
+    if (size == BUFFER_SIZE && pool_kept_count < POOL_KEEP) {
+        memcpy(buf, &pool_kept, sizeof(char *));
+        pool_kept = buf;
+        pool_kept_count++;
+        buf = NULL;
+    }
+    pthread_cond_broadcast(&pool_returned);
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+//atexit takes a void function, buffered_trace_stop returns its status
+static void trace_stop_at_exit(void) {
+    buffered_trace_stop();
+}
+
+//BUFFERED_TRACE=<path> traces the whole run without touching the program
+static void trace_from_env(void) {
+    const char *path = getenv(TRACE_ENV);
+    if (path != NULL && *path != '\0' && buffered_trace_start(path) == 0) {
+        atexit(trace_stop_at_exit);
+    }
+}
+
+//where failures go besides the handle: nowhere unless the program set a handler
+static buffered_error_handler_t error_handler = NULL;
+static void *error_arg = NULL;
+static int error_limit = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t error_window = 0;         //the second being counted
+static int error_reports = 0;           //reports made in it
+
+void buffered_set_error_handler(buffered_error_handler_t handler, void *arg, int max_per_second) {
+    pthread_mutex_lock(&error_lock);
+    error_arg = arg;
+    error_limit = max_per_second > 0 ? max_per_second : 0;
+    __atomic_store_n(&error_handler, handler, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&error_lock);
+}
+
+//record a failure on the handle (NULL if there is none yet) and hand it to the handler, errno is kept.
+//Each failure is noted once, where it happened: callers that only pass a -1 on do not note it again
+static void note_error(buffered_file_t *bf, int op, off_t offset, const char *what) {
+    int saved = errno;
+    buffered_error_t err = { saved, op, offset, what, 1 };
+    if (bf != NULL) {
+        err.count = bf->error.count + 1;
+        bf->error = err;
+    }
+    if (__atomic_load_n(&error_handler, __ATOMIC_ACQUIRE) != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&error_lock);
+        buffered_error_handler_t handler = error_handler;
+        void *arg = error_arg;
+        if (now.tv_sec != error_window) {
+            error_window = now.tv_sec;
+            error_reports = 0;
+        }
+        int report = handler != NULL && (error_limit == 0 || error_reports < error_limit);
+        if (report) error_reports++;
+        pthread_mutex_unlock(&error_lock);
+        if (report) handler(bf, &err, arg);
+    }
+    errno = saved;
+}
+
+int buffered_error(buffered_file_t *bf, buffered_error_t *err) {
+    if (bf == NULL) return EBADF;
+    if (err != NULL) *err = bf->error;
+    return bf->error.err;
+}
+
+void buffered_clearerr(buffered_file_t *bf) {
+    if (bf == NULL) return;
+    memset(&bf->error, 0, sizeof(bf->error));
+}
+
+//our own flags, never passed on to open()
+#define BUFFERED_OWN_FLAGS (O_PREAPPEND | O_MMAPWRITE | O_RANGELOCK | O_NOHINTS | O_LOWMEM | O_SHARED)
+
+//allocate a handle with its buffers and every field in its initial state, fd still unset
+static buffered_file_t *buffered_alloc(int flags) {
+    // 1.allocate buffered_file_t
     buffered_file_t *bf = malloc(sizeof(buffered_file_t));
     if (bf == NULL) {
         errno = ENOMEM;
-        perror("buffered_open: struct memory allocation error");
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "struct memory allocation error");
         return NULL;
     }
-    // 3.allocate buffers
-    bf->read_buffer = malloc(BUFFER_SIZE);
-    bf->write_buffer = malloc(BUFFER_SIZE);
+    // 2.allocate buffers, a low-footprint handle borrows its one buffer when it first needs it
+    bf->buffer_capacity = default_buffer_size;
+    bf->lowmem = (flags & O_LOWMEM) ? 1 : 0;
+    bf->read_buffer = bf->lowmem ? NULL : malloc(bf->buffer_capacity);
+    bf->write_buffer = bf->lowmem ? NULL : malloc(bf->buffer_capacity);
     
-    if (bf->read_buffer == NULL || bf->write_buffer == NULL) {
+    if (!bf->lowmem && (bf->read_buffer == NULL || bf->write_buffer == NULL)) {
         errno = ENOMEM;
-        perror("buffered_open: memory allocation error"); 
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "memory allocation error");
         free(bf->read_buffer);
         free(bf->write_buffer);
         free(bf);
         return NULL;
     }
 
-    // 4.initialize fields
+    // 3.initialize fields
+    bf->fd = -1;
     bf->read_buffer_size = 0;
-    bf->write_buffer_size = BUFFER_SIZE;
+    bf->write_buffer_size = bf->lowmem ? 0 : bf->buffer_capacity;
     bf->read_buffer_pos = 0;
     bf->write_buffer_pos = 0;
     bf->preappend = (flags & O_PREAPPEND) ? 1 : 0; 
+    bf->append = ((flags & O_APPEND) && !bf->preappend) ? 1 : 0;
+    bf->offset_stale = 0;
     
-    //remove O_PREAPPEND from flags passed to open, if we are pre-appending
-    bf->flags = flags & ~O_PREAPPEND; 
+    //remove our own flags from the flags passed to open
+    bf->flags = flags & ~BUFFERED_OWN_FLAGS; 
     
     bf->last_operation = 0;
     bf->file_offset = 0; 
+    bf->read_buffer_offset = 0;
+    bf->write_buffer_offset = 0;
+    bf->map = NULL;
+    bf->map_size = 0;
+    bf->logical_size = 0;
+    bf->dirty_start = 0;
+    bf->dirty_end = 0;
+    bf->range_lock = (flags & O_RANGELOCK) ? 1 : 0;
+    bf->held_locks = 0;
+    bf->seekable = 1;
+    bf->hints = (flags & O_NOHINTS) ? 0 : 1;
+    bf->share = (flags & O_SHARED) ? 1 : 0;
+    bf->access_pattern = 0;
+    bf->access_candidate = 0;
+    bf->access_run = 0;
+    bf->access_last = -1;
+    bf->access_stride = 0;
+    bf->readahead_end = 0;
+    bf->writeback_end = 0;
+    bf->dontneed_start = 0;
+    bf->inode = NULL;
+    bf->inode_next = NULL;
+    bf->inode_prev = NULL;
+    bf->write_seq = 0;
+    bf->path = NULL;
+    bf->txn = NULL;
+    bf->policy = NULL;
+    bf->cache = NULL;
+    memset(&bf->error, 0, sizeof(bf->error));
+    bf->trace_id = __atomic_add_fetch(&next_trace_id, 1, __ATOMIC_RELAXED);
+    pthread_once(&trace_env_once, trace_from_env);
 
-    // 5.open file 
-    bf->fd = open(pathname, bf->flags, mode); 
-    if (bf->fd == -1) {
-        perror("buffered_open: file open error");
+    //the mapping has to be readable and writable, and it cannot shift data around
+    if ((flags & O_MMAPWRITE) && ((flags & O_ACCMODE) != O_RDWR || (flags & O_APPEND) || bf->preappend)) {
+        errno = EINVAL;
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "O_MMAPWRITE needs O_RDWR without O_APPEND/O_PREAPPEND");
         free(bf->read_buffer);
         free(bf->write_buffer);
         free(bf);
@@ -64,218 +310,2232 @@ buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
     return bf;
 }
 
-ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
-    if (bf == NULL || buf == NULL || bf->fd == -1) {
-        errno = EBADF;
-        perror("buffered_read: invalid buffered_file_t or buffer");
-        return -1;
-    }
-    if (count == 0) return 0;
-    
-    //flush the write buffer when switching from write
-    if (bf->last_operation == 2) { // 2 = Write
-        if (buffered_flush(bf) == -1) {
-            perror("buffered_read: failed to flush write buffer before reading");
-            return -1;
-        }
+static void buffered_free(buffered_file_t *bf) {
+    txn_free(bf->txn);
+    free(bf->path);
+    if (bf->lowmem) {
+        if (bf->read_buffer) pool_put(bf->read_buffer, bf->buffer_capacity);
+    } else {
+        free(bf->read_buffer);
+        free(bf->write_buffer);
     }
-    bf->last_operation = 1; // 1 = Read
+    free(bf);
+}
 
-    size_t total_read = 0;
-    char *dest = (char *)buf;
+//the handles of this process on one file: O_SHARED handles find theirs by (dev, ino) in the hash table,
+//every other handle gets an entry of its own that just remembers the file
+typedef struct buffered_inode {
+    dev_t dev;
+    ino_t ino;
+    int count;                      //handles in the list
+    int hashed;                     //in inode_buckets, the entry of O_SHARED handles
+    uint64_t born;                  //birth time for the shared cache's key, 0 until a handle takes a cache
+    buffered_file_t *handles;       //linked through inode_next/inode_prev
+    unsigned long seq;              //last write_seq handed out
+    struct buffered_inode *next;    //next entry in the same bucket
+} buffered_inode_t;
 
-    while (total_read < count) {
-        size_t in_buffer = bf->read_buffer_size - bf->read_buffer_pos;
-        
-        //refill buffer if empty
-        if (in_buffer == 0) {
-            ssize_t bytes_read = read(bf->fd, bf->read_buffer, BUFFER_SIZE);
+#define INODE_INITIAL_BUCKETS 64
 
-            if (bytes_read == 0) {
-                //end of file
-                return total_read;
-            }
-            if (bytes_read < 0) {
-                perror("buffered_read: underlying read error");
-                return total_read > 0 ? (ssize_t)total_read : -1;
-            }
-            bf->read_buffer_size = bytes_read;
-            bf->read_buffer_pos = 0;
-            in_buffer = bytes_read; 
+static buffered_inode_t **inode_buckets = NULL;
+static size_t num_buckets = 0;      //power of two
+static size_t num_inodes = 0;       //hashed entries
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t inode_bucket(dev_t dev, ino_t ino, size_t buckets) {
+    unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)dev;
+    return (size_t)(h ^ (h >> 29)) & (buckets - 1);
+}
+
+//keeps the chains short, a failed allocation just leaves them longer; inodes_lock held
+static void inode_grow(void) {
+    size_t buckets = num_buckets ? num_buckets * 2 : INODE_INITIAL_BUCKETS;
+    buffered_inode_t **grown = calloc(buckets, sizeof(buffered_inode_t *));
+    if (grown == NULL) return;
+    for (size_t b = 0; b < num_buckets; b++) {
+        while (inode_buckets[b] != NULL) {
+            buffered_inode_t *ino = inode_buckets[b];
+            inode_buckets[b] = ino->next;
+            size_t to = inode_bucket(ino->dev, ino->ino, buckets);
+            ino->next = grown[to];
+            grown[to] = ino;
         }
-        size_t bytes_needed = count - total_read;
-        size_t to_copy = (bytes_needed < in_buffer) ? bytes_needed : in_buffer;     
-        memcpy(dest + total_read, bf->read_buffer + bf->read_buffer_pos, to_copy);
-        bf->read_buffer_pos += to_copy;
-        total_read += to_copy;
-        bf->file_offset += to_copy; 
     }
+    free(inode_buckets);
+    inode_buckets = grown;
+    num_buckets = buckets;
+}
 
-    return (ssize_t)total_read;
+static void inode_attach(buffered_inode_t *ino, buffered_file_t *bf) {
+    bf->inode = ino;
+    bf->inode_prev = NULL;
+    bf->inode_next = ino->handles;
+    if (ino->handles != NULL) ino->handles->inode_prev = bf;
+    ino->handles = bf;
+    ino->count++;
 }
 
-ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
-    if (bf == NULL || buf == NULL || bf->fd == -1) {
-        perror("buffered_write: invalid buffered_file_t or buffer");
+static int inode_register(buffered_file_t *bf) {
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1) {
         return -1;
     }
-    if (count == 0) return 0;
-
-    //discard any buffered read if switched from read
-    if (bf->last_operation == 1) { // 1 = Read
-        //align file cursor using lseek
-        if (lseek(bf->fd, bf->file_offset, SEEK_SET) == (off_t)-1) {
-             perror("buffered_write: lseek error");
-             return -1;
+    if (!bf->share) {
+        buffered_inode_t *ino = calloc(1, sizeof(buffered_inode_t));
+        if (ino == NULL) {
+            errno = ENOMEM;
+            return -1;
         }
-        bf->read_buffer_pos = 0;
-        bf->read_buffer_size = 0;
+        ino->dev = st.st_dev;
+        ino->ino = st.st_ino;
+        inode_attach(ino, bf);
+        return 0;
     }
-    bf->last_operation = 2; // 2 = Write
-
-    size_t total_written = 0;
-    const char *src = (const char *)buf;
-   
-    while (total_written < count) { 
-        size_t to_copy = count - total_written;
-        size_t space_left = bf->write_buffer_size - bf->write_buffer_pos;
-        
-        if (space_left == 0) {
-            //flush buffer if full
-            if (buffered_flush(bf) == -1) {
-                perror("buffered_write: flush error");
-                return total_written > 0 ? (ssize_t)total_written : -1;
-            }
-            space_left = bf->write_buffer_size;
+    pthread_mutex_lock(&inodes_lock);
+    if (num_inodes >= num_buckets) {
+        inode_grow();
+    }
+    if (num_buckets == 0) {
+        pthread_mutex_unlock(&inodes_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t b = inode_bucket(st.st_dev, st.st_ino, num_buckets);
+    buffered_inode_t *ino = inode_buckets[b];
+    while (ino != NULL && (ino->dev != st.st_dev || ino->ino != st.st_ino)) {
+        ino = ino->next;
+    }
+    if (ino == NULL) {
+        ino = calloc(1, sizeof(buffered_inode_t));
+        if (ino == NULL) {
+            pthread_mutex_unlock(&inodes_lock);
+            errno = ENOMEM;
+            return -1;
         }
+        ino->dev = st.st_dev;
+        ino->ino = st.st_ino;
+        ino->hashed = 1;
+        ino->next = inode_buckets[b];
+        inode_buckets[b] = ino;
+        num_inodes++;
+    }
+    inode_attach(ino, bf);
+    pthread_mutex_unlock(&inodes_lock);
+    return 0;
+}
 
-        if (to_copy > space_left) {
-            to_copy = space_left;
+static void inode_unregister(buffered_file_t *bf) {
+    buffered_inode_t *ino = bf->inode;
+    if (ino == NULL) return;
+    int hashed = ino->hashed;
+    if (hashed) pthread_mutex_lock(&inodes_lock);
+    if (bf->inode_prev != NULL) bf->inode_prev->inode_next = bf->inode_next;
+    else ino->handles = bf->inode_next;
+    if (bf->inode_next != NULL) bf->inode_next->inode_prev = bf->inode_prev;
+    if (--ino->count == 0) {
+        if (hashed) {
+            buffered_inode_t **entry = &inode_buckets[inode_bucket(ino->dev, ino->ino, num_buckets)];
+            while (*entry != ino) entry = &(*entry)->next;
+            *entry = ino->next;
+            num_inodes--;
         }
-        
-        memcpy(bf->write_buffer + bf->write_buffer_pos, src + total_written, to_copy);
-        bf->write_buffer_pos += to_copy;
-        total_written += to_copy;
+        free(ino);
     }
+    if (hashed) pthread_mutex_unlock(&inodes_lock);
+    bf->inode = NULL;
+    bf->inode_next = bf->inode_prev = NULL;
+}
 
-    return (ssize_t)total_written;
+//when the file was created, in ns: its inode number alone may have belonged to a deleted file before.
+//Filesystems without a birth time give the ctime, which a write moves on, so blocks cached under it
+//just stop being found
+static uint64_t file_born(int fd) {
+    struct statx sx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_BTIME | STATX_CTIME, &sx) == -1) {
+        return 0;
+    }
+    struct statx_timestamp t = (sx.stx_mask & STATX_BTIME) ? sx.stx_btime : sx.stx_ctime;
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
-int buffered_flush(buffered_file_t *bf) {
-    if (bf == NULL || bf->fd == -1) {
-        if (bf->write_buffer_pos > 0) {
-            perror("buffered_flush: invalid file descriptor or pointer");
-        }
-        return -1;
+//the handles of ino now all have another file open, a published transaction's copy: it cannot be open
+//in this process under its new (dev, ino) yet, so the entry just moves
+static void inode_rekey(buffered_inode_t *ino, dev_t dev, ino_t inum) {
+    if (ino->born != 0) {
+        ino->born = file_born(ino->handles->fd);
     }
-    if (bf->write_buffer_pos == 0) {
-        return 0;
+    if (!ino->hashed) {
+        ino->dev = dev;
+        ino->ino = inum;
+        return;
     }
+    pthread_mutex_lock(&inodes_lock);
+    buffered_inode_t **entry = &inode_buckets[inode_bucket(ino->dev, ino->ino, num_buckets)];
+    while (*entry != ino) entry = &(*entry)->next;
+    *entry = ino->next;
+    ino->dev = dev;
+    ino->ino = inum;
+    size_t b = inode_bucket(dev, inum, num_buckets);
+    ino->next = inode_buckets[b];
+    inode_buckets[b] = ino;
+    pthread_mutex_unlock(&inodes_lock);
+}
 
-    size_t total_written = 0;
+//true when other handles in this process have the same file open
+static int shared(buffered_file_t *bf) {
+    return bf->inode != NULL && bf->inode->count > 1;
+}
 
-    if (bf->preappend) {// --- O_PREAPPEND LOGIC ---
-        off_t file_size = lseek(bf->fd, 0, SEEK_END);//get file size
-        if (file_size == -1) {
-            perror("buffered_flush: lseek end error");
-            return -1;
-        }
-        char *temp_buf = NULL;//alloc temp buf to hold content
-        if (file_size > 0) {
-            temp_buf = malloc(file_size);
-            if (!temp_buf) {
-                errno = ENOMEM;
-                perror("buffered_flush: memory allocation for preappend");
-                return -1;
-            }
-            if (lseek(bf->fd, 0, SEEK_SET) == -1) {//read content into temp buf
-                perror("buffered_flush: lseek set error");
-                free(temp_buf);
-                return -1;
-            }
-            ssize_t r = 0;
-            size_t total_read_temp = 0;
-            while (total_read_temp < file_size) {
-                r = read(bf->fd, temp_buf + total_read_temp, file_size - total_read_temp);
-                if (r <= 0) {
-                    perror("buffered_flush: error reading existing content");
-                    free(temp_buf);
-                    return -1;
-                }
-                total_read_temp += r;
+//[start, start + len) of bf's file was just written (len 0 = all of it, shifted or truncated):
+//the shared caches of the handles on it must not serve the old blocks to anyone
+static void cache_written(buffered_file_t *bf, off_t start, off_t len) {
+    if (bf->inode == NULL) return;
+    int sized = 0;
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s->cache) {
+            //a write that reached the end of file may have moved it past a hole, and the block that held
+            //the old end, cached short, can be in any region before start
+            struct stat st;
+            if (len > 0 && !sized++ && (fstat(bf->fd, &st) == -1 || start + len >= st.st_size)) {
+                len = 0;
             }
+            buffered_cache_invalidate(s->cache, bf->inode->dev, bf->inode->ino, start, len);
         }
-        if (lseek(bf->fd, 0, SEEK_SET) == -1) {//move to start to write new data
-            perror("buffered_flush: lseek rewind error");
-            free(temp_buf);
+    }
+}
+
+int buffered_set_cache(buffered_file_t *bf, struct buffered_cache *cache) {
+    if (bf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    if (cache != NULL && (bf->inode == NULL || bf->buffer_capacity < CACHE_BLOCK_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (cache != NULL && bf->inode->born == 0) {
+        bf->inode->born = file_born(bf->fd);
+        if (bf->inode->born == 0) {
             return -1;
         }
-        while (total_written < bf->write_buffer_pos) {//write buf content
-            ssize_t written = write(bf->fd, bf->write_buffer + total_written, bf->write_buffer_pos - total_written);
-            if (written == -1) {
-                if (errno == EINTR) continue;
-                perror("buffered_flush: write error (prepend)");
-                free(temp_buf);
-                return -1;
-            }
-            total_written += written;
-        }
-        if (file_size > 0 && temp_buf) {//append old content back
-            size_t written_old = 0;
-            while (written_old < file_size) {
-                ssize_t w = write(bf->fd, temp_buf + written_old, file_size - written_old);
-                if (w == -1) {
-                    if (errno == EINTR) continue;
-                    perror("buffered_flush: write error (restoring old data)");
-                    free(temp_buf);
-                    return -1;
-                }
-                written_old += w;
-            }
-            free(temp_buf);
-        }
-        if (lseek(bf->fd, bf->file_offset + total_written, SEEK_SET) == -1) {//restore fd to correct logical position
-             perror("buffered_flush: lseek restore error");
-             return -1;
+    }
+    bf->cache = cache;
+    //a writer may have truncated the file when it opened it
+    if (cache != NULL && (bf->flags & O_ACCMODE) != O_RDONLY) {
+        cache_written(bf, 0, 0);
+    }
+    return 0;
+}
+
+//fd is set: find out whether it can seek and finish the mode specific setup
+static int buffered_attach(buffered_file_t *bf, int flags) {
+    //pipes, sockets and ttys have no offsets, they are read and written as streams
+    off_t pos = lseek(bf->fd, 0, SEEK_CUR);
+    if (pos == (off_t)-1) {
+        bf->seekable = 0;
+        bf->append = 0;
+        if (flags & (O_PREAPPEND | O_MMAPWRITE)) {
+            errno = ESPIPE;
+            note_error(NULL, BUFFERED_OP_OPEN, -1, "O_PREAPPEND/O_MMAPWRITE need a seekable file");
+            return -1;
         }
-    } 
-    else {
-        while (total_written < bf->write_buffer_pos) {
-            ssize_t written = write(bf->fd, bf->write_buffer + total_written, bf->write_buffer_pos - total_written);
-            if (written == -1) {
-                if (errno == EINTR) continue; 
-                perror("buffered_flush: write error"); 
+    } else {
+        bf->file_offset = pos;
+        bf->read_buffer_offset = pos;
+        bf->write_buffer_offset = pos;
+    }
+    //map the file for the mmap write mode
+    if ((flags & O_MMAPWRITE) && mmap_setup(bf) == -1) {
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "mmap setup error");
+        return -1;
+    }
+    //a stream's two directions are independent and unread input cannot be dropped, so it keeps two
+    //buffers of its own; the mapping needs none
+    if (bf->lowmem && (!bf->seekable || bf->map)) {
+        bf->lowmem = 0;
+        if (!bf->map) {
+            bf->read_buffer = malloc(bf->buffer_capacity);
+            bf->write_buffer = malloc(bf->buffer_capacity);
+            if (bf->read_buffer == NULL || bf->write_buffer == NULL) {
+                errno = ENOMEM;
+                note_error(NULL, BUFFERED_OP_OPEN, -1, "memory allocation error");
                 return -1;
             }
-            total_written += written;
+            bf->write_buffer_size = bf->buffer_capacity;
         }
     }
-    bf->file_offset += total_written;
-    bf->write_buffer_pos = 0;//clear buffer
-    
+    //the mapping already shares the page cache, the buffered modes join the file's registry entry
+    if (bf->seekable && bf->map == NULL && inode_register(bf) == -1) {
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "inode registry error");
+        return -1;
+    }
     return 0;
 }
 
-int buffered_close(buffered_file_t *bf) {
-    if (bf == NULL) return 0;
-    int flush_res = 0;
-    int close_res = 0;
+buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
+    // 1.handle mode argument for O_CREAT/O_TMPFILE
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    // 2.allocate and initialize the handle
+    buffered_file_t *bf = buffered_alloc(flags);
+    if (bf == NULL) {
+        return NULL;
+    }
 
-    //flush pending writes
-    if (bf->write_buffer_pos > 0) { 
-        flush_res = buffered_flush(bf);
+    // 3.open file 
+    bf->fd = open(pathname, bf->flags, mode); 
+    if (bf->fd == -1) {
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "open error");
+        buffered_free(bf);
+        return NULL;
     }
-    close_res = close(bf->fd);
-    if (close_res == -1) {
-        perror("buffered_close: file close error");
+
+    //remembered for transactions, which publish by renaming over it
+    if ((flags & O_TMPFILE) != O_TMPFILE) {
+        bf->path = strdup(pathname);
     }
-    
-    free(bf->read_buffer); 
-    free(bf->write_buffer);
-    free(bf);
 
-    if (flush_res == -1 || close_res == -1) {
+    // 4.mode specific setup
+    if (buffered_attach(bf, flags) == -1) {
+        int saved = errno;
+        close(bf->fd);
+        buffered_free(bf);
+        errno = saved;
+        return NULL;
+    }
+    if (buffered_trace_on) {
+        struct stat st;
+        BUFFERED_TRACE(TRACE_OPEN, bf->trace_id, fstat(bf->fd, &st) == 0 ? (off_t)st.st_ino : -1, flags, bf->fd);
+    }
+    return bf;
+}
+
+buffered_file_t *buffered_open_fd(int fd, int flags) {
+    int status = fcntl(fd, F_GETFL);
+    if (status == -1) {
+        note_error(NULL, BUFFERED_OP_OPEN, -1, "invalid file descriptor");
+        return NULL;
+    }
+    buffered_file_t *bf = buffered_alloc(status | (flags & BUFFERED_OWN_FLAGS));
+    if (bf == NULL) {
+        return NULL;
+    }
+    bf->fd = fd;
+    if (buffered_attach(bf, flags) == -1) {
+        buffered_free(bf);
+        return NULL;
+    }
+    if (buffered_trace_on) {
+        struct stat st;
+        BUFFERED_TRACE(TRACE_OPEN, bf->trace_id, fstat(fd, &st) == 0 ? (off_t)st.st_ino : -1,
+                       status | (flags & BUFFERED_OWN_FLAGS), fd);
+    }
+    return bf;
+}
+
+//round up to the next multiple of the mmap growth chunk, never below one chunk
+static size_t mmap_round_up(off_t size) {
+    size_t chunks = (size + MMAP_CHUNK_SIZE - 1) / MMAP_CHUNK_SIZE;
+    return (chunks > 0 ? chunks : 1) * (size_t)MMAP_CHUNK_SIZE;
+}
+
+//make sure the file has real blocks up to length, so stores through the mapping never SIGBUS
+static int mmap_preallocate(buffered_file_t *bf, size_t length) {
+    int res;
+    do {
+        res = fallocate(bf->fd, 0, 0, length);
+    } while (res == -1 && errno == EINTR);
+    if (res == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        res = ftruncate(bf->fd, length);//filesystem without fallocate, a sparse extension will do
+    }
+    return res;
+}
+
+static int mmap_setup(buffered_file_t *bf) {
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1) {
         return -1;
     }
+    bf->logical_size = st.st_size;
+    bf->map_size = mmap_round_up(st.st_size);
+    if (mmap_preallocate(bf, bf->map_size) == -1) {
+        return -1;
+    }
+    void *map = mmap(NULL, bf->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, bf->fd, 0);
+    if (map == MAP_FAILED) {
+        ftruncate(bf->fd, bf->logical_size);
+        return -1;
+    }
+    bf->map = map;
+    bf->write_buffer_size = 0;//nothing is staged in write_buffer in this mode
     return 0;
-}
\ No newline at end of file
+}
+
+//grow the preallocation and the mapping so that [0, needed) is addressable
+static int mmap_grow(buffered_file_t *bf, off_t needed) {
+    size_t new_size = mmap_round_up(needed);
+    if (mmap_preallocate(bf, new_size) == -1) {
+        return -1;
+    }
+    void *map = mremap(bf->map, bf->map_size, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    bf->map = map;
+    bf->map_size = new_size;
+    return 0;
+}
+
+static ssize_t mmap_write(buffered_file_t *bf, const char *src, size_t count) {
+    off_t end = bf->file_offset + (off_t)count;
+    if ((size_t)end > bf->map_size && mmap_grow(bf, end) == -1) {
+        note_error(bf, BUFFERED_OP_WRITE, bf->file_offset, "mmap grow error");
+        return -1;
+    }
+    memcpy(bf->map + bf->file_offset, src, count);
+    if (bf->dirty_start == bf->dirty_end) {
+        bf->dirty_start = bf->file_offset;
+        bf->dirty_end = end;
+    } else {
+        if (bf->file_offset < bf->dirty_start) bf->dirty_start = bf->file_offset;
+        if (end > bf->dirty_end) bf->dirty_end = end;
+    }
+    bf->file_offset = end;
+    if (end > bf->logical_size) {
+        bf->logical_size = end;
+    }
+    bf->last_operation = 2; // 2 = Write
+    return (ssize_t)count;
+}
+
+static ssize_t mmap_read(buffered_file_t *bf, char *dest, size_t count) {
+    bf->last_operation = 1; // 1 = Read
+    if (bf->file_offset >= bf->logical_size) {
+        return 0;//end of file
+    }
+    size_t available = bf->logical_size - bf->file_offset;
+    size_t to_copy = count < available ? count : available;
+    memcpy(dest, bf->map + bf->file_offset, to_copy);
+    bf->file_offset += to_copy;
+    return (ssize_t)to_copy;
+}
+
+//the data is already in the page cache, so a flush just kicks writeback for the dirty pages,
+//which is what a write() would have given us too
+static int mmap_flush(buffered_file_t *bf) {
+    if (bf->dirty_start == bf->dirty_end) {
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = bf->dirty_start - bf->dirty_start % page;
+    int synced = msync(bf->map + start, bf->dirty_end - start, MS_ASYNC);
+    BUFFERED_TRACE(TRACE_SYS_MSYNC, bf->trace_id, start, bf->dirty_end - start, synced);
+    if (synced == -1) {
+        note_error(bf, BUFFERED_OP_FLUSH, start, "msync error");
+        return -1;
+    }
+    bf->dirty_start = bf->dirty_end = 0;
+    return 0;
+}
+
+//unmap and cut the preallocated tail off, leaving the file at its logical size
+static int mmap_teardown(buffered_file_t *bf) {
+    int res = mmap_flush(bf);
+    if (munmap(bf->map, bf->map_size) == -1) {
+        note_error(bf, BUFFERED_OP_CLOSE, -1, "munmap error");
+        res = -1;
+    }
+    bf->map = NULL;
+    if (ftruncate(bf->fd, bf->logical_size) == -1) {
+        note_error(bf, BUFFERED_OP_CLOSE, bf->logical_size, "ftruncate to logical size error");
+        res = -1;
+    }
+    return res;
+}
+
+//keep the cached read window coherent with bytes written at [offset, offset + len)
+static void patch_read_window(buffered_file_t *bf, off_t offset, const char *src, size_t len) {
+    off_t win_start = bf->read_buffer_offset;
+    off_t win_end = win_start + (off_t)bf->read_buffer_size;
+    off_t start = offset > win_start ? offset : win_start;
+    off_t end = offset + (off_t)len < win_end ? offset + (off_t)len : win_end;
+    if (start < end) {
+        memcpy(bf->read_buffer + (start - win_start), src + (start - offset), end - start);
+    }
+}
+
+//re-derive read_buffer_pos after file_offset moved outside buffered_read
+static void sync_read_pos(buffered_file_t *bf) {
+    off_t rel = bf->file_offset - bf->read_buffer_offset;
+    if (rel >= 0 && rel <= (off_t)bf->read_buffer_size) {
+        bf->read_buffer_pos = rel;
+    } else if (rel > (off_t)bf->read_buffer_size) {
+        bf->read_buffer_pos = bf->read_buffer_size;//cursor is past the window, next read refills
+    } else {
+        bf->read_buffer_size = 0;//cursor is before the window, drop it
+        bf->read_buffer_pos = 0;
+        bf->read_buffer_offset = bf->file_offset;
+    }
+}
+
+//drop the cached read window, used when a flush moved data around underneath it
+static void invalidate_read_window(buffered_file_t *bf) {
+    bf->read_buffer_size = 0;
+    bf->read_buffer_pos = 0;
+    bf->read_buffer_offset = bf->file_offset;
+}
+
+//an O_LOWMEM handle uses its one buffer for a direction at a time: a write drops the read window, which
+//holds nothing the file does not, and a refill first flushes the pending run. Borrows the buffer if needed
+static int pool_take(buffered_file_t *bf, int writing) {
+    if (writing) {
+        if (bf->read_buffer_size > 0) {
+            invalidate_read_window(bf);
+        }
+    } else if (bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (bf->read_buffer != NULL) {
+        return 0;
+    }
+    char *buf = pool_get(bf->buffer_capacity);
+    if (buf == NULL) {
+        note_error(bf, writing ? BUFFERED_OP_WRITE : BUFFERED_OP_READ, bf->file_offset,
+                   errno == ENOBUFS ? "buffer pool at its limit" : "memory allocation error");
+        return -1;
+    }
+    bf->read_buffer = buf;
+    bf->write_buffer = buf;
+    bf->write_buffer_size = write_limit(bf);
+    return 0;
+}
+
+//an O_LOWMEM handle with nothing pending and nothing left to read gives its buffer back
+static void pool_idle(buffered_file_t *bf) {
+    if (!bf->lowmem || bf->read_buffer == NULL || bf->write_buffer_pos > 0 ||
+        bf->read_buffer_pos < bf->read_buffer_size) {
+        return;
+    }
+    pool_put(bf->read_buffer, bf->buffer_capacity);
+    bf->read_buffer = NULL;
+    bf->write_buffer = NULL;
+    bf->write_buffer_size = 0;//keeps buffered_putc off its fast path until the next write borrows again
+    invalidate_read_window(bf);
+    bf->last_operation = 0;
+}
+
+//write a whole buffer to fd with plain write(), retrying on EINTR and short writes
+static int write_fully(int fd, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t written = write(fd, buf + total, len - total);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += written;
+    }
+    return 0;
+}
+
+//one blocking OFD lock request, OFD locks belong to the open file description so they work
+//between threads and processes alike and the kernel drops them if the holder dies
+static int ofd_setlk(int fd, short type, off_t start, off_t len, int wait) {
+    struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = start, .l_len = len};
+    int res;
+    do {
+        res = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (res == -1 && errno == EINTR);
+    return res;
+}
+
+//len 0 would reach the gate byte, so "to end of file" stops just before it
+static off_t lock_len(off_t start, off_t len) {
+    return len == 0 ? LOCK_GATE_OFFSET - start : len;
+}
+
+//writer preference: both sides pass the gate byte first, a writer keeps it until it owns its
+//range, so readers arriving behind a waiting writer queue up instead of starving it
+static int range_lock(buffered_file_t *bf, int type, off_t start, off_t len) {
+    short gate = type == BUFFERED_LOCK_EXCLUSIVE ? F_WRLCK : F_RDLCK;
+    if (ofd_setlk(bf->fd, gate, LOCK_GATE_OFFSET, 1, 1) == -1) {
+        return -1;
+    }
+    int res = ofd_setlk(bf->fd, type == BUFFERED_LOCK_EXCLUSIVE ? F_WRLCK : F_RDLCK, start, lock_len(start, len), 1);
+    int saved = errno;
+    ofd_setlk(bf->fd, F_UNLCK, LOCK_GATE_OFFSET, 1, 0);
+    errno = saved;
+    return res;
+}
+
+static int range_unlock(buffered_file_t *bf, off_t start, off_t len) {
+    return ofd_setlk(bf->fd, F_UNLCK, start, lock_len(start, len), 0);
+}
+
+static int lock_call(buffered_file_t *bf, int type, off_t start, off_t len) {
+    if (bf == NULL || bf->fd == -1 || start < 0 || len < 0 ||
+        (type != BUFFERED_LOCK_SHARED && type != BUFFERED_LOCK_EXCLUSIVE)) {
+        errno = EINVAL;
+        note_error(bf, BUFFERED_OP_LOCK, start, "invalid arguments");
+        return -1;
+    }
+    //data we cached or staged may be older than what the lock protects
+    if (type == BUFFERED_LOCK_EXCLUSIVE && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (range_lock(bf, type, start, len) == -1) {
+        note_error(bf, BUFFERED_OP_LOCK, start, "fcntl error");
+        return -1;
+    }
+    invalidate_read_window(bf);//whatever we cached was read without this lock
+    bf->held_locks++;
+    return 0;
+}
+
+static int unlock_call(buffered_file_t *bf, off_t start, off_t len) {
+    if (bf == NULL || bf->fd == -1 || start < 0 || len < 0) {
+        errno = EINVAL;
+        note_error(bf, BUFFERED_OP_LOCK, start, "invalid arguments");
+        return -1;
+    }
+    //writes made under the lock must be in the file before anybody else can get in
+    if (buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (range_unlock(bf, start, len) == -1) {
+        note_error(bf, BUFFERED_OP_LOCK, start, "fcntl error (unlock)");
+        return -1;
+    }
+    if (bf->held_locks > 0) bf->held_locks--;
+    return 0;
+}
+
+//automatic locking only applies with O_RANGELOCK and while the caller holds no explicit
+//range, unlocking ours would otherwise cut a hole into theirs
+static int auto_locking(buffered_file_t *bf) {
+    return bf->range_lock && bf->held_locks == 0 && bf->seekable;
+}
+
+//a pattern has to hold for this many refills in a row before the kernel hears about it
+#define HINT_CONFIRM_REFILLS 3
+
+enum { ACCESS_UNKNOWN, ACCESS_SEQUENTIAL, ACCESS_STRIDED, ACCESS_RANDOM };
+
+//classify the refill about to happen at offset and keep the kernel's readahead in step with it.
+//runs before the window is replaced, so read_buffer_offset/size still describe the previous refill
+static void hint_refill(buffered_file_t *bf, off_t offset) {
+    int candidate = ACCESS_RANDOM;
+    off_t stride = bf->access_last == -1 ? 0 : offset - bf->access_last;
+    if (bf->read_buffer_size > 0 && offset == bf->read_buffer_offset + (off_t)bf->read_buffer_size) {
+        candidate = ACCESS_SEQUENTIAL;
+    } else if (stride != 0 && stride == bf->access_stride) {
+        candidate = ACCESS_STRIDED;
+    }
+    bf->access_run = candidate == bf->access_candidate ? bf->access_run + 1 : 1;
+    bf->access_candidate = candidate;
+    bf->access_stride = stride;
+    bf->access_last = offset;
+
+    if (bf->access_run >= HINT_CONFIRM_REFILLS && bf->access_pattern != candidate) {
+        //SEQUENTIAL doubles the kernel's own readahead, RANDOM switches it off
+        int advice = candidate == ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL :
+                     candidate == ACCESS_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL;
+        posix_fadvise(bf->fd, 0, 0, advice);
+        bf->access_pattern = candidate;
+        bf->readahead_end = offset;
+        if (candidate == ACCESS_STRIDED) {//prefetch the blocks the next refills will ask for
+            for (int i = 1; i < HINT_STRIDE_DEPTH; i++) {
+                if (offset + stride * i >= 0) {
+                    posix_fadvise(bf->fd, offset + stride * i, bf->buffer_capacity, POSIX_FADV_WILLNEED);
+                }
+            }
+        }
+    }
+    if (bf->access_pattern == ACCESS_SEQUENTIAL && candidate == ACCESS_SEQUENTIAL) {
+        //stay a full window ahead of the reader, topping up once half of it was consumed
+        if (bf->readahead_end < offset + HINT_READAHEAD_SIZE / 2) {
+            off_t start = bf->readahead_end > offset ? bf->readahead_end : offset;
+            readahead(bf->fd, start, offset + HINT_READAHEAD_SIZE - start);
+            bf->readahead_end = offset + HINT_READAHEAD_SIZE;
+        }
+    } else if (bf->access_pattern == ACCESS_STRIDED && candidate == ACCESS_STRIDED) {
+        off_t ahead = offset + stride * (HINT_STRIDE_DEPTH - 1);
+        if (ahead >= 0) {
+            posix_fadvise(bf->fd, ahead, bf->buffer_capacity, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+//a positional flush wrote [start, start + len): once a writer has streamed forward for HINT_CONFIRM_REFILLS
+//chunks, start writeback of each finished chunk and drop the ones two chunks behind from the page cache.
+//Neither call waits for the disk, DONTNEED just leaves pages still under writeback where they are
+static void hint_written(buffered_file_t *bf, off_t start, size_t len) {
+    //the stream continues anywhere inside the chunk still being filled, elsewhere it starts over
+    if (start < bf->writeback_end || start > bf->writeback_end + HINT_WRITEBACK_CHUNK) {
+        bf->writeback_end = start;
+        bf->dontneed_start = start;
+    }
+    off_t end = start + (off_t)len;
+    while (end - bf->writeback_end >= HINT_WRITEBACK_CHUNK) {
+        bf->writeback_end += HINT_WRITEBACK_CHUNK;
+        //until then dontneed_start is where the stream began, short and scattered writers never get past this
+        if (bf->writeback_end - bf->dontneed_start < HINT_CONFIRM_REFILLS * HINT_WRITEBACK_CHUNK) continue;
+        sync_file_range(bf->fd, bf->writeback_end - HINT_WRITEBACK_CHUNK, HINT_WRITEBACK_CHUNK, SYNC_FILE_RANGE_WRITE);
+        while (bf->writeback_end - bf->dontneed_start > 2 * HINT_WRITEBACK_CHUNK) {
+            posix_fadvise(bf->fd, bf->dontneed_start, HINT_WRITEBACK_CHUNK, POSIX_FADV_DONTNEED);
+            bf->dontneed_start += HINT_WRITEBACK_CHUNK;
+        }
+    }
+}
+
+//fill the read buffer from [at, at + span) block by block out of the shared cache, pread the rest
+//from the first missing block to the end of its region in one call and offer what it brought back
+//to the cache, then go on with the next region the same way
+static ssize_t cache_refill(buffered_file_t *bf, off_t at, size_t span) {
+    dev_t dev = bf->inode->dev;
+    ino_t ino = bf->inode->ino;
+    uint64_t born = bf->inode->born;
+    size_t total = 0;
+    while (total < span) {
+        off_t block = (at + (off_t)total) / CACHE_BLOCK_SIZE;
+        ssize_t len = buffered_cache_lookup(bf->cache, dev, ino, born, block, bf->read_buffer + total);
+        if (len >= 0) {
+            total += len;
+            if (len < CACHE_BLOCK_SIZE) break;//the end of file
+            continue;
+        }
+        //regions are versioned independently, so one version only vouches for the blocks of its own region
+        off_t region_end = ((at + (off_t)total) / CACHE_REGION_SIZE + 1) * CACHE_REGION_SIZE;
+        size_t want = span - total;
+        if ((off_t)want > region_end - (at + (off_t)total)) {
+            want = region_end - (at + (off_t)total);
+        }
+        cache_version_t version = buffered_cache_version(bf->cache, dev, ino, block);
+        ssize_t bytes_read;
+        do {
+            bytes_read = pread(bf->fd, bf->read_buffer + total, want, at + total);
+            BUFFERED_TRACE(TRACE_SYS_PREAD, bf->trace_id, at + total, want, bytes_read);
+        } while (bytes_read == -1 && errno == EINTR);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        for (size_t done = 0; done < (size_t)bytes_read || done == 0; done += CACHE_BLOCK_SIZE) {
+            size_t len = (size_t)bytes_read - done < CACHE_BLOCK_SIZE ? (size_t)bytes_read - done : CACHE_BLOCK_SIZE;
+            buffered_cache_insert(bf->cache, dev, ino, born, block + done / CACHE_BLOCK_SIZE, version,
+                                  bf->read_buffer + total + done, len);
+            if (len < CACHE_BLOCK_SIZE) break;
+        }
+        total += bytes_read;
+        if ((size_t)bytes_read < want) break;//the end of file
+    }
+    return total;
+}
+
+//refill the read window at the logical offset, positional so the fd cursor never matters.
+//With a shared cache the window starts at the block holding the offset and covers whole blocks
+static ssize_t refill_read_buffer(buffered_file_t *bf) {
+    ssize_t bytes_read;
+    off_t at = bf->file_offset;
+    size_t span = bf->buffer_capacity;
+    if (bf->cache) {
+        at -= at % CACHE_BLOCK_SIZE;
+        span -= span % CACHE_BLOCK_SIZE;
+    }
+    int locked = auto_locking(bf);
+    if (locked && range_lock(bf, BUFFERED_LOCK_SHARED, at, span) == -1) {
+        return -1;
+    }
+    if (bf->seekable && bf->hints) {
+        hint_refill(bf, bf->file_offset);
+    }
+    if (bf->cache) {
+        bytes_read = cache_refill(bf, at, span);
+    } else {
+        do {
+            bytes_read = bf->seekable ? pread(bf->fd, bf->read_buffer, span, at)
+                                      : read(bf->fd, bf->read_buffer, span);
+            BUFFERED_TRACE(bf->seekable ? TRACE_SYS_PREAD : TRACE_SYS_READ, bf->trace_id, at, span, bytes_read);
+        } while (bytes_read == -1 && errno == EINTR);
+    }
+    if (locked) {
+        int saved = errno;
+        range_unlock(bf, at, span);
+        errno = saved;
+    }
+    if (bytes_read < 0) {
+        return -1;
+    }
+    bf->read_buffer_offset = at;
+    bf->read_buffer_size = bytes_read;
+    bf->read_buffer_pos = bf->file_offset - at;
+    if (bf->read_buffer_pos > bf->read_buffer_size) {
+        bf->read_buffer_pos = bf->read_buffer_size;//the file ends before the offset
+    }
+    return bf->read_buffer_size - bf->read_buffer_pos;
+}
+
+static ssize_t read_call(buffered_file_t *bf, void *buf, size_t count) {
+    if (bf == NULL || buf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        note_error(bf, BUFFERED_OP_READ, -1, "invalid buffered_file_t or buffer");
+        return -1;
+    }
+    if (count == 0) return 0;
+    if (bf->map) {
+        return mmap_read(bf, buf, count);
+    }
+    //other handles on the file may hold writes this one has to see
+    if (shared(bf)) {
+        group_enter(bf);
+        if (group_pending(bf) && group_flush(bf) == -1) {
+            return -1;
+        }
+    }
+    
+    //pre-appended and appended data never patch the window, so they still need a flush first
+    if (bf->write_buffer_pos > 0 && (bf->preappend || bf->append)) {
+        if (buffered_flush(bf) == -1) {
+            return -1;
+        }
+    }
+    //after appending the cursor sits at the end of file, which only the kernel knows
+    if (bf->offset_stale) {
+        struct stat st;
+        if (fstat(bf->fd, &st) == -1) {
+            note_error(bf, BUFFERED_OP_READ, -1, "fstat error");
+            return -1;
+        }
+        bf->file_offset = st.st_size;
+        bf->offset_stale = 0;
+        sync_read_pos(bf);
+    }
+    bf->last_operation = 1; // 1 = Read
+
+    size_t total_read = 0;
+    char *dest = (char *)buf;
+
+    while (total_read < count) {
+        size_t in_buffer = bf->read_buffer_size - bf->read_buffer_pos;
+        
+        //refill buffer if empty
+        if (in_buffer == 0) {
+            if (!bf->seekable && total_read > 0) {
+                return total_read;//a stream returns what it has rather than blocking for more
+            }
+            //pending writes have to reach the file before we pull fresh data from it,
+            //a stream's two directions are independent so it skips this
+            if (bf->seekable && bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+                return total_read > 0 ? (ssize_t)total_read : -1;
+            }
+            if (bf->lowmem && pool_take(bf, 0) == -1) {
+                return total_read > 0 ? (ssize_t)total_read : -1;
+            }
+            ssize_t bytes_read = refill_read_buffer(bf);
+
+            if (bytes_read == 0) {
+                //end of file
+                return total_read;
+            }
+            if (bytes_read < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    note_error(bf, BUFFERED_OP_READ, bf->file_offset, "read error");
+                }
+                return total_read > 0 ? (ssize_t)total_read : -1;
+            }
+            in_buffer = bytes_read; 
+        }
+        size_t bytes_needed = count - total_read;
+        size_t to_copy = (bytes_needed < in_buffer) ? bytes_needed : in_buffer;     
+        memcpy(dest + total_read, bf->read_buffer + bf->read_buffer_pos, to_copy);
+        bf->read_buffer_pos += to_copy;
+        total_read += to_copy;
+        bf->file_offset += to_copy; 
+    }
+
+    return (ssize_t)total_read;
+}
+
+static off_t seek_call(buffered_file_t *bf, off_t offset, int whence) {
+    if (bf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!bf->seekable) {
+        errno = ESPIPE;
+        return -1;
+    }
+    //where appended and prepended data lands is only known once it is written
+    if ((bf->append || bf->preappend) && bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    off_t base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR && !bf->offset_stale) {
+        base = bf->file_offset;
+    } else if (whence == SEEK_END || whence == SEEK_CUR) {//after appending the cursor is the end of file
+        if (bf->map) {
+            base = bf->logical_size;
+        } else {
+            //runs pending on the other handles on the file may extend it
+            if (shared(bf) && group_pending(bf) && group_flush(bf) == -1) {
+                return -1;
+            }
+            struct stat st;
+            if (fstat(bf->fd, &st) == -1) {
+                return -1;
+            }
+            base = st.st_size;
+            //a pending positional run may already reach past the end the kernel knows about
+            if (bf->write_buffer_pos > 0 && bf->write_buffer_offset + (off_t)bf->write_buffer_pos > base) {
+                base = bf->write_buffer_offset + (off_t)bf->write_buffer_pos;
+            }
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset < 0 ? base < -offset : base > LLONG_MAX - offset) {
+        errno = offset < 0 ? EINVAL : EOVERFLOW;
+        return -1;
+    }
+    bf->file_offset = base + offset;
+    bf->offset_stale = 0;
+    sync_read_pos(bf);
+    //the putc fast path assumes the cursor sits at the end of the pending run
+    if (bf->last_operation == 2) {
+        bf->last_operation = 0;
+    }
+    return bf->file_offset;
+}
+
+//append mode: the buffer only ever holds whole records, so every flush is a run of complete
+//records in a single write() and O_APPEND keeps it from interleaving with other appenders
+static ssize_t append_record(buffered_file_t *bf, const char *src, size_t count) {
+    bf->last_operation = 2; // 2 = Write
+    bf->offset_stale = 1;
+    invalidate_read_window(bf);
+
+    if (count > bf->write_buffer_size - bf->write_buffer_pos && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (count > bf->write_buffer_size) {
+        //record bigger than the buffer, hand it to the kernel in one piece
+        int res = write_fully(bf->fd, src, count);
+        BUFFERED_TRACE(TRACE_SYS_WRITE, bf->trace_id, -1, count, res == -1 ? -1 : (ssize_t)count);
+        if (res == -1) {
+            note_error(bf, BUFFERED_OP_WRITE, -1, "write error (append)");
+            return -1;
+        }
+        return (ssize_t)count;
+    }
+    memcpy(bf->write_buffer + bf->write_buffer_pos, src, count);
+    bf->write_buffer_pos += count;
+    return (ssize_t)count;
+}
+
+//pipes and sockets: no offsets and no read window to patch, and with O_NONBLOCK a full pipe
+//gives back a short count (or -1/EAGAIN) instead of blocking
+static ssize_t stream_write(buffered_file_t *bf, const char *src, size_t count) {
+    bf->last_operation = 2; // 2 = Write
+    size_t total_written = 0;
+    while (total_written < count) {
+        size_t space_left = bf->write_buffer_size - bf->write_buffer_pos;
+        if (space_left == 0) {
+            if (buffered_flush(bf) == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    break;
+                }
+                if (bf->write_buffer_pos == bf->write_buffer_size) {
+                    break;//the peer took nothing, report what we buffered so far
+                }
+            }
+            space_left = bf->write_buffer_size - bf->write_buffer_pos;
+        }
+        size_t to_copy = count - total_written < space_left ? count - total_written : space_left;
+        memcpy(bf->write_buffer + bf->write_buffer_pos, src + total_written, to_copy);
+        bf->write_buffer_pos += to_copy;
+        total_written += to_copy;
+    }
+    if (total_written == 0) {
+        return -1;
+    }
+    return (ssize_t)total_written;
+}
+
+static ssize_t write_call(buffered_file_t *bf, const void *buf, size_t count) {
+    if (bf == NULL || buf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        note_error(bf, BUFFERED_OP_WRITE, -1, "invalid buffered_file_t or buffer");
+        return -1;
+    }
+    if (count == 0) return 0;
+
+    if (bf->map) {
+        return mmap_write(bf, buf, count);
+    }
+    if (bf->txn && bf->txn->active) {
+        return txn_write(bf, buf, count);
+    }
+    if (bf->lowmem && pool_take(bf, 1) == -1) {
+        return -1;
+    }
+    if (bf->inode) {
+        if (bf->write_buffer_pos == 0) {
+            bf->write_seq = ++bf->inode->seq;
+        }
+        if (shared(bf)) {
+            group_enter(bf);
+        }
+    }
+    if (bf->append) {
+        return append_record(bf, buf, count);
+    }
+    if (!bf->seekable) {
+        return stream_write(bf, buf, count);
+    }
+
+    int positional = !bf->preappend;
+    if (positional) {
+        //the write buffer holds one contiguous run, a write elsewhere flushes the old run first
+        if (bf->write_buffer_pos > 0 && bf->write_buffer_offset + (off_t)bf->write_buffer_pos != bf->file_offset) {
+            if (buffered_flush(bf) == -1) {
+                return -1;
+            }
+        }
+        if (bf->write_buffer_pos == 0) {
+            bf->write_buffer_offset = bf->file_offset;
+            if (shared(bf) && group_flush_overlapping(bf) == -1) {
+                return -1;
+            }
+        }
+    }
+    bf->last_operation = 2; // 2 = Write
+
+    size_t total_written = 0;
+    const char *src = (const char *)buf;
+   
+    while (total_written < count) { 
+        size_t to_copy = count - total_written;
+        size_t space_left = bf->write_buffer_size - bf->write_buffer_pos;
+        
+        if (space_left == 0) {
+            //flush buffer if full
+            if (buffered_flush(bf) == -1) {
+                break;
+            }
+            space_left = bf->write_buffer_size;
+        }
+
+        if (to_copy > space_left) {
+            to_copy = space_left;
+        }
+        
+        memcpy(bf->write_buffer + bf->write_buffer_pos, src + total_written, to_copy);
+        if (positional) {
+            patch_read_window(bf, bf->file_offset, src + total_written, to_copy);
+        }
+        bf->write_buffer_pos += to_copy;
+        bf->file_offset += to_copy;
+        total_written += to_copy;
+    }
+    sync_read_pos(bf);
+
+    if (total_written == 0) {
+        return -1;
+    }
+    return (ssize_t)total_written;
+}
+
+//write front at the start of the file and the old content after it
+static int prepend_bytes(int fd, const char *front, size_t len) {
+    size_t total_written = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {//get file size
+        return -1;
+    }
+    off_t file_size = st.st_size;
+    char *temp_buf = NULL;//alloc temp buf to hold content
+    if (file_size > 0) {
+        temp_buf = malloc(file_size);
+        if (!temp_buf) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t r = 0;
+        off_t total_read_temp = 0;
+        while (total_read_temp < file_size) {//read content into temp buf
+            r = pread(fd, temp_buf + total_read_temp, file_size - total_read_temp, total_read_temp);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) {
+                free(temp_buf);
+                return -1;
+            }
+            total_read_temp += r;
+        }
+    }
+    while (total_written < len) {//write buf content at the start
+        ssize_t written = pwrite(fd, front + total_written, len - total_written, total_written);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            free(temp_buf);
+            return -1;
+        }
+        total_written += written;
+    }
+    if (file_size > 0 && temp_buf) {//append old content back
+        off_t written_old = 0;
+        while (written_old < file_size) {
+            ssize_t w = pwrite(fd, temp_buf + written_old, file_size - written_old, total_written + written_old);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                free(temp_buf);
+                return -1;
+            }
+            written_old += w;
+        }
+        free(temp_buf);
+    }
+    return 0;
+}
+
+//flush one handle's own write buffer, under an exclusive range lock with O_RANGELOCK
+static int flush_one(buffered_file_t *bf) {
+    if (bf->write_buffer_pos == 0) {
+        return 0;
+    }
+    if (!auto_locking(bf)) {
+        return flush_write_buffer(bf);
+    }
+
+    //appends and prepends touch the whole file, a positional flush only its own run
+    off_t lock_start = (bf->preappend || bf->append) ? 0 : bf->write_buffer_offset;
+    off_t lock_length = (bf->preappend || bf->append) ? 0 : (off_t)bf->write_buffer_pos;
+    if (range_lock(bf, BUFFERED_LOCK_EXCLUSIVE, lock_start, lock_length) == -1) {
+        note_error(bf, BUFFERED_OP_FLUSH, lock_start, "range lock error");
+        return -1;
+    }
+    int res = flush_write_buffer(bf);
+    range_unlock(bf, lock_start, lock_length);
+    return res;
+}
+
+//a handle of the group is about to read or write: the others go back through the slow paths,
+//where they see what this one did before trusting their windows or buffers again
+static void group_enter(buffered_file_t *bf) {
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s != bf) s->last_operation = 0;
+    }
+}
+
+static int group_pending(buffered_file_t *bf) {
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s->write_buffer_pos > 0) return 1;
+    }
+    return 0;
+}
+
+//bytes of bf's write buffer reached the file, the other handles' windows take them over
+static void group_patch_windows(buffered_file_t *bf, off_t offset, const char *src, size_t len) {
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s != bf) patch_read_window(s, offset, src, len);
+    }
+}
+
+static void group_invalidate_windows(buffered_file_t *bf) {
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        invalidate_read_window(s);
+    }
+}
+
+//bf starts a positional run: pending runs of other handles that could overlap it are flushed first,
+//so pending runs never overlap and the group flush can write them in any order
+static int group_flush_overlapping(buffered_file_t *bf) {
+    off_t start = bf->write_buffer_offset;
+    off_t end = start + (off_t)bf->write_buffer_size;
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s == bf || s->write_buffer_pos == 0 || s->preappend || s->append) continue;
+        if (s->write_buffer_offset < end && start < s->write_buffer_offset + (off_t)s->write_buffer_size &&
+            flush_one(s) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int by_write_offset(const void *a, const void *b) {
+    off_t x = (*(buffered_file_t *const *)a)->write_buffer_offset;
+    off_t y = (*(buffered_file_t *const *)b)->write_buffer_offset;
+    return (x > y) - (x < y);
+}
+
+static int by_newest_write(const void *a, const void *b) {
+    unsigned long x = (*(buffered_file_t *const *)a)->write_seq;
+    unsigned long y = (*(buffered_file_t *const *)b)->write_seq;
+    return (x < y) - (x > y);
+}
+
+//writev/pwritev the whole vector (offset -1 = plain writev), retrying on EINTR and short writes
+static int writev_fully(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        ssize_t written = offset == -1 ? writev(fd, iov, iovcnt) : pwritev(fd, iov, iovcnt, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (offset != -1) offset += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+//positional runs, sorted by offset: the ones that touch go out together in one pwritev
+static int group_flush_positional(buffered_file_t **runs, int n, struct iovec *iov) {
+    qsort(runs, n, sizeof(buffered_file_t *), by_write_offset);
+    int i = 0;
+    while (i < n) {
+        int j = i;
+        off_t end = runs[i]->write_buffer_offset;
+        while (j < n && j - i < IOV_MAX && runs[j]->write_buffer_offset == end) {
+            iov[j - i].iov_base = runs[j]->write_buffer;
+            iov[j - i].iov_len = runs[j]->write_buffer_pos;
+            end += runs[j]->write_buffer_pos;
+            j++;
+        }
+        int res = writev_fully(runs[i]->fd, iov, j - i, runs[i]->write_buffer_offset);
+        BUFFERED_TRACE(TRACE_SYS_PWRITEV, runs[i]->trace_id, runs[i]->write_buffer_offset,
+                       end - runs[i]->write_buffer_offset, res == -1 ? -1 : end - runs[i]->write_buffer_offset);
+        if (res == -1) {
+            note_error(runs[i], BUFFERED_OP_FLUSH, runs[i]->write_buffer_offset, "write error (group)");
+            return -1;
+        }
+        for (; i < j; i++) {
+            buffered_file_t *s = runs[i];
+            group_patch_windows(s, s->write_buffer_offset, s->write_buffer, s->write_buffer_pos);
+            cache_written(s, s->write_buffer_offset, s->write_buffer_pos);
+            if (s->hints) {
+                hint_written(s, s->write_buffer_offset, s->write_buffer_pos);
+            }
+            s->write_buffer_offset += s->write_buffer_pos;
+            s->write_buffer_pos = 0;
+        }
+    }
+    return 0;
+}
+
+//append records of every handle in one writev, O_APPEND keeps the batch together
+static int group_flush_append(buffered_file_t **runs, int n, struct iovec *iov) {
+    for (int i = 0; i < n; i += IOV_MAX) {
+        int cnt = n - i < IOV_MAX ? n - i : IOV_MAX;
+        for (int k = 0; k < cnt; k++) {
+            iov[k].iov_base = runs[i + k]->write_buffer;
+            iov[k].iov_len = runs[i + k]->write_buffer_pos;
+        }
+        size_t bytes = 0;
+        for (int k = 0; k < cnt; k++) bytes += iov[k].iov_len;
+        int res = writev_fully(runs[i]->fd, iov, cnt, -1);
+        BUFFERED_TRACE(TRACE_SYS_WRITEV, runs[i]->trace_id, -1, bytes, res == -1 ? -1 : (ssize_t)bytes);
+        if (res == -1) {
+            note_error(runs[i], BUFFERED_OP_FLUSH, -1, "write error (group append)");
+            return -1;
+        }
+        cache_written(runs[i], 0, 0);
+        for (int k = i; k < i + cnt; k++) {
+            runs[k]->write_buffer_offset += runs[k]->write_buffer_pos;
+            runs[k]->write_buffer_pos = 0;
+            runs[k]->offset_stale = 1;
+            invalidate_read_window(runs[k]);
+        }
+    }
+    return 0;
+}
+
+//all pending prepends in one rewrite of the file. Flushed one by one, each would land in front of
+//the ones before it, so the newest run comes first
+static int group_flush_prepend(buffered_file_t **runs, int n) {
+    qsort(runs, n, sizeof(buffered_file_t *), by_newest_write);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += runs[i]->write_buffer_pos;
+    char *front = malloc(total);
+    if (front == NULL) {
+        errno = ENOMEM;
+        note_error(runs[0], BUFFERED_OP_FLUSH, 0, "memory allocation for preappend");
+        return -1;
+    }
+    size_t at = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(front + at, runs[i]->write_buffer, runs[i]->write_buffer_pos);
+        at += runs[i]->write_buffer_pos;
+    }
+    int res = prepend_bytes(runs[0]->fd, front, total);
+    BUFFERED_TRACE(TRACE_SYS_PWRITE, runs[0]->trace_id, 0, total, res == -1 ? -1 : (ssize_t)total);
+    free(front);
+    if (res == -1) {
+        note_error(runs[0], BUFFERED_OP_FLUSH, 0, "write error (group prepend)");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        runs[i]->write_buffer_offset += runs[i]->write_buffer_pos;
+        runs[i]->write_buffer_pos = 0;
+    }
+    cache_written(runs[0], 0, 0);
+    group_invalidate_windows(runs[0]);//everything after the prepended bytes just shifted
+    return 0;
+}
+
+//flush the pending writes of every handle on bf's file: positional runs first, then appends, then prepends
+static int group_flush(buffered_file_t *bf) {
+    int count = bf->inode->count;
+    buffered_file_t **runs = malloc(3 * count * sizeof(buffered_file_t *));
+    struct iovec *iov = malloc((count < IOV_MAX ? count : IOV_MAX) * sizeof(struct iovec));
+    if (runs == NULL || iov == NULL) {
+        free(runs);
+        free(iov);
+        errno = ENOMEM;
+        note_error(bf, BUFFERED_OP_FLUSH, -1, "memory allocation for group flush");
+        return -1;
+    }
+    buffered_file_t **positional = runs, **append = runs + count, **prepend = runs + 2 * count;
+    int n_positional = 0, n_append = 0, n_prepend = 0, locking = 0;
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s->write_buffer_pos == 0) continue;
+        if (s->preappend) prepend[n_prepend++] = s;
+        else if (s->append) append[n_append++] = s;
+        else positional[n_positional++] = s;
+        locking |= auto_locking(s);
+    }
+    int res = 0;
+    if (locking) {
+        //every handle takes its own range lock, so they cannot be combined into one syscall
+        for (int i = 0; i < n_positional && res == 0; i++) res = flush_one(positional[i]);
+        for (int i = 0; i < n_append && res == 0; i++) res = flush_one(append[i]);
+        for (int i = 0; i < n_prepend && res == 0; i++) res = flush_one(prepend[i]);
+    } else {
+        if (n_positional > 0) res = group_flush_positional(positional, n_positional, iov);
+        if (res == 0 && n_append > 0) res = group_flush_append(append, n_append, iov);
+        if (res == 0 && n_prepend > 0) res = group_flush_prepend(prepend, n_prepend);
+    }
+    free(runs);
+    free(iov);
+    return res;
+}
+
+static int flush_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        note_error(bf, BUFFERED_OP_FLUSH, -1, "invalid file descriptor or pointer");
+        return -1;
+    }
+    if (bf->map) {
+        return mmap_flush(bf);
+    }
+    if (shared(bf)) {
+        return group_pending(bf) ? group_flush(bf) : 0;
+    }
+    return flush_one(bf);
+}
+
+//write out the pending write buffer according to the handle's mode
+static int flush_write_buffer(buffered_file_t *bf) {
+    size_t total_written = 0;
+
+    if (bf->preappend) {// --- O_PREAPPEND LOGIC ---
+        int res = prepend_bytes(bf->fd, bf->write_buffer, bf->write_buffer_pos);
+        BUFFERED_TRACE(TRACE_SYS_PWRITE, bf->trace_id, 0, bf->write_buffer_pos, res == -1 ? -1 : (ssize_t)bf->write_buffer_pos);
+        if (res == -1) {
+            note_error(bf, BUFFERED_OP_FLUSH, 0, "write error (prepend)");
+            return -1;
+        }
+        total_written = bf->write_buffer_pos;
+        cache_written(bf, 0, 0);
+        if (bf->inode) {
+            group_invalidate_windows(bf);//everything after the prepended bytes just shifted
+        } else {
+            invalidate_read_window(bf);
+        }
+    } 
+    else if (!bf->seekable) {
+        while (total_written < bf->write_buffer_pos) {
+            ssize_t written = write(bf->fd, bf->write_buffer + total_written, bf->write_buffer_pos - total_written);
+            BUFFERED_TRACE(TRACE_SYS_WRITE, bf->trace_id, -1, bf->write_buffer_pos - total_written, written);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                int saved = errno;
+                if (saved != EAGAIN && saved != EWOULDBLOCK) {
+                    note_error(bf, BUFFERED_OP_FLUSH, -1, "write error");
+                }
+                //keep what the peer did not take at the front of the buffer for the next try
+                memmove(bf->write_buffer, bf->write_buffer + total_written, bf->write_buffer_pos - total_written);
+                bf->write_buffer_pos -= total_written;
+                errno = saved;
+                return -1;
+            }
+            total_written += written;
+        }
+    }
+    else if (bf->append) {
+        //the kernel picks the offset, so plain write() and no lseek
+        int res = write_fully(bf->fd, bf->write_buffer, bf->write_buffer_pos);
+        BUFFERED_TRACE(TRACE_SYS_WRITE, bf->trace_id, -1, bf->write_buffer_pos, res == -1 ? -1 : (ssize_t)bf->write_buffer_pos);
+        if (res == -1) {
+            note_error(bf, BUFFERED_OP_FLUSH, -1, "write error (append)");
+            return -1;
+        }
+        total_written = bf->write_buffer_pos;
+        bf->offset_stale = 1;
+        cache_written(bf, 0, 0);
+        invalidate_read_window(bf);//the data landed at the end of file, wherever that was
+    }
+    else {
+        while (total_written < bf->write_buffer_pos) {
+            ssize_t written = pwrite(bf->fd, bf->write_buffer + total_written, bf->write_buffer_pos - total_written,
+                                     bf->write_buffer_offset + total_written);
+            BUFFERED_TRACE(TRACE_SYS_PWRITE, bf->trace_id, bf->write_buffer_offset + total_written,
+                           bf->write_buffer_pos - total_written, written);
+            if (written == -1) {
+                if (errno == EINTR) continue; 
+                note_error(bf, BUFFERED_OP_FLUSH, bf->write_buffer_offset + total_written, "write error");
+                return -1;
+            }
+            total_written += written;
+        }
+        if (bf->inode) {
+            group_patch_windows(bf, bf->write_buffer_offset, bf->write_buffer, total_written);
+            cache_written(bf, bf->write_buffer_offset, total_written);
+        }
+        if (bf->hints) {
+            hint_written(bf, bf->write_buffer_offset, total_written);
+        }
+    }
+    bf->write_buffer_offset += total_written;
+    bf->write_buffer_pos = 0;//clear buffer
+    
+    return 0;
+}
+
+static ssize_t fill_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->fd == -1 || bf->map) {
+        errno = EBADF;
+        return -1;
+    }
+    size_t in_buffer = bf->read_buffer_size - bf->read_buffer_pos;
+    if (in_buffer > 0) {
+        return (ssize_t)in_buffer;
+    }
+    if (bf->seekable && bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (bf->lowmem && pool_take(bf, 0) == -1) {
+        return -1;
+    }
+    bf->last_operation = 1; // 1 = Read
+    ssize_t res = refill_read_buffer(bf);
+    if (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        note_error(bf, BUFFERED_OP_READ, bf->file_offset, "read error");
+    }
+    return res;
+}
+
+int buffered_getc_slow(buffered_file_t *bf) {
+    unsigned char c;
+    return buffered_read(bf, &c, 1) == 1 ? c : -1;
+}
+
+int buffered_putc_slow(buffered_file_t *bf, int c) {
+    unsigned char byte = (unsigned char)c;
+    return buffered_write(bf, &byte, 1) == 1 ? byte : -1;
+}
+
+//only the byte right before the cursor can be pushed back, the window is a cache of the file
+//and must not start disagreeing with it
+int buffered_ungetc_slow(buffered_file_t *bf, int c) {
+    if (bf == NULL || c < 0) {
+        return -1;
+    }
+    if (bf->map && bf->file_offset > 0 && (unsigned char)bf->map[bf->file_offset - 1] == c) {
+        bf->file_offset--;
+        return c;
+    }
+    //off the fast path (a flush policy, another handle on the file) the window may still hold the byte;
+    //pending appended or prepended data is not in the window, so it cannot vouch for it then
+    if (!bf->map && !bf->offset_stale && bf->read_buffer_pos > 0 &&
+        bf->read_buffer_offset + (off_t)bf->read_buffer_pos == bf->file_offset &&
+        (unsigned char)bf->read_buffer[bf->read_buffer_pos - 1] == c &&
+        (bf->write_buffer_pos == 0 || !(bf->append || bf->preappend))) {
+        bf->read_buffer_pos--;
+        bf->file_offset--;
+        //the putc fast path assumes the cursor sits at the end of the pending run
+        if (bf->last_operation == 2) {
+            bf->last_operation = 0;
+        }
+        return c;
+    }
+    //an O_LOWMEM handle gave its buffer back once the read drained it, the byte is still in the file
+    if (bf->lowmem && bf->read_buffer == NULL && !bf->offset_stale && bf->file_offset > 0) {
+        unsigned char byte;
+        if (pread(bf->fd, &byte, 1, bf->file_offset - 1) == 1 && byte == c) {
+            bf->file_offset--;
+            invalidate_read_window(bf);
+            return c;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static void txn_free(struct buffered_txn *txn) {
+    if (txn == NULL) return;
+    free(txn->entries);
+    free(txn->data);
+    free(txn);
+}
+
+int buffered_set_commit_batch(buffered_file_t *bf, int batch) {
+    if (bf == NULL || batch < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bf->txn == NULL && (bf->txn = calloc(1, sizeof(struct buffered_txn))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    bf->txn->batch = batch;
+    return 0;
+}
+
+static int begin_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->fd == -1 || (bf->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    //publishing replaces the file by path, which streams, mappings and bare fds do not have
+    if (bf->path == NULL || !bf->seekable || bf->map) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((bf->txn && bf->txn->active) || bf->held_locks > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (bf->txn == NULL && buffered_set_commit_batch(bf, 1) == -1) {
+        return -1;
+    }
+    //writes made before the transaction go to the file as usual
+    if (buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (bf->offset_stale) {
+        buffered_seek(bf, 0, SEEK_END);
+    }
+    struct buffered_txn *txn = bf->txn;
+    txn->active = 1;
+    txn->begin_entries = txn->num_entries;
+    txn->begin_data = txn->data_len;
+    txn->begin_offset = bf->file_offset;
+    bf->last_operation = 0;
+    return 0;
+}
+
+//stage a write, merging it into the previous entry when it continues it
+static ssize_t txn_write(buffered_file_t *bf, const char *src, size_t count) {
+    struct buffered_txn *txn = bf->txn;
+    if (txn->data_len + count > txn->data_cap) {
+        size_t cap = txn->data_cap ? txn->data_cap : BUFFER_SIZE;
+        while (cap < txn->data_len + count) cap *= 2;
+        char *grown = realloc(txn->data, cap);
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        txn->data = grown;
+        txn->data_cap = cap;
+    }
+    txn_entry_t *last = txn->num_entries > txn->begin_entries ? &txn->entries[txn->num_entries - 1] : NULL;
+    int merge = last != NULL && (bf->append || bf->preappend || last->offset + (off_t)last->len == bf->file_offset);
+    if (!merge) {
+        if (txn->num_entries == txn->cap_entries) {
+            size_t cap = txn->cap_entries ? txn->cap_entries * 2 : 16;
+            txn_entry_t *grown = realloc(txn->entries, cap * sizeof(txn_entry_t));
+            if (grown == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            txn->entries = grown;
+            txn->cap_entries = cap;
+        }
+        last = &txn->entries[txn->num_entries++];
+        last->offset = bf->file_offset;
+        last->at = txn->data_len;
+        last->len = 0;
+    }
+    memcpy(txn->data + txn->data_len, src, count);
+    txn->data_len += count;
+    last->len += count;
+    if (!bf->append && !bf->preappend) {
+        bf->file_offset += count;
+        sync_read_pos(bf);
+    }
+    return (ssize_t)count;
+}
+
+static int abort_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->txn == NULL || !bf->txn->active) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buffered_txn *txn = bf->txn;
+    txn->num_entries = txn->begin_entries;
+    txn->data_len = txn->begin_data;
+    txn->active = 0;
+    bf->file_offset = txn->begin_offset;
+    sync_read_pos(bf);
+    return 0;
+}
+
+static int commit_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->txn == NULL || !bf->txn->active) {
+        errno = EINVAL;
+        return -1;
+    }
+    bf->txn->active = 0;
+    if (bf->txn->num_entries > bf->txn->begin_entries) {
+        bf->txn->commits++;
+    }
+    return bf->txn->commits >= bf->txn->batch ? buffered_publish(bf) : 0;
+}
+
+//copy len bytes of in from the start into out, in-kernel where the filesystem allows it
+static int copy_file(int in, int out, off_t len) {
+    off_t done = 0;
+    while (done < len) {
+        off_t in_off = done, out_off = done;
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, len - done, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            char buf[64 * 1024];
+            n = pread(in, buf, sizeof(buf) < (size_t)(len - done) ? sizeof(buf) : (size_t)(len - done), done);
+            //a short write carries on where it stopped rather than failing with a stale errno
+            struct iovec iov = { buf, n > 0 ? (size_t)n : 0 };
+            if (n > 0 && writev_fully(out, &iov, 1, done) == -1) return -1;
+        }
+        if (n <= 0) {
+            if (n == 0) errno = EIO;//the file shrank underneath us
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+//apply the staged writes to a copy of the file and rename the copy over the path
+static int txn_publish_copy(buffered_file_t *bf, struct buffered_txn *txn, size_t entries) {
+    //writes made outside the transaction, on this handle or on the other O_SHARED ones, belong in the copy
+    if (flush_call(bf) == -1) {
+        return -1;
+    }
+    //every handle on the file follows it to the copy, OFD locks on the old file would not come along
+    int siblings = bf->inode->count - 1;
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s != bf && s->held_locks > 0) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    struct stat st;
+    if (fstat(bf->fd, &st) == -1) {
+        return -1;
+    }
+    char *dir_copy = strdup(bf->path);
+    char *link_path = malloc(strlen(bf->path) + 64);
+    int *sibling_fds = malloc((siblings + 1) * sizeof(int));
+    if (dir_copy == NULL || link_path == NULL || sibling_fds == NULL) {
+        free(dir_copy);
+        free(link_path);
+        free(sibling_fds);
+        errno = ENOMEM;
+        return -1;
+    }
+    const char *dir = dirname(dir_copy);
+    int res = -1;
+    int dir_fd = -1;
+    int reopened = 0;
+    //an unnamed file in the same directory, so the rename stays on one filesystem
+    int tmp_fd = open(dir, O_TMPFILE | O_RDWR, st.st_mode & 07777);
+    if (tmp_fd == -1 || copy_file(bf->fd, tmp_fd, st.st_size) == -1) {
+        goto out;
+    }
+    off_t size = st.st_size;
+    for (size_t i = 0; i < entries; i++) {
+        txn_entry_t *e = &txn->entries[i];
+        const char *data = txn->data + e->at;
+        if (bf->preappend) {
+            if (prepend_bytes(tmp_fd, data, e->len) == -1) goto out;
+            size += e->len;
+            continue;
+        }
+        off_t at = bf->append ? size : e->offset;
+        for (size_t done = 0; done < e->len; ) {
+            ssize_t n = pwrite(tmp_fd, data + done, e->len - done, at + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                goto out;
+            }
+            done += n;
+        }
+        if (at + (off_t)e->len > size) size = at + e->len;
+    }
+    int synced = fsync(tmp_fd);
+    BUFFERED_TRACE(TRACE_SYS_FSYNC, bf->trace_id, 0, size, synced);
+    if (synced == -1) {
+        goto out;
+    }
+    struct stat copy_st;
+    if (fstat(tmp_fd, &copy_st) == -1) {
+        goto out;
+    }
+    //open the copy for the other handles now, past the rename nothing may fail any more
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", tmp_fd);
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s == bf) continue;
+        int fd = open(proc_path, s->flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_TMPFILE));
+        if (fd == -1) goto out;
+        sibling_fds[reopened++] = fd;
+    }
+    //give the copy a name next to the file, then atomically move it over the file; threads publishing at
+    //the same time each need a name of their own
+    static unsigned long publish_seq = 0;
+    sprintf(link_path, "%s.txn.%ld.%lu", bf->path, (long)getpid(), __atomic_add_fetch(&publish_seq, 1, __ATOMIC_RELAXED));
+    unlink(link_path);
+    if (linkat(AT_FDCWD, proc_path, AT_FDCWD, link_path, AT_SYMLINK_FOLLOW) == -1) {
+        goto out;
+    }
+    if (renameat(AT_FDCWD, link_path, AT_FDCWD, bf->path) == -1) {
+        unlink(link_path);
+        goto out;
+    }
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);//make the rename itself durable
+    }
+    //the handles move over to the published file under the fd numbers they had
+    if (bf->append) {
+        fcntl(tmp_fd, F_SETFL, O_APPEND);
+    }
+    dup2(tmp_fd, bf->fd);
+    int i = 0;
+    for (buffered_file_t *s = bf->inode->handles; s != NULL; s = s->inode_next) {
+        if (s == bf) continue;
+        dup2(sibling_fds[i++], s->fd);
+        s->offset_stale = s->append;
+        s->last_operation = 0;
+    }
+    inode_rekey(bf->inode, copy_st.st_dev, copy_st.st_ino);
+    cache_written(bf, 0, 0);//the new file may reuse an inode number the cache still has blocks of
+    bf->offset_stale = bf->append;
+    group_invalidate_windows(bf);
+    res = 0;
+out:
+    while (reopened > 0) close(sibling_fds[--reopened]);
+    if (tmp_fd != -1) close(tmp_fd);
+    if (dir_fd != -1) close(dir_fd);
+    free(dir_copy);
+    free(link_path);
+    free(sibling_fds);
+    return res;
+}
+
+static int publish_call(buffered_file_t *bf) {
+    if (bf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    struct buffered_txn *txn = bf->txn;
+    if (txn == NULL || txn->commits == 0) {
+        return 0;
+    }
+    //only what was committed is published, the open transaction stays staged
+    size_t entries = txn->active ? txn->begin_entries : txn->num_entries;
+    size_t data = txn->active ? txn->begin_data : txn->data_len;
+    if (txn_publish_copy(bf, txn, entries) == -1) {
+        note_error(bf, BUFFERED_OP_PUBLISH, -1, "publish error");
+        return -1;
+    }
+    memmove(txn->entries, txn->entries + entries, (txn->num_entries - entries) * sizeof(txn_entry_t));
+    for (size_t i = 0; i < txn->num_entries - entries; i++) {
+        txn->entries[i].at -= data;
+    }
+    memmove(txn->data, txn->data + data, txn->data_len - data);
+    txn->num_entries -= entries;
+    txn->data_len -= data;
+    txn->begin_entries = 0;
+    txn->begin_data = 0;
+    txn->commits = 0;
+    return 0;
+}
+
+static int close_call(buffered_file_t *bf) {
+    if (bf == NULL) return 0;
+    int flush_res = 0;
+    int close_res = 0;
+
+    //the flusher thread lets go of the handle first, and a failed background flush is reported here
+    if (policy_detach(bf) == -1) {
+        flush_res = -1;
+    }
+    //flush pending writes
+    if (bf->map) {
+        flush_res = mmap_teardown(bf);
+    } else if (bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        flush_res = -1;
+    }
+    //an unfinished transaction is dropped, committed ones are published
+    if (bf->txn) {
+        if (bf->txn->active) {
+            buffered_abort(bf);
+        }
+        if (buffered_publish(bf) == -1) {
+            flush_res = -1;
+        }
+    }
+    inode_unregister(bf);
+    close_res = close(bf->fd);
+    if (close_res == -1) {
+        note_error(bf, BUFFERED_OP_CLOSE, -1, "file close error");
+    }
+    
+    buffered_free(bf);
+
+    if (flush_res == -1 || close_res == -1) {
+        return -1;
+    }
+    return 0;
+}
+//a handle's flush policy; the handle's calls and the flusher thread take turns on it through lock
+struct buffered_policy {
+    buffered_flush_policy_t cfg;
+    buffered_file_t *bf;
+    pthread_mutex_t lock;       //recursive, the library's calls nest
+    int depth;                  //nesting of the calls holding lock
+    off_t entry_offset;         //write buffer run when the outermost call began, a flush moves it on
+    size_t entry_pos;
+    uint64_t pending_since;     //when the oldest buffered byte was written, 0 with an empty buffer
+    uint64_t last_flush;
+    uint64_t deadline;          //when the flusher has to flush, 0 = nothing due
+    uint64_t tick;              //how often the flusher has to look at this handle
+    int error;                  //errno of a failed background flush, not reported yet
+    int visiting;               //the flusher took it off the list to look at, under policies_lock
+    struct buffered_policy *next;
+};
+
+//handles with a timed policy, walked by the flusher thread while it runs
+static pthread_mutex_t policies_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffered_policy *policies = NULL;
+static pthread_cond_t policies_visited = PTHREAD_COND_INITIALIZER;
+static int flusher_running = 0;
+
+#define POLICY_MAX_TICK_NS (100 * 1000000ULL)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+//how much of the write buffer writes may fill: the high-water mark is the buffer size as far as writes
+//and buffered_putc are concerned, and an O_LOWMEM handle between uses has nothing to fill
+static size_t write_limit(buffered_file_t *bf) {
+    if (bf->write_buffer == NULL) {
+        return 0;
+    }
+    if (bf->policy && bf->policy->cfg.high_water > 0 && bf->policy->cfg.high_water < bf->buffer_capacity) {
+        return bf->policy->cfg.high_water;
+    }
+    return bf->buffer_capacity;
+}
+
+static int policy_timed(const buffered_flush_policy_t *cfg) {
+    return cfg->max_age_ms > 0 || (cfg->delimiter >= 0 && cfg->coalesce_ms > 0);
+}
+
+static void policy_due(struct buffered_policy *p, uint64_t at) {
+    if (p->deadline == 0 || at < p->deadline) {
+        p->deadline = at;
+    }
+}
+
+//after a flush, by the handle or by the flusher: nothing is due while the buffer is empty
+static void policy_flushed(struct buffered_policy *p, uint64_t now) {
+    p->last_flush = now;
+    if (p->bf->write_buffer_pos == 0) {
+        p->pending_since = 0;
+        p->deadline = 0;
+    }
+}
+
+//the flusher picks the handles up under policies_lock and flushes them after dropping it, so a slow
+//device does not hold up opening, closing or setting policies on other handles; a handle being
+//closed waits in policy_detach until the flusher is done with it
+static void *policy_flusher(void *arg) {
+    (void)arg;
+    struct buffered_policy **visit = NULL;
+    size_t visit_cap = 0;
+    for (;;) {
+        pthread_mutex_lock(&policies_lock);
+        if (policies == NULL) {
+            flusher_running = 0;
+            pthread_mutex_unlock(&policies_lock);
+            free(visit);
+            return NULL;
+        }
+        uint64_t tick = POLICY_MAX_TICK_NS;
+        size_t n = 0;
+        for (struct buffered_policy *p = policies; p != NULL; p = p->next) {
+            if (p->tick < tick) tick = p->tick;
+            if (n == visit_cap) {
+                size_t cap = visit_cap ? visit_cap * 2 : 16;
+                struct buffered_policy **grown = realloc(visit, cap * sizeof(*visit));
+                if (grown == NULL) break;//the rest wait for the next tick
+                visit = grown;
+                visit_cap = cap;
+            }
+            p->visiting = 1;
+            visit[n++] = p;
+        }
+        pthread_mutex_unlock(&policies_lock);
+
+        uint64_t now = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            struct buffered_policy *p = visit[i];
+            //a handle busy in a call of its own is looked at again on the next tick
+            if (pthread_mutex_trylock(&p->lock) != 0) continue;
+            if (p->deadline != 0 && now >= p->deadline) {
+                //timed handles are never O_SHARED, so the flush touches no other handle's windows
+                if (flush_one(p->bf) == -1 && p->error == 0) {
+                    p->error = errno ? errno : EIO;
+                }
+                policy_flushed(p, now);
+                if (p->bf->write_buffer_pos > 0) {
+                    policy_due(p, now + p->tick);
+                }
+                pool_idle(p->bf);
+            }
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        pthread_mutex_lock(&policies_lock);
+        for (size_t i = 0; i < n; i++) {
+            visit[i]->visiting = 0;
+        }
+        pthread_cond_broadcast(&policies_visited);
+        pthread_mutex_unlock(&policies_lock);
+
+        struct timespec ts = { (time_t)(tick / 1000000000ULL), (long)(tick % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+//take the handle away from the flusher, returns -1 with errno if a background flush failed
+static int policy_detach(buffered_file_t *bf) {
+    struct buffered_policy *p = bf->policy;
+    if (p == NULL) return 0;
+    pthread_mutex_lock(&policies_lock);
+    for (struct buffered_policy **link = &policies; *link != NULL; link = &(*link)->next) {
+        if (*link == p) {
+            *link = p->next;
+            break;
+        }
+    }
+    //the flusher may still be flushing it with the list unlocked
+    while (p->visiting) {
+        pthread_cond_wait(&policies_visited, &policies_lock);
+    }
+    pthread_mutex_unlock(&policies_lock);
+
+    int error = p->error;
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    bf->policy = NULL;
+    bf->write_buffer_size = write_limit(bf);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int buffered_set_flush_policy(buffered_file_t *bf, const buffered_flush_policy_t *policy) {
+    if (bf == NULL || bf->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    //mapped writes are in the page cache the moment they are made, there is nothing to hold back
+    if (bf->map || (policy && (policy->max_age_ms < 0 || policy->coalesce_ms < 0 ||
+                               policy->delimiter < -1 || policy->delimiter > 255))) {
+        errno = EINVAL;
+        return -1;
+    }
+    //the flusher thread would patch O_SHARED siblings' read windows under their owners' feet
+    if (policy && bf->share && policy_timed(policy)) {
+        errno = EINVAL;
+        return -1;
+    }
+    //what was buffered under the old policy goes out under it
+    if (bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        return -1;
+    }
+    if (policy_detach(bf) == -1) {
+        return -1;
+    }
+    if (policy == NULL) {
+        return 0;
+    }
+
+    struct buffered_policy *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    p->cfg = *policy;
+    p->bf = bf;
+
+    bf->policy = p;
+    bf->write_buffer_size = write_limit(bf);
+    if (!policy_timed(policy)) {
+        return 0;
+    }
+
+    //look at the handle a few times per deadline, so it is flushed close to it
+    p->tick = POLICY_MAX_TICK_NS;
+    if (policy->max_age_ms > 0 && (uint64_t)policy->max_age_ms * 250000ULL < p->tick) {
+        p->tick = (uint64_t)policy->max_age_ms * 250000ULL;
+    }
+    if (policy->delimiter >= 0 && (uint64_t)policy->coalesce_ms * 500000ULL < p->tick) {
+        p->tick = (uint64_t)policy->coalesce_ms * 500000ULL;
+    }
+    if (p->tick < 1000000ULL) p->tick = 1000000ULL;
+
+    pthread_mutex_lock(&policies_lock);
+    p->next = policies;
+    policies = p;
+    int res = 0;
+    if (!flusher_running) {
+        pthread_t thread;
+        pthread_attr_t thread_attr;
+        pthread_attr_init(&thread_attr);
+        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+        res = pthread_create(&thread, &thread_attr, policy_flusher, NULL);
+        pthread_attr_destroy(&thread_attr);
+        flusher_running = (res == 0);
+    }
+    pthread_mutex_unlock(&policies_lock);
+    if (res != 0) {
+        policy_detach(bf);
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+static void policy_enter(buffered_file_t *bf) {
+    struct buffered_policy *p = bf->policy;
+    pthread_mutex_lock(&p->lock);
+    if (p->depth++ == 0) {
+        p->entry_offset = bf->write_buffer_offset;
+        p->entry_pos = bf->write_buffer_pos;
+    }
+}
+
+//report a background flush that failed, once
+static int policy_error(buffered_file_t *bf) {
+    struct buffered_policy *p = bf->policy;
+    if (p->error == 0) return 0;
+    errno = p->error;
+    p->error = 0;
+    return -1;
+}
+
+//the write itself succeeded, so a failed flush is reported later like a background one
+static void policy_flush_now(buffered_file_t *bf, uint64_t now) {
+    struct buffered_policy *p = bf->policy;
+    if (flush_call(bf) == -1 && p->error == 0) {
+        p->error = errno ? errno : EIO;
+    }
+    policy_flushed(p, now);
+}
+
+//count bytes of buf were just buffered: start their clock, and flush at a delimiter unless one went out
+//less than coalesce_ms ago, in which case the flusher sends this line along with the next ones
+static void policy_written(buffered_file_t *bf, const void *buf, ssize_t count) {
+    struct buffered_policy *p = bf->policy;
+    if (count <= 0 || bf->write_buffer_pos == 0) return;
+    uint64_t now = now_ns();
+    if (p->pending_since == 0 || bf->write_buffer_pos <= (size_t)count) {
+        p->pending_since = now;
+    }
+    if (p->cfg.max_age_ms > 0) {
+        policy_due(p, p->pending_since + (uint64_t)p->cfg.max_age_ms * 1000000ULL);
+    }
+    if (p->cfg.delimiter >= 0 && memchr(buf, p->cfg.delimiter, (size_t)count) != NULL) {
+        uint64_t window = (uint64_t)p->cfg.coalesce_ms * 1000000ULL;
+        if (p->last_flush == 0 || now - p->last_flush >= window) {
+            policy_flush_now(bf, now);
+        } else {
+            policy_due(p, p->last_flush + window);
+        }
+    }
+    //reaching the high-water mark flushes right away rather than on the next write
+    if (bf->write_buffer_pos > 0 && p->cfg.high_water > 0 && bf->write_buffer_pos >= bf->write_buffer_size) {
+        policy_flush_now(bf, now);
+    }
+}
+
+static void policy_leave(buffered_file_t *bf) {
+    struct buffered_policy *p = bf->policy;
+    if (--p->depth == 0) {
+        //what was buffered when the call began went out with it
+        if (p->entry_pos > 0 && (bf->write_buffer_offset != p->entry_offset || bf->write_buffer_pos == 0)) {
+            policy_flushed(p, now_ns());
+        } else if (bf->write_buffer_pos == 0) {
+            p->pending_since = 0;
+            p->deadline = 0;
+        }
+        //the flusher may give the buffer back as well, so it happens under the lock
+        pool_idle(bf);
+        //with a timer, a delimiter or a high-water mark every byte has to come through here, not the inline fast paths
+        if (policy_timed(&p->cfg) || p->cfg.delimiter >= 0 || p->cfg.high_water > 0) {
+            bf->last_operation = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+//run a call with the handle's policy lock held, when it has a policy
+#define POLICY_CALL(bf, call) \
+    ({ \
+        struct buffered_policy *policy_held = (bf) ? (bf)->policy : NULL; \
+        if (policy_held) policy_enter(bf); \
+        __typeof__(call) policy_res = (call); \
+        if (policy_held) policy_leave(bf); \
+        policy_res; \
+    })
+
+//the public entry points: with tracing on, each call the program makes is recorded once,
+//calls the library makes to itself (a write flushing, a read refilling) are not
+static __thread int api_depth = 0;
+
+#define TRACED_CALL(op, bf, offset, size, call) \
+    ({ \
+        int traced = buffered_trace_on && api_depth == 0 && (bf) != NULL; \
+        uint32_t trace_id = traced ? (bf)->trace_id : 0; \
+        off_t trace_offset = traced ? (offset) : 0; \
+        api_depth++; \
+        __typeof__(call) res = (call); \
+        api_depth--; \
+        if (traced) { \
+            int saved = errno; \
+            buffered_trace_record((op), trace_id, trace_offset, (size), res); \
+            errno = saved; \
+        } \
+        res; \
+    })
+
+//the end of a call the program made on a handle without a policy (policy_leave covers the others):
+//an O_LOWMEM handle that went idle gives its buffer back
+static void call_done(buffered_file_t *bf) {
+    if (bf != NULL && bf->lowmem && bf->policy == NULL && api_depth == 0) {
+        pool_idle(bf);
+    }
+}
+
+ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
+    ssize_t res = TRACED_CALL(TRACE_READ, bf, bf->file_offset, count, POLICY_CALL(bf, read_call(bf, buf, count)));
+    call_done(bf);
+    return res;
+}
+
+ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
+    if (bf == NULL || bf->policy == NULL) {
+        ssize_t res = TRACED_CALL(TRACE_WRITE, bf, bf->file_offset, count, write_call(bf, buf, count));
+        call_done(bf);
+        return res;
+    }
+    policy_enter(bf);
+    ssize_t res = -1;
+    if (policy_error(bf) == 0) {
+        res = TRACED_CALL(TRACE_WRITE, bf, bf->file_offset, count, write_call(bf, buf, count));
+        policy_written(bf, buf, res);
+    }
+    policy_leave(bf);
+    return res;
+}
+
+int buffered_flush(buffered_file_t *bf) {
+    if (bf == NULL || bf->policy == NULL) {
+        int res = TRACED_CALL(TRACE_FLUSH, bf, bf->file_offset, 0, flush_call(bf));
+        call_done(bf);
+        return res;
+    }
+    policy_enter(bf);
+    int res = policy_error(bf) == 0 ? TRACED_CALL(TRACE_FLUSH, bf, bf->file_offset, 0, flush_call(bf)) : -1;
+    policy_leave(bf);
+    return res;
+}
+
+off_t buffered_seek(buffered_file_t *bf, off_t offset, int whence) {
+    off_t res = TRACED_CALL(TRACE_SEEK, bf, offset, whence, POLICY_CALL(bf, seek_call(bf, offset, whence)));
+    call_done(bf);
+    return res;
+}
+
+ssize_t buffered_fill(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_FILL, bf, bf->file_offset, 0, POLICY_CALL(bf, fill_call(bf)));
+}
+
+int buffered_lock(buffered_file_t *bf, int type, off_t start, off_t len) {
+    int op = type == BUFFERED_LOCK_EXCLUSIVE ? TRACE_LOCK_EXCLUSIVE : TRACE_LOCK_SHARED;
+    return TRACED_CALL(op, bf, start, len, POLICY_CALL(bf, lock_call(bf, type, start, len)));
+}
+
+int buffered_unlock(buffered_file_t *bf, off_t start, off_t len) {
+    return TRACED_CALL(TRACE_UNLOCK, bf, start, len, POLICY_CALL(bf, unlock_call(bf, start, len)));
+}
+
+int buffered_begin(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_BEGIN, bf, bf->file_offset, 0, POLICY_CALL(bf, begin_call(bf)));
+}
+
+int buffered_abort(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_ABORT, bf, bf->file_offset, 0, POLICY_CALL(bf, abort_call(bf)));
+}
+
+int buffered_commit(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_COMMIT, bf, bf->file_offset, 0, POLICY_CALL(bf, commit_call(bf)));
+}
+
+int buffered_publish(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_PUBLISH, bf, bf->file_offset, 0, POLICY_CALL(bf, publish_call(bf)));
+}
+
+//the flusher is detached from the handle before anything else, so close needs no lock of its own
+int buffered_close(buffered_file_t *bf) {
+    return TRACED_CALL(TRACE_CLOSE, bf, 0, 0, close_call(bf));
+}
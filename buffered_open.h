@@ -7,15 +7,79 @@
 // Define a new flag that doesn't collide with existing flags
 #define O_PREAPPEND 0x40000000
 
+// Flag for a write mode that copies straight into a shared mapping of the file (needs O_RDWR)
+#define O_MMAPWRITE 0x20000000
+
+// Flag to take OFD range locks automatically: shared around refills, exclusive around flushes
+#define O_RANGELOCK 0x10000000
+
+// Flag to stop the automatic page cache hints (posix_fadvise, readahead, writeback behind streaming writers)
+#define O_NOHINTS 0x08000000
+
+// Flag for the low-footprint mode: the handle holds no buffer while idle and a single one, used by reads
+// and writes in turn, while active; buffers come from a process-wide pool (streams and O_MMAPWRITE ignore it)
+#define O_LOWMEM 0x04000000
+
+// Flag to share state with the other O_SHARED handles of this process on the same file (seekable files,
+// not O_MMAPWRITE): flushes are combined and reads see the other handles' writes
+#define O_SHARED 0x02000000
+
+// Lock types for buffered_lock
+#define BUFFERED_LOCK_SHARED 1
+#define BUFFERED_LOCK_EXCLUSIVE 2
+
 // Define the standard buffer size for read and write operations
 #define BUFFER_SIZE 4096
 
-// Structure to hold the buffer and original flags
+// Granularity in which the mmap write mode preallocates and remaps the file
+#define MMAP_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Page cache hints: readahead() distance for sequential readers, how many blocks ahead strided readers
+// prefetch, and the chunk in which streaming writers are written back and dropped from the cache
+#define HINT_READAHEAD_SIZE (1024 * 1024)
+#define HINT_STRIDE_DEPTH 8
+#define HINT_WRITEBACK_CHUNK (1024 * 1024)
+
+// Registry entry for the handles of this process open on one file (see buffered_open.c)
+struct buffered_inode;
+
+// Staged writes of buffered_begin/buffered_commit (see buffered_open.c)
+struct buffered_txn;
+struct buffered_policy;
+struct buffered_cache;
+
+// Operations named in error reports
+enum {
+    BUFFERED_OP_OPEN = 1,
+    BUFFERED_OP_READ,
+    BUFFERED_OP_WRITE,
+    BUFFERED_OP_FLUSH,
+    BUFFERED_OP_LOCK,
+    BUFFERED_OP_PUBLISH,
+    BUFFERED_OP_CLOSE,
+};
+
+// A failure recorded on a handle; the call itself still returns -1 (or a short count) with errno set
 typedef struct {
+    int err;                    // errno of the failure, 0 = none since buffered_clearerr
+    int op;                     // BUFFERED_OP_* that failed, a flush also when a write or read triggered it
+    off_t offset;               // File offset the operation was at, -1 when it has none (appends, arguments)
+    const char *what;           // Static description, e.g. "write error (append)"
+    unsigned long count;        // Failures since buffered_clearerr, this being the last of them
+} buffered_error_t;
+
+// Structure to hold the buffer and original flags
+// O_SHARED handles on the same file share a registry entry: a flush on one of them flushes the pending
+// writes of all of them in combined syscalls, and reads see the other handles' writes. An operation on one
+// handle touches the others' buffers, so like a single handle the group must only be used from one thread
+// at a time. Handles opened without O_SHARED stay independent of every other handle.
+typedef struct buffered_file {
     int fd;                     // File descriptor for the opened file
+    int last_operation; //indicator of the last operation, 0 for none/clear, 1 for read, 2 for write
 
     char *read_buffer;          // Buffer for reading operations, holds data read from the file
     char *write_buffer;         // Buffer for writing operations, holds data to be written to the file
+                                // (O_LOWMEM: both name the one pooled buffer, or NULL while the handle is idle)
 
     size_t read_buffer_size;    // Size of the read buffer, indicating how much data it can hold
     size_t write_buffer_size;   // Size of the write buffer, indicating how much data it can hold
@@ -23,27 +87,177 @@ typedef struct {
     size_t read_buffer_pos;     // Current position in the read buffer, indicating the next byte to be read
     size_t write_buffer_pos;    // Current position in the write buffer, indicating the next byte to be written
 
+    off_t file_offset; //the logical file offset maintained by the buffer system
+    off_t read_buffer_offset; //file offset of read_buffer[0], i.e. the start of the cached read window
+    off_t write_buffer_offset; //file offset where write_buffer[0] lands when the buffer is flushed
+
     int flags;                  // File flags used to control file access modes and options (like O_RDONLY, O_WRONLY)
+    int held_locks;             // Number of explicit buffered_lock ranges held, automatic locking stays out of their way
 
-    int preappend;              // Flag to remember if the O_PREAPPEND flag was used, indicating special handling for writes
+    unsigned int preappend : 1; // Flag to remember if the O_PREAPPEND flag was used, indicating special handling for writes
+    unsigned int append : 1;    // Flag to remember if O_APPEND was used, each buffered_write is then one record landing in one write()
+    unsigned int offset_stale : 1; // Append mode only: file_offset must be re-read with fstat before the next read
+    unsigned int range_lock : 1; // Flag to remember if O_RANGELOCK was used, refills and flushes then lock their byte range
+    unsigned int seekable : 1;  // 0 for pipes, sockets and ttys, which are read and written as streams with read()/write()
+    unsigned int hints : 1;     // 0 when O_NOHINTS was used, the kernel is then left to its own readahead
+    unsigned int lowmem : 1;    // Flag to remember if O_LOWMEM was used, the buffer then comes from the pool only while needed
+    unsigned int share : 1;     // Flag to remember if O_SHARED was used, the handle then joins the file's group
+    unsigned char access_pattern;   // Read pattern told to the kernel: 0 unknown, 1 sequential, 2 strided, 3 random
+    unsigned char access_candidate; // Pattern of the latest refills, adopted once it held for a few refills in a row
+    int access_run;             // Number of refills in a row that matched access_candidate
+    unsigned int trace_id;      // Names the handle in I/O traces (buffered_trace.h)
 
-    int last_operation; //indicator of the last operation, 0 for none/clear, 1 for read, 2 for write
-    off_t file_offset; //the logical file offset maintained by the buffer system
+    char *map;                  // O_MMAPWRITE only: shared mapping of the file, NULL in the regular buffered mode
+    size_t map_size;            // O_MMAPWRITE only: bytes mapped, the file is preallocated up to this length
+    off_t logical_size;         // O_MMAPWRITE only: real end of the data, the file is truncated to it on close
+    off_t dirty_start;          // O_MMAPWRITE only: start of the range written since the last flush
+    off_t dirty_end;            // O_MMAPWRITE only: end of the range written since the last flush
+
+    off_t access_last;          // Offset of the previous refill, -1 before the first
+    off_t access_stride;        // Distance between the previous two refills
+    off_t readahead_end;        // Sequential readers: readahead() was issued up to here
+    off_t writeback_end;        // Streaming writers: writeback was started up to here
+    off_t dontneed_start;       // Streaming writers: the cache was dropped up to here
+
+    struct buffered_inode *inode; // Registry entry, shared with the other O_SHARED handles on the file; NULL for streams and O_MMAPWRITE
+    struct buffered_file *inode_next; // Next handle on the same file
+    struct buffered_file *inode_prev; // Previous handle on the same file, NULL for the first
+    unsigned long write_seq;    // When the pending write buffer was started, orders combined prepends
+
+    size_t buffer_capacity;     // Bytes allocated for each buffer, BUFFER_SIZE unless buffered_set_buffer_size changed it
+
+    char *path;                 // Path given to buffered_open, NULL for buffered_open_fd; transactions rename over it
+    struct buffered_txn *txn;   // Staged and committed but unpublished transactions, NULL before the first buffered_begin
+    struct buffered_policy *policy; // Flush policy set with buffered_set_flush_policy, NULL for the default
+    struct buffered_cache *cache;   // Shared block cache set with buffered_set_cache (buffered_cache.h), or NULL
+
+    buffered_error_t error;     // Last failure, read with buffered_error
 } buffered_file_t;
 
 // Function to wrap the original open function
 buffered_file_t *buffered_open(const char *pathname, int flags, ...);
 
+// Function to wrap an already open descriptor (pipe, socket, file), flags may add O_PREAPPEND/O_RANGELOCK/...
+// buffered_close closes fd. On non-blocking streams reads and writes return short counts or -1 with EAGAIN.
+buffered_file_t *buffered_open_fd(int fd, int flags);
+
+// Function to set the buffer size of handles opened from now on (default BUFFER_SIZE)
+int buffered_set_buffer_size(size_t size);
+
+// Function to cap the buffer memory lent to O_LOWMEM handles at once (0 = no cap). A handle that needs a
+// buffer at the cap waits up to wait_ms for another thread to give one back, then fails with ENOBUFS.
+// Up to POOL_KEEP returned buffers are kept for reuse besides the ones lent.
+#define POOL_KEEP 64
+int buffered_set_pool_limit(size_t max_bytes, int wait_ms);
+
+// Function to read the pool's usage: bytes lent to active handles and bytes kept for reuse
+void buffered_pool_stats(size_t *lent, size_t *kept);
+
 // Function to write to the buffered file
 ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count);
 
 // Function to read from the buffered file
 ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count);
 
+// Function to refill an empty read buffer without consuming anything, returns the bytes buffered,
+// 0 at end of file or -1 (EAGAIN on a non-blocking stream with nothing to read)
+ssize_t buffered_fill(buffered_file_t *bf);
+
+// Function to move the logical offset like lseek, the read window is kept when the target is inside it.
+// Returns the new offset, or -1 (ESPIPE on streams)
+off_t buffered_seek(buffered_file_t *bf, off_t offset, int whence);
+
 // Function to flush the buffer to the file
 int buffered_flush(buffered_file_t *bf);
 
+// Function to lock a byte range across processes (len 0 = to end of file), writers get preference over readers
+int buffered_lock(buffered_file_t *bf, int type, off_t start, off_t len);
+
+// Function to release a byte range taken with buffered_lock
+int buffered_unlock(buffered_file_t *bf, off_t start, off_t len);
+
+// Transactions: between buffered_begin and buffered_commit, writes (positional, O_APPEND or O_PREAPPEND)
+// are staged in memory and reads still see the last published file. Committed transactions are published
+// together, every `batch` commits (buffered_set_commit_batch, default 1), on buffered_publish and on close:
+// an O_TMPFILE copy of the file gets every staged write, is fsynced and renamed over the path, so a crash
+// leaves either the old or the new file. buffered_abort drops the open transaction's writes.
+int buffered_begin(buffered_file_t *bf);
+int buffered_commit(buffered_file_t *bf);
+int buffered_abort(buffered_file_t *bf);
+int buffered_publish(buffered_file_t *bf);
+int buffered_set_commit_batch(buffered_file_t *bf, int batch);
+
+// Flush policy for streams that others tail: bounds how long written data can sit in the write buffer
+// while still batching it. Timed flushes (max_age_ms, coalesce_ms) are done by a background thread, so
+// a handle with one must not share its file with handles used from other threads, and the byte
+// fast paths are off for it (as for a delimiter, which has to see every byte).
+typedef struct {
+    int max_age_ms;         // Longest time written data may stay buffered, 0 = no limit
+    size_t high_water;      // Flush once this many bytes are buffered, 0 = when the buffer is full
+    int delimiter;          // Flush after a write containing this byte (e.g. '\n'), -1 = never
+    int coalesce_ms;        // At most one delimiter flush per this many ms, lines in between wait for it
+} buffered_flush_policy_t;
+
+// Function to set a handle's flush policy, NULL restores the default (flush when the buffer is full).
+// A background flush that fails is reported by the next buffered_write, buffered_flush or buffered_close.
+// Timed policies (max_age_ms, or coalesce_ms with a delimiter) flush from another thread and are refused
+// with EINVAL on O_SHARED handles, whose group must stay with one thread.
+int buffered_set_flush_policy(buffered_file_t *bf, const buffered_flush_policy_t *policy);
+
+// Function to read the file through a shared block cache (buffered_cache.h), NULL stops using it.
+// Needs a regular file opened without O_MMAPWRITE and a buffer of at least CACHE_BLOCK_SIZE bytes.
+int buffered_set_cache(buffered_file_t *bf, struct buffered_cache *cache);
+
+// Function to read the handle's last failure into err (may be NULL), returns its errno or 0 if none
+int buffered_error(buffered_file_t *bf, buffered_error_t *err);
+
+// Function to forget the handle's failures
+void buffered_clearerr(buffered_file_t *bf);
+
+// Function to have failures reported to handler, called in the failing thread, at most max_per_second
+// times a second (0 = every failure) across all handles; bf is NULL when buffered_open itself failed.
+// The library writes no diagnostics of its own, NULL stops the reports.
+typedef void (*buffered_error_handler_t)(buffered_file_t *bf, const buffered_error_t *err, void *arg);
+void buffered_set_error_handler(buffered_error_handler_t handler, void *arg, int max_per_second);
+
 // Function to close the buffered file
 int buffered_close(buffered_file_t *bf);
 
+// Out-of-line slow paths of the byte functions below, for refills, flushes and mode switches
+int buffered_getc_slow(buffered_file_t *bf);
+int buffered_putc_slow(buffered_file_t *bf, int c);
+int buffered_ungetc_slow(buffered_file_t *bf, int c);
+
+// Function to read one byte, returns it as an unsigned char or -1 at end of file or on error
+static inline int buffered_getc(buffered_file_t *bf) {
+    if (bf->last_operation == 1 && bf->read_buffer_pos < bf->read_buffer_size) {
+        bf->file_offset++;
+        return (unsigned char)bf->read_buffer[bf->read_buffer_pos++];
+    }
+    return buffered_getc_slow(bf);
+}
+
+// Function to write one byte, returns it as an unsigned char or -1 on error
+// (the cursor must be past the read window, otherwise the slow path patches the window)
+static inline int buffered_putc(buffered_file_t *bf, int c) {
+    if (bf->last_operation == 2 && bf->write_buffer_pos < bf->write_buffer_size &&
+        bf->read_buffer_pos == bf->read_buffer_size) {
+        bf->write_buffer[bf->write_buffer_pos++] = (char)c;
+        bf->file_offset++;
+        return (unsigned char)c;
+    }
+    return buffered_putc_slow(bf, c);
+}
+
+// Function to push back the byte just read, returns it or -1 if it is not the byte before the cursor
+static inline int buffered_ungetc(buffered_file_t *bf, int c) {
+    if (bf->last_operation == 1 && bf->read_buffer_pos > 0 &&
+        (unsigned char)bf->read_buffer[bf->read_buffer_pos - 1] == c) {
+        bf->read_buffer_pos--;
+        bf->file_offset--;
+        return c;
+    }
+    return buffered_ungetc_slow(bf, c);
+}
+
 #endif // BUFFERED_OPEN_H
@@ -0,0 +1,181 @@
+#include "buffered_reactor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS 256
+
+typedef struct reactor_entry {
+    buffered_file_t *bf;
+    buffered_event_cb cb;
+    void *arg;
+    int want_out;                  //EPOLLOUT is armed because output is pending
+    int removed;                   //unregistered, freed once the current dispatch round is over
+    struct reactor_entry *next;    //in the graveyard
+} reactor_entry_t;
+
+struct buffered_reactor {
+    int epfd;
+    reactor_entry_t **by_fd;       //registered handles by fd, epoll already refuses an fd twice
+    int num_fds;                   //length of by_fd
+    reactor_entry_t *graveyard;    //removed during dispatch, freed at the end of the round
+    int dispatching;
+};
+
+buffered_reactor_t *buffered_reactor_create(void) {
+    buffered_reactor_t *r = calloc(1, sizeof(buffered_reactor_t));
+    if (r == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+static reactor_entry_t *find_entry(buffered_reactor_t *r, buffered_file_t *bf) {
+    if (bf == NULL || bf->fd < 0 || bf->fd >= r->num_fds) return NULL;
+    reactor_entry_t *e = r->by_fd[bf->fd];
+    return e != NULL && e->bf == bf ? e : NULL;
+}
+
+//arm EPOLLOUT only while output is pending, a writable socket would otherwise spin the loop
+static int rearm(buffered_reactor_t *r, reactor_entry_t *e) {
+    int want_out = e->bf->write_buffer_pos > 0;
+    if (want_out == e->want_out) return 0;
+    struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = e};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, e->bf->fd, &ev) == -1) {
+        return -1;
+    }
+    e->want_out = want_out;
+    return 0;
+}
+
+int buffered_reactor_add(buffered_reactor_t *r, buffered_file_t *bf, buffered_event_cb cb, void *arg) {
+    if (r == NULL || bf == NULL || bf->fd == -1 || cb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bf->fd >= r->num_fds) {
+        int num = r->num_fds ? r->num_fds : 64;
+        while (num <= bf->fd) num *= 2;
+        reactor_entry_t **grown = realloc(r->by_fd, num * sizeof(reactor_entry_t *));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + r->num_fds, 0, (num - r->num_fds) * sizeof(reactor_entry_t *));
+        r->by_fd = grown;
+        r->num_fds = num;
+    }
+    reactor_entry_t *e = calloc(1, sizeof(reactor_entry_t));
+    if (e == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    e->bf = bf;
+    e->cb = cb;
+    e->arg = arg;
+    e->want_out = bf->write_buffer_pos > 0;
+    struct epoll_event ev = {.events = EPOLLIN | (e->want_out ? EPOLLOUT : 0), .data.ptr = e};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, bf->fd, &ev) == -1) {
+        free(e);
+        return -1;
+    }
+    r->by_fd[bf->fd] = e;
+    return 0;
+}
+
+int buffered_reactor_update(buffered_reactor_t *r, buffered_file_t *bf) {
+    reactor_entry_t *e = find_entry(r, bf);
+    if (e == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return rearm(r, e);
+}
+
+int buffered_reactor_remove(buffered_reactor_t *r, buffered_file_t *bf) {
+    reactor_entry_t *e = find_entry(r, bf);
+    if (e == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    r->by_fd[bf->fd] = NULL;
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, bf->fd, NULL);
+    e->removed = 1;
+    if (r->dispatching) {//later events of this round may still point at it
+        e->next = r->graveyard;
+        r->graveyard = e;
+    } else {
+        free(e);
+    }
+    return 0;
+}
+
+int buffered_reactor_run(buffered_reactor_t *r, int timeout_ms) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n;
+    do {
+        n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        return -1;
+    }
+    int dispatched = 0;
+    r->dispatching = 1;
+    for (int i = 0; i < n; i++) {
+        reactor_entry_t *e = events[i].data.ptr;
+        //an earlier callback of this round removed it, and may have closed the handle too
+        if (e->removed) continue;
+        buffered_file_t *bf = e->bf;
+        int ready = 0;
+        if (events[i].events & EPOLLOUT) {
+            //drain pending output, report once it is all gone
+            if (buffered_flush(bf) == 0) {
+                ready |= BUFFERED_EV_WRITE;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ready |= BUFFERED_EV_ERROR;
+            }
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ssize_t filled = buffered_fill(bf);
+            if (filled > 0) {
+                ready |= BUFFERED_EV_READ;
+            } else if (filled == 0) {
+                ready |= BUFFERED_EV_EOF;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ready |= BUFFERED_EV_ERROR;
+            }
+        }
+        if (ready) {
+            e->cb(r, bf, ready, e->arg);
+            dispatched++;
+        }
+        if (!e->removed) {
+            rearm(r, e);
+        }
+    }
+    r->dispatching = 0;
+    while (r->graveyard != NULL) {
+        reactor_entry_t *dead = r->graveyard;
+        r->graveyard = dead->next;
+        free(dead);
+    }
+    return dispatched;
+}
+
+void buffered_reactor_destroy(buffered_reactor_t *r) {
+    if (r == NULL) return;
+    for (int fd = 0; fd < r->num_fds; fd++) {
+        free(r->by_fd[fd]);
+    }
+    free(r->by_fd);
+    close(r->epfd);
+    free(r);
+}
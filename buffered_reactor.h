@@ -0,0 +1,35 @@
+#ifndef BUFFERED_REACTOR_H
+#define BUFFERED_REACTOR_H
+
+#include "buffered_open.h"
+
+// Events passed to the callback
+#define BUFFERED_EV_READ  0x1   // buffered input is waiting in the handle's read buffer
+#define BUFFERED_EV_WRITE 0x2   // the handle's pending output has been flushed completely
+#define BUFFERED_EV_EOF   0x4   // the peer closed its end
+#define BUFFERED_EV_ERROR 0x8   // the descriptor failed, errno holds the reason
+
+typedef struct buffered_reactor buffered_reactor_t;
+
+// Callback invoked from buffered_reactor_run for a registered handle
+typedef void (*buffered_event_cb)(buffered_reactor_t *r, buffered_file_t *bf, int events, void *arg);
+
+// Function to create an epoll based reactor driving refills and flushes of non-blocking handles
+buffered_reactor_t *buffered_reactor_create(void);
+
+// Function to register a handle (its fd should be O_NONBLOCK), the reactor does not own it
+int buffered_reactor_add(buffered_reactor_t *r, buffered_file_t *bf, buffered_event_cb cb, void *arg);
+
+// Function to tell the reactor that output was queued on bf outside of a callback
+int buffered_reactor_update(buffered_reactor_t *r, buffered_file_t *bf);
+
+// Function to unregister a handle, safe to call from inside its callback
+int buffered_reactor_remove(buffered_reactor_t *r, buffered_file_t *bf);
+
+// Function to wait up to timeout_ms (-1 = forever) and dispatch, returns the number of callbacks run
+int buffered_reactor_run(buffered_reactor_t *r, int timeout_ms);
+
+// Function to free the reactor, registered handles are left open
+void buffered_reactor_destroy(buffered_reactor_t *r);
+
+#endif // BUFFERED_REACTOR_H
@@ -0,0 +1,344 @@
+#include "buffered_record.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//one index entry, stored as three u64s
+typedef struct {
+    uint64_t record;
+    uint64_t key;
+    uint64_t offset;
+} record_index_t;
+
+struct buffered_record_file {
+    buffered_file_t *bf;
+    int writing;
+    record_index_t *index;
+    uint64_t index_len;
+    uint64_t index_cap;
+    uint64_t count;         //records in the file
+    uint64_t last_key;      //writer: key of the last record
+    off_t data_end;         //reader: where the records stop and the index starts
+    uint64_t next;          //reader: record number at the cursor
+};
+
+static int read_fully(buffered_file_t *bf, void *buf, size_t len) {
+    ssize_t n = buffered_read(bf, buf, len);
+    if (n == (ssize_t)len) return 0;
+    if (n >= 0) errno = EIO;//truncated file
+    return -1;
+}
+
+static int write_fully(buffered_file_t *bf, const void *buf, size_t len) {
+    return buffered_write(bf, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int index_add(buffered_record_t *rf, uint64_t record, uint64_t key, uint64_t offset) {
+    if (rf->index_len == rf->index_cap) {
+        uint64_t cap = rf->index_cap ? rf->index_cap * 2 : 64;
+        record_index_t *grown = realloc(rf->index, cap * sizeof(record_index_t));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        rf->index = grown;
+        rf->index_cap = cap;
+    }
+    rf->index[rf->index_len++] = (record_index_t){record, key, offset};
+    return 0;
+}
+
+static buffered_record_t *record_alloc(buffered_file_t *bf, int writing) {
+    buffered_record_t *rf = calloc(1, sizeof(buffered_record_t));
+    if (rf == NULL) {
+        errno = ENOMEM;
+        buffered_close(bf);
+        return NULL;
+    }
+    rf->bf = bf;
+    rf->writing = writing;
+    return rf;
+}
+
+static void record_free(buffered_record_t *rf) {
+    free(rf->index);
+    free(rf);
+}
+
+buffered_record_t *buffered_record_create(const char *pathname, mode_t mode) {
+    buffered_file_t *bf = buffered_open(pathname, O_RDWR | O_CREAT | O_TRUNC, mode);
+    if (bf == NULL) {
+        return NULL;
+    }
+    return record_alloc(bf, 1);
+}
+
+int buffered_record_append(buffered_record_t *rf, uint64_t key, const void *data, uint32_t len) {
+    if (rf == NULL || !rf->writing || (data == NULL && len > 0) || (rf->count > 0 && key < rf->last_key)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rf->count % RECORD_INDEX_INTERVAL == 0 &&
+        index_add(rf, rf->count, key, (uint64_t)rf->bf->file_offset) == -1) {
+        return -1;
+    }
+    char header[RECORD_HEADER_SIZE];
+    memcpy(header, &len, 4);
+    memcpy(header + 4, &key, 8);
+    if (write_fully(rf->bf, header, sizeof(header)) == -1 || (len > 0 && write_fully(rf->bf, data, len) == -1)) {
+        return -1;
+    }
+    rf->count++;
+    rf->last_key = key;
+    return 0;
+}
+
+//index entries for count records, as buffered_record_close writes them
+static uint64_t index_entries(uint64_t count) {
+    return (count + RECORD_INDEX_INTERVAL - 1) / RECORD_INDEX_INTERVAL;
+}
+
+//the writer may have died while writing the index and footer, or the footer is damaged: if [offset,
+//file_size) is what the writer puts after the records scanned so far, or a prefix of it, the records end at
+//offset. Of the footer only the magic is compared, the counts are what may be wrong. Stops at the first
+//difference, which for a real record is almost always within its first bytes
+static int trailer_at(buffered_record_t *rf, off_t offset, off_t file_size) {
+    uint64_t magic = RECORD_MAGIC;
+    off_t index_bytes = (off_t)(rf->index_len * sizeof(record_index_t));
+    off_t left = file_size - offset;
+    if (left > index_bytes + RECORD_FOOTER_SIZE) {
+        return 0;
+    }
+    if (left > index_bytes + (off_t)sizeof(magic)) {
+        left = index_bytes + sizeof(magic);
+    }
+    char got[sizeof(record_index_t)];
+    for (off_t pos = 0; pos < left;) {
+        const char *expected = pos < index_bytes ? (const char *)rf->index + pos : (const char *)&magic + (pos - index_bytes);
+        off_t n = pos < index_bytes ? index_bytes - pos : (off_t)sizeof(magic) - (pos - index_bytes);
+        if (n > left - pos) n = left - pos;
+        if (n > (off_t)sizeof(got)) n = sizeof(got);
+        if (buffered_seek(rf->bf, offset + pos, SEEK_SET) == -1 || read_fully(rf->bf, got, n) == -1) {
+            return -1;
+        }
+        if (memcmp(got, expected, n) != 0) return 0;
+        pos += n;
+    }
+    return 1;
+}
+
+//no usable footer: walk the record headers and index them the way the writer would have
+static int record_rebuild_index(buffered_record_t *rf, off_t file_size) {
+    off_t offset = 0;
+    char header[RECORD_HEADER_SIZE];
+    rf->index_len = 0;
+    rf->count = 0;
+    while (offset + RECORD_HEADER_SIZE <= file_size) {
+        uint32_t len;
+        uint64_t key;
+        int trailer = trailer_at(rf, offset, file_size);
+        if (trailer == -1) return -1;
+        if (trailer) break;
+        if (buffered_seek(rf->bf, offset, SEEK_SET) == -1 || read_fully(rf->bf, header, sizeof(header)) == -1) {
+            return -1;
+        }
+        memcpy(&len, header, 4);
+        memcpy(&key, header + 4, 8);
+        if (offset + RECORD_HEADER_SIZE + (off_t)len > file_size) {
+            break;//a record the writer did not finish
+        }
+        if (rf->count % RECORD_INDEX_INTERVAL == 0 && index_add(rf, rf->count, key, offset) == -1) {
+            return -1;
+        }
+        rf->count++;
+        offset += RECORD_HEADER_SIZE + len;
+    }
+    rf->data_end = offset;
+    return 0;
+}
+
+//a footer that checks out can still carry an index from some other file state, seeks would then land
+//on the wrong records
+static int index_consistent(buffered_record_t *rf) {
+    for (uint64_t i = 0; i < rf->index_len; i++) {
+        record_index_t *e = &rf->index[i];
+        if (e->record != i * RECORD_INDEX_INTERVAL || e->offset >= (uint64_t)rf->data_end) return 0;
+        if (i == 0 ? e->offset != 0 : e->offset <= e[-1].offset || e->key < e[-1].key) return 0;
+    }
+    return 1;
+}
+
+buffered_record_t *buffered_record_open(const char *pathname) {
+    buffered_file_t *bf = buffered_open(pathname, O_RDONLY);
+    if (bf == NULL) {
+        return NULL;
+    }
+    buffered_record_t *rf = record_alloc(bf, 0);
+    if (rf == NULL) {
+        return NULL;
+    }
+    off_t file_size = buffered_seek(bf, 0, SEEK_END);
+    if (file_size == -1) {
+        goto fail;
+    }
+    uint64_t footer[4];
+    int valid = 0;
+    if (file_size >= RECORD_FOOTER_SIZE && buffered_seek(bf, file_size - RECORD_FOOTER_SIZE, SEEK_SET) != -1 &&
+        read_fully(bf, footer, sizeof(footer)) == 0 && footer[0] == RECORD_MAGIC) {
+        valid = footer[2] <= (uint64_t)file_size / sizeof(record_index_t) &&
+                footer[1] + footer[2] * sizeof(record_index_t) + RECORD_FOOTER_SIZE == (uint64_t)file_size &&
+                footer[2] == index_entries(footer[3]) && footer[3] <= footer[1] / RECORD_HEADER_SIZE;
+    }
+    if (valid) {
+        rf->data_end = footer[1];
+        rf->count = footer[3];
+        rf->index_len = rf->index_cap = footer[2];
+        if (footer[2] > 0) {
+            rf->index = malloc(footer[2] * sizeof(record_index_t));
+            if (rf->index == NULL) {
+                errno = ENOMEM;
+                goto fail;
+            }
+            //the whole index is one contiguous read
+            if (buffered_seek(bf, rf->data_end, SEEK_SET) == -1 ||
+                read_fully(bf, rf->index, footer[2] * sizeof(record_index_t)) == -1) {
+                goto fail;
+            }
+        }
+        valid = index_consistent(rf);
+    }
+    if (!valid && record_rebuild_index(rf, file_size) == -1) {
+        goto fail;
+    }
+    if (buffered_record_seek(rf, 0) == -1) {
+        goto fail;
+    }
+    return rf;
+
+fail:
+    buffered_close(rf->bf);
+    record_free(rf);
+    return NULL;
+}
+
+uint64_t buffered_record_count(buffered_record_t *rf) {
+    return rf->count;
+}
+
+//step over records from the cursor until record n, reading only their headers
+static int record_skip_to(buffered_record_t *rf, uint64_t n) {
+    char header[RECORD_HEADER_SIZE];
+    while (rf->next < n) {
+        uint32_t len;
+        if (read_fully(rf->bf, header, sizeof(header)) == -1) {
+            return -1;
+        }
+        memcpy(&len, header, 4);
+        if (buffered_seek(rf->bf, len, SEEK_CUR) == -1) {
+            return -1;
+        }
+        rf->next++;
+    }
+    return 0;
+}
+
+int buffered_record_seek(buffered_record_t *rf, uint64_t n) {
+    if (rf == NULL || rf->writing || n > rf->count) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n == rf->count) {
+        rf->next = n;
+        return buffered_seek(rf->bf, rf->data_end, SEEK_SET) == -1 ? -1 : 0;
+    }
+    //entries are RECORD_INDEX_INTERVAL records apart, so the nearest one is a plain array lookup
+    record_index_t *entry = &rf->index[n / RECORD_INDEX_INTERVAL];
+    if (buffered_seek(rf->bf, entry->offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    rf->next = entry->record;
+    return record_skip_to(rf, n);
+}
+
+int64_t buffered_record_seek_key(buffered_record_t *rf, uint64_t key) {
+    if (rf == NULL || rf->writing) {
+        errno = EINVAL;
+        return -1;
+    }
+    //binary search for the last entry with a smaller key, the first match is at most one interval after it
+    uint64_t lo = 0, hi = rf->index_len;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (rf->index[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t start = lo > 0 ? rf->index[lo - 1].record : 0;
+    if (buffered_record_seek(rf, start) == -1) {
+        return -1;
+    }
+    char header[RECORD_HEADER_SIZE];
+    while (rf->next < rf->count) {
+        uint32_t len;
+        uint64_t k;
+        if (read_fully(rf->bf, header, sizeof(header)) == -1) {
+            return -1;
+        }
+        memcpy(&len, header, 4);
+        memcpy(&k, header + 4, 8);
+        if (k >= key) {//back to the start of this record
+            if (buffered_seek(rf->bf, -RECORD_HEADER_SIZE, SEEK_CUR) == -1) return -1;
+            break;
+        }
+        if (buffered_seek(rf->bf, len, SEEK_CUR) == -1) {
+            return -1;
+        }
+        rf->next++;
+    }
+    return (int64_t)rf->next;
+}
+
+int buffered_record_next(buffered_record_t *rf, uint64_t *key, void *buf, size_t size, size_t *len) {
+    if (rf == NULL || rf->writing) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rf->next >= rf->count) {
+        return 0;
+    }
+    char header[RECORD_HEADER_SIZE];
+    uint32_t length;
+    if (read_fully(rf->bf, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    memcpy(&length, header, 4);
+    if (len) *len = length;
+    if (length > size) {
+        buffered_seek(rf->bf, -RECORD_HEADER_SIZE, SEEK_CUR);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (key) memcpy(key, header + 4, 8);
+    if (length > 0 && read_fully(rf->bf, buf, length) == -1) {
+        return -1;
+    }
+    rf->next++;
+    return 1;
+}
+
+int buffered_record_close(buffered_record_t *rf) {
+    if (rf == NULL) return 0;
+    int res = 0;
+    if (rf->writing) {
+        uint64_t footer[4] = {RECORD_MAGIC, (uint64_t)rf->bf->file_offset, rf->index_len, rf->count};
+        if ((rf->index_len > 0 && write_fully(rf->bf, rf->index, rf->index_len * sizeof(record_index_t)) == -1) ||
+            write_fully(rf->bf, footer, sizeof(footer)) == -1) {
+            res = -1;
+        }
+    }
+    if (buffered_close(rf->bf) == -1) {
+        res = -1;
+    }
+    record_free(rf);
+    return res;
+}
@@ -0,0 +1,44 @@
+#ifndef BUFFERED_RECORD_H
+#define BUFFERED_RECORD_H
+
+#include "buffered_open.h"
+#include <stdint.h>
+
+// Record file layout (host byte order):
+//   records:  [u32 length][u64 key][payload], keys never decrease
+//   index:    one {u64 record, u64 key, u64 offset} entry for every RECORD_INDEX_INTERVAL-th record
+//   footer:   [u64 magic][u64 index offset][u64 index entries][u64 record count]
+// A file without a valid footer (the writer died) is indexed by scanning its records on open.
+#define RECORD_INDEX_INTERVAL 64
+#define RECORD_HEADER_SIZE 12
+#define RECORD_FOOTER_SIZE 32
+#define RECORD_MAGIC 0x3158444943455242ULL // "BRECIDX1"
+
+typedef struct buffered_record_file buffered_record_t;
+
+// Function to create (or truncate) a record file for writing
+buffered_record_t *buffered_record_create(const char *pathname, mode_t mode);
+
+// Function to append one record, key must not be smaller than the previous record's key
+int buffered_record_append(buffered_record_t *rf, uint64_t key, const void *data, uint32_t len);
+
+// Function to open a record file for reading, loads its index
+buffered_record_t *buffered_record_open(const char *pathname);
+
+// Function to get the number of records in the file
+uint64_t buffered_record_count(buffered_record_t *rf);
+
+// Function to position the reader at record n (n == count positions at the end)
+int buffered_record_seek(buffered_record_t *rf, uint64_t n);
+
+// Function to position the reader at the first record with a key >= key, returns its record number
+int64_t buffered_record_seek_key(buffered_record_t *rf, uint64_t key);
+
+// Function to read the record at the reader position: returns 1 and advances, 0 at the end, -1 on error.
+// *len is set to the payload length; a payload longer than size fails with EMSGSIZE and is not consumed.
+int buffered_record_next(buffered_record_t *rf, uint64_t *key, void *buf, size_t size, size_t *len);
+
+// Function to close the file, a writer first writes the index and footer
+int buffered_record_close(buffered_record_t *rf);
+
+#endif // BUFFERED_RECORD_H
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE  //for memrchr
+#include "buffered_scan.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+//how far past its split a worker reads at a time to find the end of the split's last record
+#define SCAN_TAIL 4096
+
+typedef struct {
+    int fd;
+    off_t size;
+    off_t split;                //bytes per split, the last one may be shorter
+    int delim;
+    buffered_chunk_cb cb;
+    void *arg;
+    atomic_long next;           //next split to hand out
+    atomic_int result;          //first non-zero callback value or -1, stops everyone
+    atomic_int error;           //errno behind a -1
+} scan_t;
+
+typedef struct {
+    scan_t *scan;
+    int worker;
+    pthread_t thread;
+} scan_worker_t;
+
+static void scan_fail(scan_t *s, int result, int err) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&s->result, &expected, result)) {
+        atomic_store(&s->error, err);
+    }
+}
+
+static ssize_t pread_retry(int fd, char *buf, size_t len, off_t offset) {
+    ssize_t n;
+    do {
+        n = pread(fd, buf, len, offset);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+//where the first record starting at or after start begins: just past the first delimiter at or after
+//start - 1. Returns end of file when there is none
+static off_t record_start(scan_t *s, char *buf, size_t cap, off_t start) {
+    if (start == 0 || s->delim < 0) return start;
+    off_t at = start - 1;
+    while (at < s->size) {
+        ssize_t n = pread_retry(s->fd, buf, cap < SCAN_TAIL ? cap : SCAN_TAIL, at);
+        if (n <= 0) return n == 0 ? s->size : -1;
+        char *hit = memchr(buf, s->delim, n);
+        if (hit != NULL) return at + (hit - buf) + 1;
+        at += n;
+    }
+    return s->size;
+}
+
+//read the records starting in [start, end) and hand them to the callback in whole-record chunks
+static int scan_split(scan_t *s, char **bufp, size_t *capp, int worker, off_t start, off_t end) {
+    off_t pos = record_start(s, *bufp, *capp, start);
+    if (pos == -1) return -1;
+    size_t have = 0;                //bytes in the buffer, they start at pos
+    while (pos < end && atomic_load_explicit(&s->result, memory_order_relaxed) == 0) {
+        if (have == *capp) {
+            //one record longer than the buffer: make room for the rest of it
+            char *bigger = realloc(*bufp, *capp * 2);
+            if (bigger == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            *bufp = bigger;
+            *capp *= 2;
+        }
+        char *buf = *bufp;
+        //read up to the split's end, past it only as far as its last record is likely to reach
+        size_t want = *capp - have;
+        off_t reach = end - pos - (off_t)have;
+        if (s->delim >= 0) reach = (reach > 0 ? reach : 0) + SCAN_TAIL;
+        if ((off_t)want > reach) want = reach;
+        ssize_t n = pread_retry(s->fd, buf + have, want, pos + have);
+        if (n == -1) return -1;
+        int eof = n == 0;
+        have += n;
+
+        size_t deliver;
+        int last = 0;
+        if (eof || s->delim < 0) {
+            deliver = have;
+            last = eof || pos + (off_t)have >= end;
+        } else {
+            //the record holding end - 1 is the split's last, it ends at the first delimiter from there on
+            size_t from = end - 1 > pos ? (size_t)(end - 1 - pos) : 0;
+            char *stop = from < have ? memchr(buf + from, s->delim, have - from) : NULL;
+            if (stop != NULL) {
+                deliver = stop - buf + 1;
+                last = 1;
+            } else {
+                char *cut = memrchr(buf, s->delim, from < have ? from : have);
+                deliver = cut != NULL ? (size_t)(cut - buf + 1) : 0;
+            }
+        }
+        if (deliver > 0) {
+            int res = s->cb(buf, deliver, pos, worker, s->arg);
+            if (res != 0) {
+                scan_fail(s, res, 0);
+                return 0;
+            }
+            memmove(buf, buf + deliver, have - deliver);
+            have -= deliver;
+            pos += deliver;
+        }
+        if (last || eof) break;
+    }
+    return 0;
+}
+
+static void *scan_worker(void *p) {
+    scan_worker_t *w = p;
+    scan_t *s = w->scan;
+    size_t cap = SCAN_BUFFER_SIZE;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        scan_fail(s, -1, ENOMEM);
+        return NULL;
+    }
+    long splits = (s->size + s->split - 1) / s->split;
+    for (;;) {
+        long i = atomic_fetch_add(&s->next, 1);
+        if (i >= splits || atomic_load(&s->result) != 0) break;
+        off_t start = (off_t)i * s->split;
+        off_t end = start + s->split < s->size ? start + s->split : s->size;
+        if (scan_split(s, &buf, &cap, w->worker, start, end) == -1) {
+            scan_fail(s, -1, errno);
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int buffered_parallel_scan(const char *path, int nthreads, int delim, buffered_chunk_cb cb, void *arg) {
+    if (path == NULL || cb == NULL || delim < -1 || delim > 255 || nthreads < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    scan_t s = { .fd = fd, .size = st.st_size, .delim = delim, .cb = cb, .arg = arg };
+    atomic_init(&s.next, 0);
+    atomic_init(&s.result, 0);
+    atomic_init(&s.error, 0);
+    //small files still get a few splits per worker so a slow split does not hold everyone up
+    s.split = s.size / ((off_t)nthreads * 4);
+    if (s.split > SCAN_SPLIT_SIZE) s.split = SCAN_SPLIT_SIZE;
+    if (s.split < SCAN_MIN_SPLIT) s.split = SCAN_MIN_SPLIT;
+    if (s.size == 0) {
+        close(fd);
+        return 0;
+    }
+    //each worker reads its split front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    long splits = (s.size + s.split - 1) / s.split;
+    if (nthreads > splits) nthreads = (int)splits;
+    scan_worker_t *workers = calloc(nthreads, sizeof(scan_worker_t));
+    if (workers == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].scan = &s;
+        workers[i].worker = i;
+        //the calling thread is worker 0
+        if (i > 0) {
+            //without more threads the ones we have take all the splits, at worst the caller alone
+            if (pthread_create(&workers[i].thread, NULL, scan_worker, &workers[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+    scan_worker(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    close(fd);
+
+    int result = atomic_load(&s.result);
+    if (result == -1) {
+        errno = atomic_load(&s.error);
+    }
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef BUFFERED_SCAN_H
+#define BUFFERED_SCAN_H
+
+#include <sys/types.h>
+
+// Parallel read of one large file: the file is cut into splits that worker threads take in turn and
+// read with pread into buffers of their own, so no cursor is shared. With a delimiter every chunk
+// handed to the callback ends right after one (or at end of file), so no record is cut between chunks
+// or between workers: a split's records are the ones that start in it. Chunks of one split arrive in
+// order, different splits arrive concurrently and in any order; offset tells where a chunk belongs.
+#define SCAN_BUFFER_SIZE (1024 * 1024)      // Bytes each worker reads at a time, grows for longer records
+#define SCAN_SPLIT_SIZE (16 * 1024 * 1024)  // Largest split, smaller files get about 4 splits per worker
+#define SCAN_MIN_SPLIT (64 * 1024)
+
+// Called from a worker thread with data[0, len) at offset in the file; the data is only valid during the
+// call. Returning anything but 0 stops the scan, which then returns that value.
+typedef int (*buffered_chunk_cb)(const char *data, size_t len, off_t offset, int worker, void *arg);
+
+// Function to scan path with nthreads workers (0 = one per online CPU), cutting chunks after delim
+// (-1 = anywhere). Returns 0 when the whole file was passed to cb, cb's value if it stopped the scan,
+// or -1 with errno on error.
+int buffered_parallel_scan(const char *path, int nthreads, int delim, buffered_chunk_cb cb, void *arg);
+
+#endif // BUFFERED_SCAN_H
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE  //for O_TMPFILE
+#include "buffered_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#define TABLE_INITIAL_SLOTS 64
+
+//one virtual handle; bf is NULL while it is evicted
+typedef struct {
+    char *path;             //NULL when the slot is free
+    int flags;              //flags for reopening, without O_CREAT/O_TRUNC/O_EXCL
+    mode_t mode;
+    buffered_file_t *bf;
+    off_t file_offset;      //saved on eviction, restored on reopen
+    int offset_stale;
+    int error;              //errno of a failed flush on eviction, reported on the next access
+    int prev, next;         //LRU list of open handles, most recent at the head
+} table_entry_t;
+
+struct buffered_table {
+    table_entry_t *entries;
+    int num_slots;
+    int free_hint;          //lowest slot that may be free
+    int max_open;
+    int lru_head, lru_tail;
+    buffered_table_stats_t stats;
+};
+
+static void lru_unlink(buffered_table_t *t, int h) {
+    table_entry_t *e = &t->entries[h];
+    if (e->prev != -1) t->entries[e->prev].next = e->next;
+    else t->lru_head = e->next;
+    if (e->next != -1) t->entries[e->next].prev = e->prev;
+    else t->lru_tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+static void lru_push_front(buffered_table_t *t, int h) {
+    table_entry_t *e = &t->entries[h];
+    e->prev = -1;
+    e->next = t->lru_head;
+    if (t->lru_head != -1) t->entries[t->lru_head].prev = h;
+    else t->lru_tail = h;
+    t->lru_head = h;
+}
+
+//flush and close the handle's fd, keeping where it was for the reopen
+static void evict(buffered_table_t *t, int h) {
+    table_entry_t *e = &t->entries[h];
+    lru_unlink(t, h);
+    e->file_offset = e->bf->file_offset;
+    e->offset_stale = e->bf->offset_stale;
+    if (buffered_close(e->bf) == -1 && e->error == 0) {
+        e->error = errno;
+    }
+    e->bf = NULL;
+    t->stats.open_now--;
+    t->stats.evictions++;
+}
+
+//state a reopen from path, flags and offset would lose: explicit locks, transactions, a flush policy,
+//a block cache or a recorded error
+static int pinned(const buffered_file_t *bf) {
+    return bf->held_locks > 0 || bf->txn != NULL || bf->policy != NULL || bf->cache != NULL || bf->error.err != 0;
+}
+
+//least recently used handle that may be evicted, -1 when every open handle is pinned
+static int lru_victim(buffered_table_t *t) {
+    for (int h = t->lru_tail; h != -1; h = t->entries[h].prev) {
+        if (!pinned(t->entries[h].bf)) return h;
+    }
+    return -1;
+}
+
+//open the entry's file, evicting the least recently used handles when full or out of fds
+static int attach(buffered_table_t *t, int h, int flags) {
+    table_entry_t *e = &t->entries[h];
+    while (t->stats.open_now >= t->max_open) {
+        int victim = lru_victim(t);
+        if (victim == -1) {
+            errno = EMFILE;
+            return -1;
+        }
+        evict(t, victim);
+    }
+    for (;;) {
+        e->bf = buffered_open(e->path, flags, e->mode);
+        if (e->bf != NULL) break;
+        int victim = lru_victim(t);
+        if ((errno != EMFILE && errno != ENFILE) || victim == -1) return -1;
+        evict(t, victim);
+    }
+    t->stats.open_now++;
+    lru_push_front(t, h);
+    return 0;
+}
+
+buffered_table_t *buffered_table_create(int max_open) {
+    if (max_open <= 0) {
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            return NULL;
+        }
+        max_open = rl.rlim_cur == RLIM_INFINITY ? 4096 : (int)(rl.rlim_cur / 2);
+        if (max_open < 1) max_open = 1;
+    }
+    buffered_table_t *t = calloc(1, sizeof(buffered_table_t));
+    if (t == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->max_open = max_open;
+    t->lru_head = t->lru_tail = -1;
+    return t;
+}
+
+int buffered_table_open(buffered_table_t *t, const char *pathname, int flags, mode_t mode) {
+    //an unnamed file cannot be found again after its fd is closed
+    if ((flags & O_TMPFILE) == O_TMPFILE) {
+        errno = EINVAL;
+        return -1;
+    }
+    //find a free slot, growing the array when there is none
+    int h = t->free_hint;
+    while (h < t->num_slots && t->entries[h].path != NULL) h++;
+    if (h == t->num_slots) {
+        int slots = t->num_slots ? t->num_slots * 2 : TABLE_INITIAL_SLOTS;
+        table_entry_t *grown = realloc(t->entries, slots * sizeof(table_entry_t));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + t->num_slots, 0, (slots - t->num_slots) * sizeof(table_entry_t));
+        t->entries = grown;
+        t->num_slots = slots;
+    }
+    table_entry_t *e = &t->entries[h];
+    e->path = strdup(pathname);
+    if (e->path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    e->flags = flags & ~(O_CREAT | O_TRUNC | O_EXCL);
+    e->mode = mode;
+    e->error = 0;
+    e->prev = e->next = -1;
+    if (attach(t, h, flags) == -1) {
+        free(e->path);
+        e->path = NULL;
+        return -1;
+    }
+    t->free_hint = h + 1;
+    return h;
+}
+
+buffered_file_t *buffered_table_get(buffered_table_t *t, int h) {
+    if (h < 0 || h >= t->num_slots || t->entries[h].path == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+    table_entry_t *e = &t->entries[h];
+    t->stats.accesses++;
+    if (e->error != 0) {//data lost when the handle was evicted
+        errno = e->error;
+        e->error = 0;
+        return NULL;
+    }
+    if (e->bf != NULL) {
+        t->stats.hits++;
+        if (t->lru_head != h) {
+            lru_unlink(t, h);
+            lru_push_front(t, h);
+        }
+        return e->bf;
+    }
+    if (attach(t, h, e->flags) == -1) {
+        return NULL;
+    }
+    t->stats.reopens++;
+    //all regular I/O is positional, so restoring the offsets puts the handle back where it was
+    e->bf->file_offset = e->file_offset;
+    e->bf->read_buffer_offset = e->file_offset;
+    e->bf->write_buffer_offset = e->file_offset;
+    e->bf->offset_stale = e->offset_stale;
+    return e->bf;
+}
+
+ssize_t buffered_table_read(buffered_table_t *t, int h, void *buf, size_t count) {
+    buffered_file_t *bf = buffered_table_get(t, h);
+    return bf ? buffered_read(bf, buf, count) : -1;
+}
+
+ssize_t buffered_table_write(buffered_table_t *t, int h, const void *buf, size_t count) {
+    buffered_file_t *bf = buffered_table_get(t, h);
+    return bf ? buffered_write(bf, buf, count) : -1;
+}
+
+int buffered_table_flush(buffered_table_t *t, int h) {
+    if (h < 0 || h >= t->num_slots || t->entries[h].path == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    table_entry_t *e = &t->entries[h];
+    if (e->bf == NULL) {//evicted handles were flushed on the way out
+        if (e->error != 0) {
+            errno = e->error;
+            e->error = 0;
+            return -1;
+        }
+        return 0;
+    }
+    return buffered_flush(e->bf);
+}
+
+int buffered_table_close(buffered_table_t *t, int h) {
+    if (h < 0 || h >= t->num_slots || t->entries[h].path == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    table_entry_t *e = &t->entries[h];
+    int res = 0;
+    if (e->bf != NULL) {
+        lru_unlink(t, h);
+        res = buffered_close(e->bf);
+        e->bf = NULL;
+        t->stats.open_now--;
+    } else if (e->error != 0) {
+        errno = e->error;
+        res = -1;
+    }
+    free(e->path);
+    e->path = NULL;
+    if (h < t->free_hint) t->free_hint = h;
+    return res;
+}
+
+void buffered_table_stats(buffered_table_t *t, buffered_table_stats_t *stats) {
+    *stats = t->stats;
+}
+
+int buffered_table_destroy(buffered_table_t *t) {
+    int res = 0;
+    for (int h = 0; h < t->num_slots; h++) {
+        if (t->entries[h].path != NULL && buffered_table_close(t, h) == -1) {
+            res = -1;
+        }
+    }
+    free(t->entries);
+    free(t);
+    return res;
+}
@@ -0,0 +1,48 @@
+#ifndef BUFFERED_TABLE_H
+#define BUFFERED_TABLE_H
+
+#include "buffered_open.h"
+
+// Table of virtual handles for more files than RLIMIT_NOFILE allows open at once. Each handle remembers
+// its path, flags and file_offset; only the most recently used ones keep a buffered_file_t (and fd) open.
+// A handle is never evicted while it holds state a reopen cannot restore: buffered_lock ranges, a
+// transaction (buffered_begin or buffered_set_commit_batch), a flush policy, a block cache, or an error not
+// yet cleared with buffered_clearerr. Once every open handle is pinned like that, calls that need another fd
+// fail with EMFILE.
+typedef struct buffered_table buffered_table_t;
+
+// Counters reported by buffered_table_stats
+typedef struct {
+    unsigned long accesses;     // Calls that needed an open handle
+    unsigned long hits;         // Accesses that found the handle already open
+    unsigned long reopens;      // Accesses that had to reopen an evicted handle
+    unsigned long evictions;    // Handles flushed and closed to make room
+    int open_now;               // Handles holding an fd right now
+} buffered_table_stats_t;
+
+// Function to create a table keeping at most max_open fds (0 = half of RLIMIT_NOFILE)
+buffered_table_t *buffered_table_create(int max_open);
+
+// Function to add a handle, opens the file right away; O_CREAT/O_TRUNC/O_EXCL only apply to this first open.
+// Returns the handle number or -1.
+int buffered_table_open(buffered_table_t *t, const char *pathname, int flags, mode_t mode);
+
+// Function to get the open buffered_file_t of a handle, reopening it if it was evicted.
+// The pointer is only valid until the next call on the table.
+buffered_file_t *buffered_table_get(buffered_table_t *t, int h);
+
+// Functions to read, write and flush through a handle
+ssize_t buffered_table_read(buffered_table_t *t, int h, void *buf, size_t count);
+ssize_t buffered_table_write(buffered_table_t *t, int h, const void *buf, size_t count);
+int buffered_table_flush(buffered_table_t *t, int h);
+
+// Function to close a handle and free its number for reuse
+int buffered_table_close(buffered_table_t *t, int h);
+
+// Function to read the cache counters
+void buffered_table_stats(buffered_table_t *t, buffered_table_stats_t *stats);
+
+// Function to close every handle and free the table, returns -1 if any close failed
+int buffered_table_destroy(buffered_table_t *t);
+
+#endif // BUFFERED_TABLE_H
@@ -0,0 +1,221 @@
+#include "buffered_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+//one thread's records: only that thread moves head, only the flusher moves tail
+typedef struct trace_ring {
+    trace_record_t records[TRACE_RING_SIZE];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    size_t tail_bytes;          //bytes of the record at tail already in the file, after a short write
+    atomic_int orphaned;        //its thread exited, freed once drained
+    uint16_t thread;
+    struct trace_ring *next;
+} trace_ring_t;
+
+volatile int buffered_trace_on = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings = NULL;
+static trace_ring_t *partial_ring = NULL;  //has a record half in the file, nothing else may be written first
+static int trace_fd = -1;
+static pthread_t flusher;
+static atomic_int flusher_stop;
+static _Atomic uint64_t dropped;
+static uint16_t next_thread = 0;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+//a thread keeps its ring across starts and stops, it is freed after the thread exits
+static __thread trace_ring_t *my_ring = NULL;
+
+static void drain_rings(void);
+
+static void ring_orphan(void *p) {
+    trace_ring_t *ring = p;
+    atomic_store(&ring->orphaned, 1);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_orphan);
+}
+
+static trace_ring_t *ring_get(void) {
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&rings_lock);
+    ring->thread = next_thread++;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+void buffered_trace_record(int op, uint32_t handle, off_t offset, size_t size, int64_t result) {
+    trace_ring_t *ring = ring_get();
+    if (ring == NULL) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        //the flusher fell behind: drain here rather than lose records the replay needs
+        drain_rings();
+        if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+            atomic_fetch_add(&dropped, 1);//the file takes no writes, keep the records not yet in it
+            return;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_record_t *r = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->offset = offset;
+    r->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    r->handle = handle;
+    r->op = op;
+    r->thread = ring->thread;
+    r->result = result == -1 ? -errno : (int64_t)result;
+    r->seq = head;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+//write out one ring's records, normally in at most two write() calls; tail only passes what reached
+//the file, so after a failed write the rest waits in the ring for the next drain. rings_lock held
+static int drain_ring(trace_ring_t *ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    int res = 0;
+    while (tail < head) {
+        uint64_t start = tail & (TRACE_RING_SIZE - 1);
+        uint64_t n = head - tail;
+        if (n > TRACE_RING_SIZE - start) n = TRACE_RING_SIZE - start;
+        ssize_t written = write(trace_fd, (char *)&ring->records[start] + ring->tail_bytes,
+                                n * sizeof(trace_record_t) - ring->tail_bytes);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            res = -1;
+            break;
+        }
+        size_t done = ring->tail_bytes + (size_t)written;
+        tail += done / sizeof(trace_record_t);
+        ring->tail_bytes = done % sizeof(trace_record_t);
+    }
+    partial_ring = ring->tail_bytes > 0 ? ring : NULL;
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return res;
+}
+
+//write out everything the rings hold, stopping at the first write that fails
+static void drain_rings(void) {
+    pthread_mutex_lock(&rings_lock);
+    if (partial_ring != NULL && drain_ring(partial_ring) == -1) {
+        pthread_mutex_unlock(&rings_lock);
+        return;
+    }
+    trace_ring_t **link = &rings;
+    while (*link != NULL) {
+        trace_ring_t *ring = *link;
+        int orphaned = atomic_load(&ring->orphaned);
+        if (drain_ring(ring) == -1) break;
+        if (orphaned && atomic_load_explicit(&ring->tail, memory_order_relaxed) ==
+                        atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    struct timespec pause = {0, TRACE_FLUSH_MS * 1000000L};
+    while (!atomic_load(&flusher_stop)) {
+        nanosleep(&pause, NULL);
+        drain_rings();
+    }
+    return NULL;
+}
+
+int buffered_trace_start(const char *path) {
+    if (buffered_trace_on) {
+        errno = EBUSY;
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd == -1) {
+        return -1;
+    }
+    trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t)};
+    if (write(trace_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    atomic_store(&flusher_stop, 0);
+    atomic_store(&dropped, 0);
+    int err = pthread_create(&flusher, NULL, flusher_main, NULL);
+    if (err != 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        errno = err;
+        return -1;
+    }
+    buffered_trace_on = 1;
+    return 0;
+}
+
+int buffered_trace_stop(void) {
+    if (!buffered_trace_on) {
+        return 0;
+    }
+    buffered_trace_on = 0;
+    atomic_store(&flusher_stop, 1);
+    pthread_join(flusher, NULL);
+    drain_rings();
+    //what the file did not take would otherwise go into the next trace
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        atomic_fetch_add(&dropped, head - atomic_load_explicit(&ring->tail, memory_order_relaxed));
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+        ring->tail_bytes = 0;
+    }
+    partial_ring = NULL;
+    pthread_mutex_unlock(&rings_lock);
+    int lost = 0;
+    if (atomic_load(&dropped) > 0) {//tell the replay the trace has holes
+        trace_record_t r = {0, 0, 0, 0, TRACE_DROPPED, 0, 0, 0};
+        r.size = atomic_load(&dropped) > UINT32_MAX ? UINT32_MAX : (uint32_t)atomic_load(&dropped);
+        lost = write(trace_fd, &r, sizeof(r)) == -1;
+    }
+    int saved = errno;
+    int res = close(trace_fd);
+    trace_fd = -1;
+    if (lost) {
+        errno = saved;
+        return -1;
+    }
+    return res;
+}
+
+uint64_t buffered_trace_dropped(void) {
+    return atomic_load(&dropped);
+}
@@ -0,0 +1,83 @@
+#ifndef BUFFERED_TRACE_H
+#define BUFFERED_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Trace file: a header followed by fixed size records, appended in per-thread batches (so only
+// roughly in time order). Tracing starts with buffered_trace_start or by setting BUFFERED_TRACE=<path>
+// before the first buffered_open. The inline getc/putc/ungetc fast paths are not traced, their refills
+// and flushes are; neither are the buffered_set_* calls, which only configure a handle.
+#define TRACE_ENV "BUFFERED_TRACE"
+#define TRACE_MAGIC 0x3345434152544642ULL // "BFTRACE3"
+#define TRACE_VERSION 3
+#define TRACE_RING_SIZE 4096              // Records per thread ring, a power of two; a full ring is drained by its thread
+#define TRACE_FLUSH_MS 10                 // How often the rings are drained into the file
+
+// Traced operations: library calls first, then the syscalls they made
+enum {
+    TRACE_OPEN = 1,     // size = flags, offset = inode number, which tells which handles share a file
+    TRACE_CLOSE,
+    TRACE_READ,         // size = requested, offset = file offset before the call, result = returned
+    TRACE_WRITE,
+    TRACE_FLUSH,
+    TRACE_SEEK,         // offset and size = whence as requested, result = new offset
+    TRACE_FILL,         // offset = file offset, result = bytes buffered
+    TRACE_LOCK_SHARED,  // offset = start, size = len (0 = to end of file)
+    TRACE_LOCK_EXCLUSIVE,
+    TRACE_UNLOCK,
+    TRACE_BEGIN,
+    TRACE_COMMIT,
+    TRACE_ABORT,
+    TRACE_PUBLISH,
+    TRACE_SYS_READ = 16,
+    TRACE_SYS_WRITE,
+    TRACE_SYS_PREAD,
+    TRACE_SYS_PWRITE,
+    TRACE_SYS_PWRITEV,
+    TRACE_SYS_WRITEV,
+    TRACE_SYS_FSYNC,
+    TRACE_SYS_MSYNC,
+    TRACE_DROPPED = 63, // Last record when records were lost, size = how many
+};
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+} trace_header_t;
+
+typedef struct {
+    uint64_t ts_ns;     // CLOCK_MONOTONIC
+    int64_t offset;
+    uint32_t size;
+    uint32_t handle;    // Handle id, unique within the traced process
+    uint16_t op;
+    uint16_t thread;    // Small id of the calling thread
+    int64_t result;     // Return value, -errno on failure; a seek's result is a full file offset
+    uint64_t seq;       // Counts the thread's records, orders them when their timestamps are equal
+} trace_record_t;
+
+// Set while tracing, checked before every record so the disabled cost is one branch
+extern volatile int buffered_trace_on;
+
+// Function to start tracing into path (truncated), returns -1 if already tracing or on error
+int buffered_trace_start(const char *path);
+
+// Function to drain every ring and stop tracing; threads must be done calling into the library
+int buffered_trace_stop(void);
+
+// Function to read how many records were dropped (a thread ring could not be allocated, or the trace
+// file stopped taking writes while a ring was full)
+uint64_t buffered_trace_dropped(void);
+
+// Records one event, normally called through BUFFERED_TRACE
+void buffered_trace_record(int op, uint32_t handle, off_t offset, size_t size, int64_t result);
+
+#define BUFFERED_TRACE(op, handle, offset, size, result) \
+    do { \
+        if (__builtin_expect(buffered_trace_on, 0)) \
+            buffered_trace_record((op), (handle), (offset), (size), (result)); \
+    } while (0)
+
+#endif // BUFFERED_TRACE_H
@@ -7,82 +7,327 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <stdatomic.h>
 
-int main(int argc, char *argv[]) {
-    int fdout;
-    ssize_t charsw;  //how manny chars were written
-    
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <parent_message> <child1_message> <child2_message> <count>\n", argv[0]);
-        return 1;
+#define APPEND_MAX_IOV 1024        //records per writev, stays under IOV_MAX
+#define APPEND_MAX_BYTES 65536     //bytes per writev, one batch is one atomic O_APPEND write
+#define APPEND_FLUSH_MS 50         //a record never waits longer than this in a batch before it is written
+
+//packs records into one writev on an O_APPEND fd, so each batch lands whole and needs no lock
+typedef struct {
+    int fd;
+    struct iovec iov[APPEND_MAX_IOV];
+    int iovcnt;
+    size_t bytes;                 //bytes queued in iov
+    struct timespec oldest;       //when the first queued record was added
+    int error;                    //errno of a failed flush from the timer, reported by the next call
+} record_appender_t;
+
+static int batched = 1;  //0 = one write() per message like before, for comparison
+
+//a one-shot timer armed with every new batch flushes it from SIGALRM, so a stalled producer cannot hold
+//records back; while the appender is being changed the handler only leaves the flush to the caller
+static record_appender_t *volatile timed_appender;
+static volatile sig_atomic_t appender_busy;
+static volatile sig_atomic_t flush_deferred;
+static timer_t flush_timer;
+static pid_t flush_timer_owner;  //timers are not inherited by fork, each process creates its own
+
+static double elapsed_ms(const struct timespec *start);
+
+//writes out everything queued, the only part the timer runs
+static int appender_drain(record_appender_t *a) {
+    struct iovec *iov = a->iov;
+    int iovcnt = a->iovcnt;
+    while (iovcnt > 0) {
+        ssize_t w = writev(a->fd, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        //a short writev only happens on errors like ENOSPC, finish what is left
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
     }
-    const char *parent_message = argv[1];
-    const char *child1_message = argv[2];
-    const char *child2_message = argv[3];
-    int times_to_write = atoi(argv[4]);
+    a->iovcnt = 0;
+    a->bytes = 0;
+    return 0;
+}
 
-    fdout = open("output.txt", O_CREAT | O_RDWR | O_TRUNC, 0666);
-    if (fdout < 0) {
-        perror("after create");
-        exit(-1);
+static void flush_timer_fired(int sig) {
+    (void)sig;
+    record_appender_t *a = timed_appender;
+    if (a == NULL) return;
+    if (appender_busy) {
+        flush_deferred = 1;
+        return;
     }
+    int saved = errno;
+    if (appender_drain(a) == -1) a->error = errno;
+    errno = saved;
+}
 
-    pid_t pid1, pid2;
+//arms the timer for a batch that just started, without a timer the check in appender_add still applies
+static void appender_arm(record_appender_t *a) {
+    if (flush_timer_owner != getpid()) {
+        struct sigaction sa = {.sa_handler = flush_timer_fired, .sa_flags = SA_RESTART};
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGALRM, &sa, NULL) == -1 || timer_create(CLOCK_MONOTONIC, NULL, &flush_timer) == -1) return;
+        flush_timer_owner = getpid();
+    }
+    timed_appender = a;
+    struct itimerspec due = {.it_value = {.tv_sec = APPEND_FLUSH_MS / 1000, .tv_nsec = APPEND_FLUSH_MS % 1000 * 1000000L}};
+    timer_settime(flush_timer, 0, &due, NULL);
+}
 
-    if ((pid1 = fork()) < 0) { //create child1
-        perror("fork error");
-        return 1;
+static void appender_enter(void) {
+    appender_busy = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+}
+
+//leaves the appender to the timer again and runs a flush it deferred meanwhile
+static int appender_leave(record_appender_t *a, int res) {
+    atomic_signal_fence(memory_order_seq_cst);
+    appender_busy = 0;
+    if (flush_deferred) {
+        flush_deferred = 0;
+        appender_enter();
+        if (appender_drain(a) == -1 && res == 0) res = -1;
+        atomic_signal_fence(memory_order_seq_cst);
+        appender_busy = 0;
     }
+    if (a->error != 0 && res == 0) {
+        errno = a->error;
+        res = -1;
+    }
+    a->error = 0;
+    return res;
+}
 
-    if (pid1 == 0) {
-        sleep(1);//child1
-        for (int i = 0; i < times_to_write; i++) {
-            charsw = write(fdout, child1_message, strlen(child1_message));
-            if (charsw < 0) {
-                perror("write error in child1");
-                exit(-1);
+static int appender_flush(record_appender_t *a) {
+    appender_enter();
+    return appender_leave(a, appender_drain(a));
+}
+
+//the record has to stay valid until the next flush, it is referenced and not copied
+static int appender_add(record_appender_t *a, const char *record, size_t len) {
+    appender_enter();
+    if (a->iovcnt == APPEND_MAX_IOV || (a->iovcnt > 0 && a->bytes + len > APPEND_MAX_BYTES)) {
+        if (appender_drain(a) == -1) return appender_leave(a, -1);
+    }
+    if (a->iovcnt == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &a->oldest);
+        appender_arm(a);
+    }
+    a->iov[a->iovcnt].iov_base = (void *)record;
+    a->iov[a->iovcnt].iov_len = len;
+    a->iovcnt++;
+    a->bytes += len;
+    int res = 0;
+    if (elapsed_ms(&a->oldest) >= APPEND_FLUSH_MS) {//the timer may be late or missing
+        res = appender_drain(a);
+    }
+    return appender_leave(a, res);
+}
+
+//write one message count times, name is only used for error reporting
+static int write_messages(int fdout, const char *message, int count, const char *name) {
+    ssize_t charsw;  //how manny chars were written
+    if (batched) {
+        static record_appender_t appender;
+        size_t len = strlen(message);
+        appender.fd = fdout;
+        for (int i = 0; i < count; i++) {
+            if (appender_add(&appender, message, len) == -1) {
+                fprintf(stderr, "write error in %s: %s\n", name, strerror(errno));
+                return -1;
             }
         }
-        close(fdout);
-        exit(0);
+        if (appender_flush(&appender) == -1) {
+            fprintf(stderr, "write error in %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        charsw = write(fdout, message, strlen(message));
+        if (charsw < 0) {
+            fprintf(stderr, "write error in %s: %s\n", name, strerror(errno));
+            return -1;
+        }
     }
+    return 0;
+}
 
-    //parent continues and creates the second child 
-    if ((pid2 = fork()) < 0) {
-        perror("fork error");
-        return 1;
+//block until the previous writer hands over, 0 on success, -1 if it died without doing so
+static int wait_turn(int fd) {
+    char token;
+    ssize_t r;
+    while ((r = read(fd, &token, 1)) == -1 && errno == EINTR)
+        ;
+    return r == 1 ? 0 : -1;
+}
+
+static void pass_turn(int fd) {
+    char token = 1;
+    while (write(fd, &token, 1) == -1 && errno == EINTR)
+        ;
+}
+
+//children[0..n-1] write in order, each one starting the moment the previous one hands over
+//through a pipe, then the parent writes last. No sleeps, runtime is just the write work.
+static int run_ordered_writers(int fdout, const char *parent_message, const char **child_messages,
+                               int num_children, int times_to_write) {
+    int (*turn)[2] = malloc(num_children * sizeof(*turn));
+    pid_t *pids = malloc(num_children * sizeof(pid_t));
+    if (!turn || !pids) {
+        perror("malloc");
+        free(turn);
+        free(pids);
+        return -1;
+    }
+    //turn[i] carries the token from child i to writer i + 1 (the parent after the last child)
+    for (int i = 0; i < num_children; i++) {
+        if (pipe(turn[i]) < 0) {
+            perror("pipe error");
+            for (int j = 0; j < i; j++) { close(turn[j][0]); close(turn[j][1]); }
+            free(turn);
+            free(pids);
+            return -1;
+        }
     }
 
-    if (pid2 == 0) {
-        //child2
-        sleep(3);
-        for (int i = 0; i < times_to_write; i++) {
-            charsw = write(fdout, child2_message, strlen(child2_message));
-            if (charsw < 0) {
-                perror("write error in child2");
+    for (int i = 0; i < num_children; i++) {
+        if ((pids[i] = fork()) < 0) {
+            perror("fork error");
+            exit(-1);
+        }
+        if (pids[i] == 0) {
+            //keep only our own ends so a dead predecessor shows up as EOF
+            for (int j = 0; j < num_children; j++) {
+                if (j != i - 1) close(turn[j][0]);
+                if (j != i) close(turn[j][1]);
+            }
+            char name[32];
+            snprintf(name, sizeof(name), "child%d", i + 1);
+            if (i > 0 && wait_turn(turn[i - 1][0]) == -1) {
+                fprintf(stderr, "%s: previous writer exited without handing over\n", name);
                 exit(-1);
             }
+            int res = write_messages(fdout, child_messages[i], times_to_write, name);
+            pass_turn(turn[i][1]);
+            close(fdout);
+            exit(res == 0 ? 0 : -1);
         }
-        close(fdout);
-        exit(0);
+    }
+    for (int j = 0; j < num_children; j++) {
+        if (j != num_children - 1) close(turn[j][0]);
+        close(turn[j][1]);
     }
 
-    //wait for both children
-    if (waitpid(pid1, NULL, 0) != pid1)
-        perror("waitpid error for child1");
-
-        
-    if (waitpid(pid2, NULL, 0) != pid2)
-        perror("waitpid error for child2");
+    int res = 0;
+    if (wait_turn(turn[num_children - 1][0]) == -1) {
+        fprintf(stderr, "parent: last child exited without handing over\n");
+        res = -1;
+    }
+    close(turn[num_children - 1][0]);
 
-    for (int i = 0; i < times_to_write; i++) {
-        charsw = write(fdout, parent_message, strlen(parent_message));
-        if (charsw < 0) {
-            perror("write error in parent");
-            exit(-1);
+    //wait for all children
+    for (int i = 0; i < num_children; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) != pids[i]) {
+            perror("waitpid error for child");
+            res = -1;
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            res = -1;
         }
     }
+    if (res == 0) {
+        res = write_messages(fdout, parent_message, times_to_write, "parent");
+    }
+    free(turn);
+    free(pids);
+    return res;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int open_output(void) {
+    int fdout = open("output.txt", O_CREAT | O_RDWR | O_TRUNC | O_APPEND, 0666);
+    if (fdout < 0) {
+        perror("after create");
+    }
+    return fdout;
+}
 
+//wall-clock time of one full ordered run, -1 on failure
+static double timed_run(const char *parent_message, const char **child_messages, int num_children, int count) {
+    int fdout = open_output();
+    if (fdout < 0) return -1;
+    fflush(stdout);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int res = run_ordered_writers(fdout, parent_message, child_messages, num_children, count);
+    double ms = elapsed_ms(&start);
     close(fdout);
+    return res == 0 ? ms : -1;
+}
+
+//wall-clock time and records/sec for message counts 1, 10, 100 ... max_count,
+//with one write() per message against batched writev appends
+static int run_timing(const char *parent_message, const char **child_messages, int num_children, int max_count) {
+    printf("%10s %8s %14s %14s %14s %14s\n", "count", "writers", "single(ms)", "single rec/s", "batched(ms)", "batched rec/s");
+    for (int count = 1; count <= max_count; count *= 10) {
+        double records = (double)count * (num_children + 1);
+        batched = 0;
+        double single_ms = timed_run(parent_message, child_messages, num_children, count);
+        batched = 1;
+        double batched_ms = timed_run(parent_message, child_messages, num_children, count);
+        if (single_ms < 0 || batched_ms < 0) return 1;
+        printf("%10d %8d %14.3f %14.0f %14.3f %14.0f\n", count, num_children + 1,
+               single_ms, records / single_ms * 1e3, batched_ms, records / batched_ms * 1e3);
+        if (count > max_count / 10) break;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    int fdout;
+
+    if (argc >= 6 && strcmp(argv[1], "-T") == 0) {//timing harness, messages only, no count
+        return run_timing(argv[3], (const char **)&argv[4], argc - 4, atoi(argv[2]));
+    }
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s <parent_message> <child1_message> <child2_message> [<childN_message> ...] <count>\n", argv[0]);
+        fprintf(stderr, "       %s -T <max_count> <parent_message> <child1_message> <child2_message> [...]\n", argv[0]);
+        return 1;
+    }
+    const char *parent_message = argv[1];
+    const char **child_messages = (const char **)&argv[2];
+    int num_children = argc - 3;
+    int times_to_write = atoi(argv[argc - 1]);
+
+    fdout = open_output();
+    if (fdout < 0) {
+        exit(-1);
+    }
+
+    int res = run_ordered_writers(fdout, parent_message, child_messages, num_children, times_to_write);
+    close(fdout);
+    return res == 0 ? 0 : 1;
+}
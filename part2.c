@@ -1,24 +1,168 @@
+#define _GNU_SOURCE  //for F_OFD_SETLKW and syscall()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
 
 #define LOCK_FILE "lockfile.lock"
+#define OFD_LOCK_FILE "lockfile.ofd" //stays on disk, so it must not collide with the O_EXCL lockfile
+#define LOCK_SLOTS 4096          //ticket ring size, has to exceed the number of processes queued at once
+#define LOCK_RECHECK_NS 10000000 //how long a waiter sleeps before checking whether the ticket holder died
+#define SLOT_PID_DEAD 0x80000000u //set on a slot's pid once the parent reaped it, pids never use the top bit
+#define RING_SLOTS 1024          //messages the shared ring holds before producers have to wait
+#define RING_OUT_SIZE 65536      //consumer output batch, written with one write() when full or idle
+#define DRIVER_SAMPLES (1 << 20) //handoff latency samples kept across all workers for the p99
+#define DRIVER_OUTPUT "driver_output.txt"
+
+enum lock_kind {
+    LOCK_FUTEX, //FIFO ticket lock on a futex in shared memory, recovers from dead holders
+    LOCK_OFD,   //OFD fcntl lock on OFD_LOCK_FILE, released by the kernel when the holder dies
+    LOCK_EXCL   //the original O_CREAT|O_EXCL lockfile spin, kept for comparison
+};
+
+//lives in a MAP_SHARED mapping created before fork, so every child sees the same lock
+typedef struct {
+    atomic_uint next_ticket;             //next ticket to hand out
+    atomic_uint now_serving;             //ticket that owns the lock, also the futex word
+    atomic_ullong slots[LOCK_SLOTS];     //(ticket << 32 | pid) of whoever drew each ticket, pid 0 = not drawn
+} shared_lock_t;
+
+enum ring_order {
+    RING_ORDER_SEQ,  //emit messages in the global order they were published
+    RING_ORDER_CHILD //emit each child's messages as one block once that child is done
+};
+
+//one message per slot, the seq field is the Vyukov sequence: pos when free, pos + 1 when published
+typedef struct {
+    atomic_ullong seq;
+    unsigned int child;
+    unsigned int len;
+    char data[];
+} ring_slot_t;
+
+//multi-producer single-consumer ring in a MAP_SHARED mapping, children publish and the parent drains
+typedef struct {
+    atomic_ullong head;          //next position a producer claims
+    atomic_uint published;       //bumped on every publish, the futex word the idle consumer sleeps on
+    atomic_uint consumer_idle;   //set while the consumer is (about to be) asleep
+    size_t slot_size;            //stride of a slot, header plus the longest message and its newline
+    size_t map_size;
+    char slots[];
+} msg_ring_t;
+
+//growable private buffer a child collects its output in
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} byte_buf_t;
 
 int LOCK_FILE_fd = -1;   //file descriptor for the lock file
+enum lock_kind lock_kind = LOCK_FUTEX;
+shared_lock_t *shared_lock = NULL;
+unsigned int my_ticket;  //ticket held by this process while it owns the futex lock
 
+void lock_init(void);
+void lock_reaped(pid_t pid);
 void lock(void);
 void unlock(void);
-void writemessage(const char *, int);
+int writemessage(byte_buf_t *, const char *, int);
+static int byte_buf_append(byte_buf_t *b, const char *src, size_t len);
+static int write_all(int fd, const char *buf, size_t len);
+int run_lock_benchmark(int max_children, int acquisitions);
+int run_driver(int writers, int records, int workers, int all_kinds);
+msg_ring_t *ring_create(size_t max_message_len);
+void ring_writemessage(msg_ring_t *ring, unsigned int child, const char *message, int count);
+int ring_drain(msg_ring_t *ring, pid_t *pids, int num_of_children, enum ring_order order);
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l futex|ofd|excl] <message1> <message2> ... <count>\n", prog);
+    fprintf(stderr, "       %s -r [-o seq|child] <message1> <message2> ... <count>\n", prog);
+    fprintf(stderr, "       %s [-l futex|ofd|excl] -D <writers> -N <records> [-w <workers>]\n", prog);
+    fprintf(stderr, "       %s [-l futex|ofd|excl] -b <max_children> [-n <acquisitions>]\n", prog);
+}
 
 int main(int argc, char *argv[]) {
+    int bench_children = 0;
+    int bench_acquisitions = 10000;
+    int all_kinds = 1;  //benchmark every lock kind unless -l picked one
+    int ring_mode = 0;
+    enum ring_order ring_order = RING_ORDER_SEQ;
+    int driver_writers = 0;
+    int driver_records = 1000;
+    int driver_workers = 0;  //0 = one worker per online CPU
+    int opt;
+    while ((opt = getopt(argc, argv, "+l:b:n:ro:D:N:w:")) != -1) {
+        switch (opt) {
+        case 'D':
+            driver_writers = atoi(optarg);
+            break;
+        case 'N':
+            driver_records = atoi(optarg);
+            break;
+        case 'w':
+            driver_workers = atoi(optarg);
+            break;
+        case 'r':
+            ring_mode = 1;
+            break;
+        case 'o':
+            if (strcmp(optarg, "seq") == 0) ring_order = RING_ORDER_SEQ;
+            else if (strcmp(optarg, "child") == 0) ring_order = RING_ORDER_CHILD;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'l':
+            if (strcmp(optarg, "futex") == 0) lock_kind = LOCK_FUTEX;
+            else if (strcmp(optarg, "ofd") == 0) lock_kind = LOCK_OFD;
+            else if (strcmp(optarg, "excl") == 0) lock_kind = LOCK_EXCL;
+            else { usage(argv[0]); return 1; }
+            all_kinds = 0;
+            break;
+        case 'b':
+            bench_children = atoi(optarg);
+            break;
+        case 'n':
+            bench_acquisitions = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (driver_writers > 0) {
+        if (driver_workers <= 0) driver_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (driver_workers > driver_writers) driver_workers = driver_writers;
+        return run_driver(driver_writers, driver_records, driver_workers, all_kinds);
+    }
+    if (bench_children > 0) {
+        printf("%-6s %8s %14s %16s\n", "lock", "children", "acquires/sec", "avg handoff(us)");
+        for (int kind = LOCK_FUTEX; kind <= LOCK_EXCL; kind++) {
+            if (!all_kinds && kind != (int)lock_kind) continue;
+            lock_kind = kind;
+            lock_init();
+            if (run_lock_benchmark(bench_children, bench_acquisitions) != 0) return 1;
+        }
+        return 0;
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc <= 4) {
-        fprintf(stderr, "Usage: %s <message1> <message2> ... <count>", argv[0]);
+        usage(argv[0]);
         return 1;
     }
     int times_to_write = atoi(argv[argc - 1]);
@@ -28,6 +172,20 @@ int main(int argc, char *argv[]) {
         perror("malloc");
         return 1;
     }
+    msg_ring_t *ring = NULL;
+    if (ring_mode) {
+        size_t max_len = 0;
+        for (int i = 0; i < num_of_children; i++) {
+            size_t len = strlen(argv[i + 1]);
+            if (len > max_len) max_len = len;
+        }
+        if ((ring = ring_create(max_len)) == NULL) {
+            free(pids);
+            return 1;
+        }
+    } else {
+        lock_init();
+    }
 
     for (int i = 0; i < num_of_children; i++) {//fork all children
         pid_t pid;
@@ -37,25 +195,161 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         if (pid == 0) {//for nth child process
-            setbuf(stdout, NULL);
+            if (ring) {//no lock, the ring keeps whole messages apart
+                ring_writemessage(ring, i, argv[i + 1], times_to_write);
+                exit(0);
+            }
+            //build the whole block without the lock, then hold it only for the one write
+            byte_buf_t block = {0};
+            if (writemessage(&block, argv[i + 1], times_to_write) == -1) exit(EXIT_FAILURE);
             lock();
-            writemessage(argv[i + 1], times_to_write);
+            int res = write_all(STDOUT_FILENO, block.data, block.len);
             unlock();
-            exit(0);
+            free(block.data);
+            exit(res == 0 ? 0 : EXIT_FAILURE);
         }
         pids[i] = pid; //save child's pid and continue loop
     }
-    //parent waits for children
+    if (ring) {//parent is the single consumer, it reaps the children while draining
+        int res = ring_drain(ring, pids, num_of_children, ring_order);
+        free(pids);
+        return res;
+    }
+    //parent reaps children in whatever order they exit, so a dead lock holder is never left a zombie
     for (int i = 0; i < num_of_children; i++) {
-        if (waitpid(pids[i], NULL, 0) != pids[i])
-            perror("waitpid error for child");
+        pid_t pid = wait(NULL);
+        if (pid < 0) {
+            perror("wait error for child");
+            break;
+        }
+        lock_reaped(pid);
     }
 
     free(pids);
     return 0;
 }
 
-void lock(void) {
+static long futex(atomic_uint *uaddr, int op, unsigned int val, const struct timespec *timeout, unsigned int bitset) {
+    return syscall(SYS_futex, (unsigned int *)uaddr, op, val, timeout, NULL, bitset);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//must run in the parent before fork so the mapping is inherited
+void lock_init(void) {
+    if (lock_kind != LOCK_FUTEX || shared_lock != NULL) return;
+    void *mem = mmap(NULL, sizeof(shared_lock_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap shared lock, falling back to OFD lock");
+        lock_kind = LOCK_OFD;
+        return;
+    }
+    shared_lock = mem; //anonymous mappings start zeroed, which is the unlocked state
+}
+
+static int slot_drawn(unsigned long long slot, unsigned int t) {
+    return (unsigned int)(slot >> 32) == t && (unsigned int)slot != 0;
+}
+
+//called by the parent for every child it reaps: kill(pid, 0) still succeeds on a zombie and may hit a
+//reused pid afterwards, so the parent flags the dead pid on every ticket it still holds
+void lock_reaped(pid_t pid) {
+    if (shared_lock == NULL) return;
+    for (int i = 0; i < LOCK_SLOTS; i++) {
+        unsigned long long slot = atomic_load(&shared_lock->slots[i]);
+        if ((unsigned int)slot == (unsigned int)pid) {//a newer draw replacing it makes the CAS fail, which is fine
+            atomic_compare_exchange_strong(&shared_lock->slots[i], &slot, slot | SLOT_PID_DEAD);
+        }
+    }
+}
+
+//the holder of ticket t is gone if its parent reaped it, or if its pid no longer exists at all
+static int ticket_holder_dead(unsigned int t) {
+    unsigned long long slot = atomic_load(&shared_lock->slots[t % LOCK_SLOTS]);
+    if (!slot_drawn(slot, t)) return 0; //drawing is a single CAS, so this is a holder still being served
+    if ((unsigned int)slot & SLOT_PID_DEAD) return 1;
+    pid_t pid = (pid_t)(slot & 0xffffffffu);
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+//claims the next ticket and records our pid on it in one CAS on the slot, so no process can die holding a
+//ticket nobody can attribute; whoever sees a drawn slot at next_ticket advances next_ticket past it
+static unsigned int ticket_draw(void) {
+    unsigned long long mine = (unsigned int)getpid();
+    for (;;) {
+        unsigned int t = atomic_load(&shared_lock->next_ticket);
+        atomic_ullong *slot = &shared_lock->slots[t % LOCK_SLOTS];
+        unsigned long long seen = atomic_load(slot);
+        if (slot_drawn(seen, t)) {
+            atomic_compare_exchange_strong(&shared_lock->next_ticket, &t, t + 1);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(slot, &seen, ((unsigned long long)t << 32) | mine)) {
+            atomic_compare_exchange_strong(&shared_lock->next_ticket, &t, t + 1);
+            return t;
+        }
+    }
+}
+
+static void futex_lock(void) {
+    unsigned int t = ticket_draw();
+    for (;;) {
+        unsigned int serving = atomic_load(&shared_lock->now_serving);
+        if (serving == t) break;
+        //sleep on our own bit only, so a release wakes roughly one waiter instead of all of them
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOCK_RECHECK_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (futex(&shared_lock->now_serving, FUTEX_WAIT_BITSET, serving, &deadline, 1u << (t % 32)) == -1
+            && errno == ETIMEDOUT && ticket_holder_dead(serving)) {
+            //the process owning the current ticket died, skip it on its behalf
+            if (atomic_compare_exchange_strong(&shared_lock->now_serving, &serving, serving + 1)) {
+                futex(&shared_lock->now_serving, FUTEX_WAKE_BITSET, INT_MAX, NULL, 1u << ((serving + 1) % 32));
+            }
+        }
+    }
+    my_ticket = t;
+}
+
+static void futex_unlock(void) {
+    unsigned int next = my_ticket + 1;
+    atomic_store(&shared_lock->now_serving, next);
+    futex(&shared_lock->now_serving, FUTEX_WAKE_BITSET, INT_MAX, NULL, 1u << (next % 32));
+}
+
+static void ofd_lock(void) {
+    if (LOCK_FILE_fd < 0) {//each process needs its own open file description
+        LOCK_FILE_fd = open(OFD_LOCK_FILE, O_CREAT | O_RDWR, 0666);
+        if (LOCK_FILE_fd < 0) {
+            perror("open lockfile");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0};
+    while (fcntl(LOCK_FILE_fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl lockfile");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void ofd_unlock(void) {
+    struct flock fl = {.l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0};
+    if (fcntl(LOCK_FILE_fd, F_OFD_SETLK, &fl) == -1) {
+        perror("fcntl unlock lockfile");
+    }
+}
+
+static void excl_lock(void) {
     int fd;
     while ((fd = open(LOCK_FILE, O_CREAT | O_EXCL | O_WRONLY, 0666)) == -1) {
         if (errno != EEXIST) {
@@ -67,7 +361,7 @@ void lock(void) {
     LOCK_FILE_fd = fd; //save acquired fd
 }
 
-void unlock(void) {
+static void excl_unlock(void) {
     if (LOCK_FILE_fd >= 0) {
         close(LOCK_FILE_fd);
         LOCK_FILE_fd = -1;
@@ -75,9 +369,376 @@ void unlock(void) {
     unlink(LOCK_FILE);
 }
 
-void writemessage(const char *message, int count) {
+void lock(void) {
+    switch (lock_kind) {
+    case LOCK_FUTEX: futex_lock(); break;
+    case LOCK_OFD: ofd_lock(); break;
+    case LOCK_EXCL: excl_lock(); break;
+    }
+}
+
+void unlock(void) {
+    switch (lock_kind) {
+    case LOCK_FUTEX: futex_unlock(); break;
+    case LOCK_OFD: ofd_unlock(); break;
+    case LOCK_EXCL: excl_unlock(); break;
+    }
+}
+
+int writemessage(byte_buf_t *block, const char *message, int count) {
+    size_t len = strlen(message);
+    for (int i = 0; i < count; i++) {
+        if (byte_buf_append(block, message, len) == -1 || byte_buf_append(block, "\n", 1) == -1) {
+            return -1;
+        }
+        usleep((rand() % 100) * 1000); // Random delay between 0 and 99 milliseconds
+    }
+    return 0;
+}
+
+//shared between benchmark children, handoff = time from one release to the next contended acquire
+typedef struct {
+    atomic_ullong last_release_ns;
+    atomic_ullong handoff_ns_total;
+    atomic_ullong handoffs;
+} bench_stats_t;
+
+static const char *lock_kind_name(enum lock_kind kind) {
+    return kind == LOCK_FUTEX ? "futex" : kind == LOCK_OFD ? "ofd" : "excl";
+}
+
+//lock() with timing: returns how long we waited, and *handoff_ns is the release to acquire
+//latency when we actually waited for somebody else's release, 0 otherwise
+static unsigned long long timed_lock(atomic_ullong *last_release_ns, unsigned long long *handoff_ns) {
+    unsigned long long asked = now_ns();
+    lock();
+    unsigned long long got = now_ns();
+    unsigned long long released = atomic_load(last_release_ns);
+    *handoff_ns = released > asked ? got - released : 0;
+    return got - asked;
+}
+
+static void timed_unlock(atomic_ullong *last_release_ns) {
+    atomic_store(last_release_ns, now_ns());
+    unlock();
+}
+
+//empty critical sections from 1, 2, 4 ... max_children processes, one line per child count
+int run_lock_benchmark(int max_children, int acquisitions) {
+    bench_stats_t *stats = mmap(NULL, sizeof(bench_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap bench stats");
+        return 1;
+    }
+    for (int children = 1; ; children = children * 2 > max_children && children < max_children ? max_children : children * 2) {
+        memset(stats, 0, sizeof(*stats));
+        fflush(stdout);//children must not inherit and re-emit buffered table lines
+        unsigned long long start = now_ns();
+        for (int c = 0; c < children; c++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork error");
+                return 1;
+            }
+            if (pid == 0) {
+                for (int i = 0; i < acquisitions; i++) {
+                    unsigned long long handoff;
+                    timed_lock(&stats->last_release_ns, &handoff);
+                    if (handoff > 0) {
+                        atomic_fetch_add(&stats->handoff_ns_total, handoff);
+                        atomic_fetch_add(&stats->handoffs, 1);
+                    }
+                    timed_unlock(&stats->last_release_ns);
+                }
+                exit(0);
+            }
+        }
+        pid_t reaped;
+        while ((reaped = wait(NULL)) > 0)
+            lock_reaped(reaped);
+        double seconds = (now_ns() - start) / 1e9;
+        unsigned long long handoffs = atomic_load(&stats->handoffs);
+        double avg_handoff_us = handoffs ? atomic_load(&stats->handoff_ns_total) / 1e3 / handoffs : 0.0;
+        printf("%-6s %8d %14.0f %16.2f\n", lock_kind_name(lock_kind), children,
+               (double)children * acquisitions / seconds, avg_handoff_us);
+        if (children >= max_children) break;
+    }
+    munmap(stats, sizeof(bench_stats_t));
+    return 0;
+}
+
+//shared by the driver's workers, samples[] keeps the first DRIVER_SAMPLES contended handoffs
+typedef struct {
+    atomic_ullong last_release_ns;
+    atomic_ullong wait_ns_total;
+    atomic_ullong records;
+    atomic_ullong next_sample;
+    unsigned long long samples[DRIVER_SAMPLES];
+} driver_stats_t;
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+//pin the calling worker to the n-th CPU it is allowed to run on, wrapping around
+static void pin_worker(int n) {
+    cpu_set_t allowed, mine;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+    int cpus = CPU_COUNT(&allowed);
+    if (cpus <= 0) return;
+    int want = n % cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && want-- == 0) {
+            CPU_ZERO(&mine);
+            CPU_SET(cpu, &mine);
+            sched_setaffinity(0, sizeof(mine), &mine);
+            return;
+        }
+    }
+}
+
+//worker w serves writers w, w + workers, ... and writes one locked record per writer per round
+static int driver_worker(driver_stats_t *stats, int fd, int w, int workers, int writers, int records) {
+    char line[64];
+    unsigned long long waited = 0, done = 0;
+    pin_worker(w);
+    for (int r = 0; r < records; r++) {
+        for (int wr = w; wr < writers; wr += workers) {
+            int len = snprintf(line, sizeof(line), "writer %d record %d\n", wr, r);
+            unsigned long long handoff;
+            waited += timed_lock(&stats->last_release_ns, &handoff);
+            int res = write_all(fd, line, len);
+            timed_unlock(&stats->last_release_ns);
+            if (res == -1) return -1;
+            done++;
+            if (handoff > 0) {
+                unsigned long long idx = atomic_fetch_add(&stats->next_sample, 1);
+                if (idx < DRIVER_SAMPLES) stats->samples[idx] = handoff;
+            }
+        }
+    }
+    atomic_fetch_add(&stats->wait_ns_total, waited);
+    atomic_fetch_add(&stats->records, done);
+    return 0;
+}
+
+//fixed pool of pinned worker processes multiplexing many logical writers onto one shared output,
+//one report line per lock kind
+int run_driver(int writers, int records, int workers, int all_kinds) {
+    driver_stats_t *stats = mmap(NULL, sizeof(driver_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap driver stats");
+        return 1;
+    }
+    printf("%-6s %8s %8s %10s %10s %14s %14s %16s\n", "lock", "workers", "writers", "records", "wall(s)",
+           "records/sec", "avg wait(us)", "p99 handoff(us)");
+    enum lock_kind requested = lock_kind;
+    for (int kind = LOCK_FUTEX; kind <= LOCK_EXCL; kind++) {
+        if (!all_kinds && kind != (int)requested) continue;
+        lock_kind = kind;
+        lock_init();
+        atomic_store(&stats->last_release_ns, 0);
+        atomic_store(&stats->wait_ns_total, 0);
+        atomic_store(&stats->records, 0);
+        atomic_store(&stats->next_sample, 0);
+        int fd = open(DRIVER_OUTPUT, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("open driver output");
+            return 1;
+        }
+        fflush(stdout);
+        unsigned long long start = now_ns();
+        for (int w = 0; w < workers; w++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork error");
+                return 1;
+            }
+            if (pid == 0) {
+                exit(driver_worker(stats, fd, w, workers, writers, records) == 0 ? 0 : EXIT_FAILURE);
+            }
+        }
+        int failed = 0, status;
+        pid_t reaped;
+        while ((reaped = wait(&status)) > 0) {
+            lock_reaped(reaped);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+        }
+        double seconds = (now_ns() - start) / 1e9;
+        close(fd);
+        if (failed) {
+            fprintf(stderr, "driver: a worker failed\n");
+            return 1;
+        }
+        unsigned long long done = atomic_load(&stats->records);
+        unsigned long long nsamples = atomic_load(&stats->next_sample);
+        if (nsamples > DRIVER_SAMPLES) nsamples = DRIVER_SAMPLES;
+        double p99_us = 0.0;
+        if (nsamples > 0) {
+            qsort(stats->samples, nsamples, sizeof(stats->samples[0]), cmp_ull);
+            p99_us = stats->samples[nsamples * 99 / 100] / 1e3;
+        }
+        printf("%-6s %8d %8d %10llu %10.3f %14.0f %14.2f %16.2f\n", lock_kind_name(lock_kind), workers, writers,
+               done, seconds, done / seconds, done ? atomic_load(&stats->wait_ns_total) / 1e3 / done : 0.0, p99_us);
+    }
+    munmap(stats, sizeof(driver_stats_t));
+    return 0;
+}
+
+static ring_slot_t *ring_slot(msg_ring_t *ring, unsigned long long pos) {
+    return (ring_slot_t *)(ring->slots + (pos % RING_SLOTS) * ring->slot_size);
+}
+
+//must run in the parent before fork, like lock_init
+msg_ring_t *ring_create(size_t max_message_len) {
+    size_t slot_size = (sizeof(ring_slot_t) + max_message_len + 1 + 63) & ~(size_t)63;
+    size_t map_size = sizeof(msg_ring_t) + RING_SLOTS * slot_size;
+    msg_ring_t *ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap message ring");
+        return NULL;
+    }
+    ring->slot_size = slot_size;
+    ring->map_size = map_size;
+    for (unsigned long long pos = 0; pos < RING_SLOTS; pos++) {
+        atomic_store(&ring_slot(ring, pos)->seq, pos);
+    }
+    return ring;
+}
+
+//claim a slot with one CAS, fill it, then publish it by moving its sequence to pos + 1
+static void ring_publish(msg_ring_t *ring, unsigned int child, const char *message, size_t len) {
+    unsigned long long pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_slot_t *slot;
+    for (;;) {
+        slot = ring_slot(ring, pos);
+        unsigned long long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long long diff = (long long)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            sched_yield();//ring is full, let the consumer catch up
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    slot->child = child;
+    slot->len = len + 1;
+    memcpy(slot->data, message, len);
+    slot->data[len] = '\n';
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add(&ring->published, 1);
+    if (atomic_load(&ring->consumer_idle)) {
+        futex(&ring->published, FUTEX_WAKE, 1, NULL, 0);
+    }
+}
+
+void ring_writemessage(msg_ring_t *ring, unsigned int child, const char *message, int count) {
+    size_t len = strlen(message);
     for (int i = 0; i < count; i++) {
-        printf("%s\n", message);
+        ring_publish(ring, child, message, len);
         usleep((rand() % 100) * 1000); // Random delay between 0 and 99 milliseconds
     }
 }
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            perror("write error");
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int byte_buf_append(byte_buf_t *b, const char *src, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len) cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            perror("realloc");
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+    return 0;
+}
+
+//drain until every child has exited and the ring is empty, writing output in RING_OUT_SIZE batches
+int ring_drain(msg_ring_t *ring, pid_t *pids, int num_of_children, enum ring_order order) {
+    byte_buf_t out = {0};
+    byte_buf_t *per_child = calloc(num_of_children, sizeof(byte_buf_t));
+    if (!per_child) {
+        perror("calloc");
+        return 1;
+    }
+    unsigned long long tail = 0;
+    int live = num_of_children;
+    int res = 0;
+    for (;;) {
+        ring_slot_t *slot = ring_slot(ring, tail);
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == tail + 1) {
+            byte_buf_t *dst = order == RING_ORDER_CHILD ? &per_child[slot->child] : &out;
+            if (byte_buf_append(dst, slot->data, slot->len) == -1) res = 1;
+            atomic_store_explicit(&slot->seq, tail + RING_SLOTS, memory_order_release);
+            tail++;
+            if (out.len >= RING_OUT_SIZE) {
+                if (write_all(STDOUT_FILENO, out.data, out.len) == -1) res = 1;
+                out.len = 0;
+            }
+            continue;
+        }
+        //ring is empty: push out what we have, then reap finished children
+        if (out.len > 0) {
+            if (write_all(STDOUT_FILENO, out.data, out.len) == -1) res = 1;
+            out.len = 0;
+        }
+        for (int i = 0; i < num_of_children; i++) {
+            if (pids[i] > 0 && waitpid(pids[i], NULL, WNOHANG) == pids[i]) {
+                pids[i] = 0;
+                live--;
+                //everything this child published is already in the ring, its block is complete
+                if (order == RING_ORDER_CHILD) {
+                    while (atomic_load_explicit(&ring_slot(ring, tail)->seq, memory_order_acquire) == tail + 1) {
+                        slot = ring_slot(ring, tail);
+                        if (byte_buf_append(&per_child[slot->child], slot->data, slot->len) == -1) res = 1;
+                        atomic_store_explicit(&slot->seq, tail + RING_SLOTS, memory_order_release);
+                        tail++;
+                    }
+                    if (per_child[i].len > 0 && write_all(STDOUT_FILENO, per_child[i].data, per_child[i].len) == -1) res = 1;
+                    per_child[i].len = 0;
+                }
+            }
+        }
+        if (live == 0 && atomic_load_explicit(&ring_slot(ring, tail)->seq, memory_order_acquire) != tail + 1) {
+            break;
+        }
+        //sleep until a producer publishes, with a timeout so exited children get reaped
+        unsigned int seen = atomic_load(&ring->published);
+        atomic_store(&ring->consumer_idle, 1);
+        if (atomic_load_explicit(&ring_slot(ring, tail)->seq, memory_order_acquire) != tail + 1) {
+            struct timespec timeout = {.tv_sec = 0, .tv_nsec = LOCK_RECHECK_NS};
+            futex(&ring->published, FUTEX_WAIT, seen, &timeout, 0);
+        }
+        atomic_store(&ring->consumer_idle, 0);
+    }
+    for (int i = 0; i < num_of_children; i++) {
+        free(per_child[i].data);
+    }
+    free(per_child);
+    free(out.data);
+    munmap(ring, ring->map_size);
+    return res;
+}
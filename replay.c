@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include "buffered_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+// Re-executes the library calls of a trace (buffered_trace.h) against scratch files, with the buffered
+// library in any mode and buffer size or with raw syscalls, and reports latency and throughput per call.
+
+#define MAX_OPS 64
+#define FILL_CHUNK (1024 * 1024)
+
+typedef struct {
+    uint32_t id;            // Handle id in the trace
+    buffered_file_t *bf;    // Buffered backend
+    int fd;                 // Raw backend
+    int append;
+    off_t offset;           // Raw backend: the logical offset
+} replay_handle_t;
+
+typedef struct {
+    uint64_t *lat_ns;
+    size_t count, cap;
+    uint64_t bytes;
+} op_stats_t;
+
+static const char *op_name(int op) {
+    static const char *names[] = {
+        [TRACE_OPEN] = "open", [TRACE_CLOSE] = "close", [TRACE_READ] = "read", [TRACE_WRITE] = "write",
+        [TRACE_FLUSH] = "flush", [TRACE_SEEK] = "seek", [TRACE_FILL] = "fill", [TRACE_LOCK_SHARED] = "lock sh",
+        [TRACE_LOCK_EXCLUSIVE] = "lock ex", [TRACE_UNLOCK] = "unlock", [TRACE_BEGIN] = "begin",
+        [TRACE_COMMIT] = "commit", [TRACE_ABORT] = "abort", [TRACE_PUBLISH] = "publish", [TRACE_SYS_READ] = "sys read",
+        [TRACE_SYS_WRITE] = "sys write", [TRACE_SYS_PREAD] = "sys pread", [TRACE_SYS_PWRITE] = "sys pwrite",
+        [TRACE_SYS_PWRITEV] = "sys pwritev", [TRACE_SYS_WRITEV] = "sys writev", [TRACE_SYS_FSYNC] = "sys fsync",
+        [TRACE_SYS_MSYNC] = "sys msync",
+    };
+    if (op == TRACE_DROPPED) return "dropped";
+    return op > 0 && op < MAX_OPS && names[op] ? names[op] : "?";
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static trace_record_t *load_trace(const char *path, size_t *count) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { perror("replay: open trace"); return NULL; }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC ||
+        header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "replay: %s is not a trace file\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    size_t cap = 1024, n = 0;
+    trace_record_t *records = malloc(cap * sizeof(trace_record_t));
+    while (records && fread(&records[n], sizeof(trace_record_t), 1, fp) == 1) {
+        if (++n == cap) {
+            cap *= 2;
+            trace_record_t *grown = realloc(records, cap * sizeof(trace_record_t));
+            if (!grown) { free(records); records = NULL; break; }
+            records = grown;
+        }
+    }
+    fclose(fp);
+    *count = n;
+    return records;
+}
+
+static int by_time(const void *a, const void *b) {
+    const trace_record_t *x = a, *y = b;
+    if (x->ts_ns != y->ts_ns) return x->ts_ns < y->ts_ns ? -1 : 1;
+    if (x->thread != y->thread) return x->thread < y->thread ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);//keep the order of one thread's records
+}
+
+static int by_value(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static replay_handle_t *find_handle(replay_handle_t *handles, size_t n, uint32_t id) {
+    for (size_t i = 0; i < n; i++) {
+        if (handles[i].id == id) return &handles[i];
+    }
+    return NULL;
+}
+
+//handles of the traced program that opened the same inode share one scratch file
+static void scratch_path(char *buf, size_t size, const char *dir, int64_t file) {
+    snprintf(buf, size, "%s/replay_%lld.dat", dir, (long long)file);
+}
+
+//reads need data to find: fill each file up to the furthest byte the trace reads from it
+static int prepare_files(trace_record_t *records, size_t n, const char *dir) {
+    size_t num_opens = 0, num_files = 0;
+    for (size_t i = 0; i < n; i++) num_opens += records[i].op == TRACE_OPEN;
+    uint32_t *open_handle = malloc((num_opens + 1) * sizeof(uint32_t));
+    size_t *open_file = malloc((num_opens + 1) * sizeof(size_t));
+    int64_t *files = malloc((num_opens + 1) * sizeof(int64_t));
+    uint64_t *extent = calloc(num_opens + 1, sizeof(uint64_t));
+    char *chunk = malloc(FILL_CHUNK);
+    int res = -1;
+    if (!open_handle || !open_file || !files || !extent || !chunk) goto out;
+    memset(chunk, 'r', FILL_CHUNK);
+    size_t opens = 0;
+    for (size_t i = 0; i < n; i++) {
+        trace_record_t *r = &records[i];
+        if (r->op == TRACE_OPEN) {
+            size_t f = 0;
+            while (f < num_files && files[f] != r->offset) f++;
+            if (f == num_files) files[num_files++] = r->offset;
+            open_handle[opens] = r->handle;
+            open_file[opens++] = f;
+        } else if (r->op == TRACE_READ && r->offset >= 0) {
+            for (size_t k = opens; k-- > 0; ) {//the latest open of this handle
+                if (open_handle[k] == r->handle) {
+                    uint64_t end = (uint64_t)r->offset + r->size;
+                    if (end > extent[open_file[k]]) extent[open_file[k]] = end;
+                    break;
+                }
+            }
+        }
+    }
+    for (size_t f = 0; f < num_files; f++) {
+        char path[4096];
+        scratch_path(path, sizeof(path), dir, files[f]);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) { perror("replay: create scratch file"); goto out; }
+        for (uint64_t done = 0; done < extent[f]; done += FILL_CHUNK) {
+            size_t len = extent[f] - done < FILL_CHUNK ? extent[f] - done : FILL_CHUNK;
+            if (pwrite(fd, chunk, len, done) != (ssize_t)len) { perror("replay: fill"); close(fd); goto out; }
+        }
+        close(fd);
+    }
+    res = 0;
+out:
+    free(open_handle);
+    free(open_file);
+    free(files);
+    free(extent);
+    free(chunk);
+    return res;
+}
+
+static void record_latency(op_stats_t *stats, uint64_t ns, uint64_t bytes) {
+    if (stats->count == stats->cap) {
+        stats->cap = stats->cap ? stats->cap * 2 : 1024;
+        stats->lat_ns = realloc(stats->lat_ns, stats->cap * sizeof(uint64_t));
+        if (!stats->lat_ns) { perror("replay"); exit(1); }
+    }
+    stats->lat_ns[stats->count++] = ns;
+    stats->bytes += bytes;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-B buffered|raw] [-s buffer_size] [-f mmap|nohints|rangelock|preappend]... "
+                    "[-p] [-d dir] [-c] trace_file\n", prog);
+    fprintf(stderr, "  -p  keep the original spacing between calls, -c count the syscalls of the replay\n");
+}
+
+int main(int argc, char *argv[]) {
+    int raw = 0, pace = 0, count_syscalls = 0, extra_flags = 0;
+    const char *dir = ".";
+    int opt;
+    while ((opt = getopt(argc, argv, "B:s:f:pd:c")) != -1) {
+        switch (opt) {
+        case 'B': raw = strcmp(optarg, "raw") == 0; break;
+        case 's':
+            if (buffered_set_buffer_size(strtoul(optarg, NULL, 10)) == -1) { usage(argv[0]); return 1; }
+            break;
+        case 'f':
+            if (strcmp(optarg, "mmap") == 0) extra_flags |= O_MMAPWRITE;
+            else if (strcmp(optarg, "nohints") == 0) extra_flags |= O_NOHINTS;
+            else if (strcmp(optarg, "rangelock") == 0) extra_flags |= O_RANGELOCK;
+            else if (strcmp(optarg, "preappend") == 0) extra_flags |= O_PREAPPEND;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'p': pace = 1; break;
+        case 'd': dir = optarg; break;
+        case 'c': count_syscalls = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    size_t n;
+    trace_record_t *records = load_trace(argv[optind], &n);
+    if (!records) return 1;
+    qsort(records, n, sizeof(trace_record_t), by_time);
+
+    //what the traced program did, library calls and the syscalls underneath them
+    size_t traced[MAX_OPS] = {0};
+    size_t max_size = 1, num_handles = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].op < MAX_OPS) traced[records[i].op]++;
+        if ((records[i].op == TRACE_READ || records[i].op == TRACE_WRITE) && records[i].size > max_size) {
+            max_size = records[i].size;
+        }
+        if (records[i].op == TRACE_OPEN) num_handles++;
+    }
+    printf("trace: %zu records\n", n);
+    if (traced[TRACE_DROPPED]) {
+        printf("  warning: the tracer lost records, the replay is incomplete\n");
+    }
+    for (int op = 1; op < MAX_OPS; op++) {
+        if (traced[op]) printf("  %-12s %10zu\n", op_name(op), traced[op]);
+    }
+    if (prepare_files(records, n, dir) == -1) return 1;
+
+    char *data = malloc(max_size);
+    replay_handle_t *handles = calloc(num_handles ? num_handles : 1, sizeof(replay_handle_t));
+    if (!data || !handles) { perror("replay"); return 1; }
+    memset(data, 'w', max_size);
+    char trace_path[4096];
+    snprintf(trace_path, sizeof(trace_path), "%s/replay_syscalls.trace", dir);
+    if (count_syscalls && !raw && buffered_trace_start(trace_path) == -1) {
+        perror("replay: trace start");
+        return 1;
+    }
+
+    op_stats_t stats[MAX_OPS] = {{0}};
+    size_t open_handles = 0, failures = 0;
+    uint64_t start = now_ns();
+    uint64_t trace_start = n ? records[0].ts_ns : 0;
+    for (size_t i = 0; i < n; i++) {
+        trace_record_t *r = &records[i];
+        if (r->op >= TRACE_SYS_READ) continue;//syscalls follow from the calls, they are not replayed
+        if (pace) {
+            uint64_t due = start + (r->ts_ns - trace_start);
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec ts = {(due - now) / 1000000000ULL, (due - now) % 1000000000ULL};
+                nanosleep(&ts, NULL);
+            }
+        }
+        replay_handle_t *h = find_handle(handles, open_handles, r->handle);
+        if (r->op != TRACE_OPEN && h == NULL) continue;//opened before tracing started
+        uint64_t t0 = now_ns();
+        ssize_t res = 0;
+        switch (r->op) {
+        case TRACE_OPEN: {
+            char path[4096];
+            scratch_path(path, sizeof(path), dir, r->offset);
+            //the scratch file was filled for the reads that follow, a recorded O_TRUNC would empty it again
+            int flags = ((int)r->size & ~(O_EXCL | O_TRUNC)) | O_CREAT | extra_flags;
+            if (flags & O_MMAPWRITE) flags = (flags & ~(O_ACCMODE | O_APPEND | O_PREAPPEND)) | O_RDWR;
+            h = &handles[open_handles++];
+            h->id = r->handle;
+            h->append = (flags & O_APPEND) != 0;
+            h->offset = 0;
+            if (raw) {
+                h->fd = open(path, flags & ~(O_PREAPPEND | O_MMAPWRITE | O_RANGELOCK | O_NOHINTS), 0644);
+                res = h->fd;
+            } else {
+                h->bf = buffered_open(path, flags, 0644);
+                res = h->bf ? 0 : -1;
+            }
+            break;
+        }
+        case TRACE_CLOSE:
+            res = raw ? close(h->fd) : buffered_close(h->bf);
+            *h = handles[--open_handles];
+            break;
+        case TRACE_READ:
+            if (raw) {
+                res = pread(h->fd, data, r->size, h->offset);
+                if (res > 0) h->offset += res;
+            } else {
+                res = buffered_read(h->bf, data, r->size);
+            }
+            break;
+        case TRACE_WRITE:
+            if (raw) {
+                res = h->append ? write(h->fd, data, r->size) : pwrite(h->fd, data, r->size, h->offset);
+                if (res > 0 && !h->append) h->offset += res;
+            } else {
+                res = buffered_write(h->bf, data, r->size);
+            }
+            break;
+        case TRACE_FLUSH:
+            res = raw ? 0 : buffered_flush(h->bf);
+            break;
+        case TRACE_SEEK:
+            if (raw) {
+                off_t end = lseek(h->fd, 0, SEEK_END);
+                off_t base = r->size == SEEK_SET ? 0 : r->size == SEEK_CUR ? h->offset : end;
+                h->offset = base + r->offset;
+                res = 0;
+            } else {
+                res = buffered_seek(h->bf, r->offset, r->size) == -1 ? -1 : 0;
+            }
+            break;
+        case TRACE_FILL:
+            res = raw ? 0 : buffered_fill(h->bf);//the raw backend has no buffer, its reads go to the file
+            break;
+        case TRACE_LOCK_SHARED:
+        case TRACE_LOCK_EXCLUSIVE:
+        case TRACE_UNLOCK:
+            if (raw) {
+                short type = r->op == TRACE_UNLOCK ? F_UNLCK : r->op == TRACE_LOCK_SHARED ? F_RDLCK : F_WRLCK;
+                struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = r->offset, .l_len = r->size};
+                res = fcntl(h->fd, r->op == TRACE_UNLOCK ? F_OFD_SETLK : F_OFD_SETLKW, &fl);
+            } else if (r->op == TRACE_UNLOCK) {
+                res = buffered_unlock(h->bf, r->offset, r->size);
+            } else {
+                int type = r->op == TRACE_LOCK_SHARED ? BUFFERED_LOCK_SHARED : BUFFERED_LOCK_EXCLUSIVE;
+                res = buffered_lock(h->bf, type, r->offset, r->size);
+            }
+            break;
+        //the raw backend writes straight through, it has nothing to stage or publish
+        case TRACE_BEGIN:
+            res = raw ? 0 : buffered_begin(h->bf);
+            break;
+        case TRACE_COMMIT:
+            res = raw ? 0 : buffered_commit(h->bf);
+            break;
+        case TRACE_ABORT:
+            res = raw ? 0 : buffered_abort(h->bf);
+            break;
+        case TRACE_PUBLISH:
+            res = raw ? 0 : buffered_publish(h->bf);
+            break;
+        }
+        uint64_t t1 = now_ns();
+        if (res < 0) failures++;
+        uint64_t bytes = (r->op == TRACE_READ || r->op == TRACE_WRITE) && res > 0 ? (uint64_t)res : 0;
+        record_latency(&stats[r->op], t1 - t0, bytes);
+    }
+    for (size_t i = 0; i < open_handles; i++) {//handles the trace never closed
+        if (raw) close(handles[i].fd);
+        else buffered_close(handles[i].bf);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("\nreplay: %s backend%s\n", raw ? "raw" : "buffered", pace ? ", paced" : "");
+    printf("  %-8s %10s %12s %10s %10s %10s\n", "call", "count", "bytes", "p50 us", "p99 us", "max us");
+    uint64_t total_bytes = 0;
+    for (int op = 1; op < TRACE_SYS_READ; op++) {
+        op_stats_t *st = &stats[op];
+        if (st->count == 0) continue;
+        qsort(st->lat_ns, st->count, sizeof(uint64_t), by_value);
+        printf("  %-8s %10zu %12llu %10.2f %10.2f %10.2f\n", op_name(op), st->count, (unsigned long long)st->bytes,
+               st->lat_ns[st->count / 2] / 1e3, st->lat_ns[st->count * 99 / 100] / 1e3,
+               st->lat_ns[st->count - 1] / 1e3);
+        total_bytes += st->bytes;
+        free(st->lat_ns);
+    }
+    printf("  %.3f s, %.1f MB/s, %zu failed calls\n", seconds, total_bytes / seconds / (1024 * 1024), failures);
+
+    if (count_syscalls && !raw) {
+        buffered_trace_stop();
+        size_t m;
+        trace_record_t *own = load_trace(trace_path, &m);
+        size_t syscalls[MAX_OPS] = {0};
+        for (size_t i = 0; own && i < m; i++) {
+            if (own[i].op < MAX_OPS) syscalls[own[i].op]++;
+        }
+        printf("  syscalls:");
+        for (int op = TRACE_SYS_READ; op < MAX_OPS; op++) {
+            if (syscalls[op]) printf(" %s %zu", op_name(op) + 4, syscalls[op]);
+        }
+        printf("\n");
+        free(own);
+        remove(trace_path);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].op == TRACE_OPEN) {
+            char path[4096];
+            scratch_path(path, sizeof(path), dir, records[i].offset);
+            remove(path);
+        }
+    }
+    free(records);
+    free(data);
+    free(handles);
+    return 0;
+}
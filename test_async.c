@@ -0,0 +1,130 @@
+#include "buffered_open.h"
+#include "buffered_async.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define NUM_FILES 16
+#define WRITES_PER_FILE 100
+#define RECORD "0123456789"
+
+static int callbacks = 0;
+
+static void count_cb(buffered_file_t *bf, ssize_t result, int error, void *arg) {
+    (void)bf; (void)error; (void)arg;
+    if (result >= 0) callbacks++;
+}
+
+int main() {
+    printf("--- Starting async API tests ---\n");
+    int overall_status = TEST_PASS;
+    char names[NUM_FILES][32];
+    buffered_file_t *files[NUM_FILES];
+
+    // Test 1: Many in-flight writes over several handles, reaped by one thread
+    printf("\nTEST 1: %d writes on each of %d files, then a flush each.\n", WRITES_PER_FILE, NUM_FILES);
+    for (int f = 0; f < NUM_FILES; f++) {
+        snprintf(names[f], sizeof(names[f]), "test_async_%d.txt", f);
+        files[f] = buffered_open(names[f], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (!files[f]) return TEST_FAIL;
+    }
+    int submitted = 0;
+    for (int i = 0; i < WRITES_PER_FILE; i++) {
+        for (int f = 0; f < NUM_FILES; f++) {
+            if (buffered_write_async(files[f], RECORD, strlen(RECORD), count_cb, NULL) <= 0) return TEST_FAIL;
+            submitted++;
+        }
+    }
+    for (int f = 0; f < NUM_FILES; f++) {
+        if (buffered_flush_async(files[f], count_cb, NULL) <= 0) return TEST_FAIL;
+        submitted++;
+    }
+    int reaped = 0;
+    buffered_completion_t done[64];
+    while (reaped < submitted) {
+        int n = buffered_poll(done, 64, 1000);
+        if (n <= 0) break;
+        reaped += n;
+    }
+    if (reaped != submitted || callbacks != submitted) {
+        fprintf(stderr, "FAIL: Test 1 - Reaped %d, callbacks %d, submitted %d.\n", reaped, callbacks, submitted);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - All %d requests completed.\n", submitted);
+    }
+
+    // Test 2: Requests on one handle run in submission order, so the file reads back in order
+    printf("\nTEST 2: Content written in submission order.\n");
+    int status_2 = TEST_PASS;
+    for (int f = 0; f < NUM_FILES; f++) {
+        buffered_close(files[f]);
+        FILE *fp = fopen(names[f], "r");
+        char buf[16];
+        int records = 0;
+        while (fp && fread(buf, 1, strlen(RECORD), fp) == strlen(RECORD)) {
+            if (memcmp(buf, RECORD, strlen(RECORD)) != 0) status_2 = TEST_FAIL;
+            records++;
+        }
+        if (records != WRITES_PER_FILE) status_2 = TEST_FAIL;
+        if (fp) fclose(fp);
+    }
+    if (status_2 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 2 - File content out of order or incomplete.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - Every file holds %d whole records.\n", WRITES_PER_FILE);
+    }
+
+    // Test 3: An async read returns the data and the completion carries the token
+    printf("\nTEST 3: Async read of the first record.\n");
+    buffered_file_t *bf = buffered_open(names[0], O_RDONLY);
+    char buf[16] = {0};
+    buffered_token_t token = buffered_read_async(bf, buf, strlen(RECORD), NULL, NULL);
+    int n = buffered_poll(done, 1, -1);
+    if (n != 1 || done[0].token != token || done[0].result != (ssize_t)strlen(RECORD) || strcmp(buf, RECORD) != 0) {
+        fprintf(stderr, "FAIL: Test 3 - Wrong completion for the read.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - Read completed with its token.\n");
+    }
+    buffered_close(bf);
+
+    buffered_async_shutdown();
+
+    // Test 4: A pool that cannot start all its threads cleans up and can be started again
+    printf("\nTEST 4: Starting a pool with too little address space.\n");
+    struct rlimit old_limit, tight;
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL || fscanf(statm, "%ld", &pages) != 1) return TEST_FAIL;
+    fclose(statm);
+    getrlimit(RLIMIT_AS, &old_limit);
+    tight = old_limit;
+    tight.rlim_cur = pages * 4096 + 64 * 1024 * 1024;//room for a few thread stacks, not 64
+    setrlimit(RLIMIT_AS, &tight);
+    int started = buffered_async_init(64);
+    int start_error = errno;
+    setrlimit(RLIMIT_AS, &old_limit);
+    if (started != -1 || start_error != EAGAIN || buffered_async_init(2) != 0) {
+        fprintf(stderr, "FAIL: Test 4 - init returned %d (%s), then could not start again.\n", started,
+                strerror(start_error));
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 4 - The partial pool was torn down and a new one started.\n");
+    }
+    buffered_async_shutdown();
+
+    for (int f = 0; f < NUM_FILES; f++) {
+        remove(names[f]);
+    }
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All async API tests passed! ***\n");
+    } else {
+        fprintf(stderr, "\n*** FAIL: Some async API tests failed. ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,203 @@
+#include "buffered_open.h"
+#include "buffered_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_FILE "test_cache.dat"
+#define FILE_SIZE (16 * CACHE_BLOCK_SIZE + 100)
+
+static char cache_name[64];
+
+//reads the whole file through the cache and checks it against expected, 1 if it matches
+static int read_all(buffered_cache_t *cache, const char *expected, size_t size) {
+    char *buf = malloc(size + 1);
+    buffered_file_t *bf = buffered_open(TEST_FILE, O_RDONLY);
+    if (!bf || !buf || buffered_set_cache(bf, cache) == -1) return 0;
+    ssize_t got = buffered_read(bf, buf, size + 1);
+    int ok = got == (ssize_t)size && memcmp(buf, expected, size) == 0;
+    buffered_close(bf);
+    free(buf);
+    return ok;
+}
+
+//the same in a separate process attached by name, which is what the cache is for.
+//Returns 1 if it read the right data with at least min_hits blocks served from the cache
+static int read_in_child(const char *expected, size_t size, unsigned long min_hits) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        buffered_cache_t *cache = buffered_cache_attach(cache_name, 0);
+        unsigned long hits = 0;
+        int ok = cache && read_all(cache, expected, size);
+        if (cache) buffered_cache_stats(cache, &hits, NULL);
+        _exit(ok && hits >= min_hits ? 0 : 1);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main() {
+    printf("--- Starting shared block cache tests ---\n");
+    int overall_status = TEST_PASS;
+    snprintf(cache_name, sizeof(cache_name), "/buffered_test_cache.%d", (int)getpid());
+    buffered_cache_unlink(cache_name);
+
+    char *data = malloc(FILE_SIZE + CACHE_BLOCK_SIZE);
+    for (int i = 0; i < FILE_SIZE; i++) data[i] = 'a' + i % 23;
+    FILE *fp = fopen(TEST_FILE, "w");
+    if (!fp || fwrite(data, 1, FILE_SIZE, fp) != FILE_SIZE) return TEST_FAIL;
+    fclose(fp);
+
+    //room enough that no set of four ways overflows and evicts a block the tests expect to hit
+    buffered_cache_t *cache = buffered_cache_attach(cache_name, 16384 * CACHE_BLOCK_SIZE);
+    if (!cache) {
+        perror("buffered_cache_attach");
+        return TEST_FAIL;
+    }
+
+    // Test 1: One process reads the file, another one finds every block in the cache
+    printf("\nTEST 1: Blocks read by one process are served to another.\n");
+    unsigned long hits, misses;
+    int status_1 = read_all(cache, data, FILE_SIZE);
+    buffered_cache_stats(cache, &hits, &misses);
+    if (misses != 17) status_1 = 0;//one per block, the probe at the end of file is a hit
+    if (!read_in_child(data, FILE_SIZE, 17)) status_1 = 0;
+    if (!status_1) {
+        fprintf(stderr, "FAIL: Test 1 - Blocks not shared (%lu hits, %lu misses).\n", hits, misses);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - The second process read all 17 blocks from the cache.\n");
+    }
+
+    // Test 2: A write through a cached handle is seen by the next reader in any process
+    printf("\nTEST 2: Writes invalidate the cached blocks.\n");
+    buffered_file_t *bf = buffered_open(TEST_FILE, O_RDWR);
+    if (!bf || buffered_set_cache(bf, cache) == -1) return TEST_FAIL;
+    char probe[8];
+    buffered_seek(bf, 3 * CACHE_BLOCK_SIZE - 2, SEEK_SET);
+    int status_2 = buffered_read(bf, probe, 4) == 4 && memcmp(probe, data + 3 * CACHE_BLOCK_SIZE - 2, 4) == 0;
+    buffered_seek(bf, 3 * CACHE_BLOCK_SIZE - 2, SEEK_SET);
+    buffered_write(bf, "WXYZ", 4);
+    memcpy(data + 3 * CACHE_BLOCK_SIZE - 2, "WXYZ", 4);
+    buffered_flush(bf);
+    if (!read_all(cache, data, FILE_SIZE) || !read_in_child(data, FILE_SIZE, 0)) status_2 = 0;
+    buffered_close(bf);
+
+    //the cached block at the end of file grows with an append
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_APPEND);
+    if (!bf || buffered_set_cache(bf, cache) == -1) return TEST_FAIL;
+    buffered_write(bf, "tail", 4);
+    memcpy(data + FILE_SIZE, "tail", 4);
+    buffered_close(bf);
+    if (!read_in_child(data, FILE_SIZE + 4, 0) || !read_all(cache, data, FILE_SIZE + 4)) status_2 = 0;
+
+    //a write past a hole in another region leaves the cached end of file block behind
+    char *grown = calloc(1, CACHE_REGION_SIZE + 3);
+    memcpy(grown, data, FILE_SIZE + 4);
+    memcpy(grown + CACHE_REGION_SIZE, "far", 3);
+    bf = buffered_open(TEST_FILE, O_RDWR);
+    if (!bf || buffered_set_cache(bf, cache) == -1) return TEST_FAIL;
+    if (!read_all(cache, data, FILE_SIZE + 4)) status_2 = 0;//opening the writer dropped the blocks
+    buffered_seek(bf, CACHE_REGION_SIZE, SEEK_SET);
+    buffered_write(bf, "far", 3);
+    buffered_close(bf);
+    if (!read_in_child(grown, CACHE_REGION_SIZE + 3, 0) || !read_all(cache, grown, CACHE_REGION_SIZE + 3)) status_2 = 0;
+    free(grown);
+    //back to the old contents through a handle with the cache, so the readers hear of the truncation
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_TRUNC);
+    if (!bf || buffered_set_cache(bf, cache) == -1) return TEST_FAIL;
+    buffered_write(bf, data, FILE_SIZE + 4);
+    buffered_close(bf);
+    if (!status_2) {
+        fprintf(stderr, "FAIL: Test 2 - A reader saw stale blocks.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - Positional writes, appends and writes past the end reached every reader.\n");
+    }
+
+    // Test 3: A stream has no blocks to cache
+    printf("\nTEST 3: Only buffered regular files take the cache.\n");
+    int fds[2];
+    int status_3 = pipe(fds) == 0;
+    buffered_file_t *stream = status_3 ? buffered_open_fd(fds[0], O_RDONLY) : NULL;
+    if (!stream || buffered_set_cache(stream, cache) != -1 || errno != EINVAL) status_3 = 0;
+    if (stream) buffered_close(stream);
+    if (status_3) close(fds[1]);
+    if (!status_3) {
+        fprintf(stderr, "FAIL: Test 3 - A pipe was given the cache.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - The pipe was refused with EINVAL.\n");
+    }
+
+    // Test 4: A file created again under the same inode number starts with nothing cached
+    printf("\nTEST 4: Blocks of a deleted file are not served for a new one.\n");
+    struct stat before, after;
+    int status_4 = read_all(cache, data, FILE_SIZE + 4) && stat(TEST_FILE, &before) == 0;
+    unlink(TEST_FILE);
+    for (int i = 0; i < FILE_SIZE + 4; i++) data[i] = 'A' + i % 19;
+    fp = fopen(TEST_FILE, "w");//a writer that does not know about the cache
+    if (!fp || fwrite(data, 1, FILE_SIZE + 4, fp) != FILE_SIZE + 4) return TEST_FAIL;
+    fclose(fp);
+    if (stat(TEST_FILE, &after) == -1 || !read_all(cache, data, FILE_SIZE + 4) ||
+        !read_in_child(data, FILE_SIZE + 4, 0)) {
+        status_4 = 0;
+    }
+    if (!status_4) {
+        fprintf(stderr, "FAIL: Test 4 - The new file was read from the old one's blocks.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 4 - The new file read back right (inode number %s).\n",
+               before.st_ino == after.st_ino ? "reused" : "not reused");
+    }
+
+    // Test 5: A window larger than a region caches the blocks of each region under that region's version
+    printf("\nTEST 5: Refills across a region boundary.\n");
+    size_t big_size = CACHE_REGION_SIZE + 64 * CACHE_BLOCK_SIZE;
+    char *big = malloc(big_size);
+    for (size_t i = 0; i < big_size; i++) big[i] = 'a' + i % 17;
+    fp = fopen(TEST_FILE, "w");
+    if (!fp || fwrite(big, 1, big_size, fp) != big_size) return TEST_FAIL;
+    fclose(fp);
+    //the second region is written until the two regions' versions differ
+    struct stat big_st;
+    bf = buffered_open(TEST_FILE, O_RDWR);
+    if (!bf || buffered_set_cache(bf, cache) == -1 || stat(TEST_FILE, &big_st) == -1) return TEST_FAIL;
+    off_t second = CACHE_REGION_SIZE / CACHE_BLOCK_SIZE;
+    for (int i = 0; i < 3; i++) {
+        buffered_seek(bf, CACHE_REGION_SIZE + 10, SEEK_SET);
+        buffered_write(bf, "mid", 3);
+        buffered_flush(bf);
+        if (buffered_cache_version(cache, big_st.st_dev, big_st.st_ino, second).region_gen !=
+            buffered_cache_version(cache, big_st.st_dev, big_st.st_ino, 0).region_gen) {
+            break;
+        }
+    }
+    memcpy(big + CACHE_REGION_SIZE + 10, "mid", 3);
+    buffered_close(bf);
+    buffered_set_buffer_size(big_size);//one window spans both regions
+    size_t blocks = big_size / CACHE_BLOCK_SIZE;
+    int status_5 = read_all(cache, big, big_size) && read_in_child(big, big_size, blocks);
+    buffered_set_buffer_size(BUFFER_SIZE);
+    free(big);
+    if (!status_5) {
+        fprintf(stderr, "FAIL: Test 5 - The second process did not find every block of both regions.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 5 - All %zu blocks of a two-region window were served from the cache.\n", blocks);
+    }
+
+    buffered_cache_detach(cache);
+    buffered_cache_unlink(cache_name);
+    unlink(TEST_FILE);
+    free(data);
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All shared block cache tests passed! ***\n");
+    }
+    return overall_status;
+}
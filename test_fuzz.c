@@ -0,0 +1,366 @@
+#include "buffered_open.h"
+#include "buffered_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_FILE "test_fuzz.dat"
+#define REF_FILE "test_fuzz.ref"
+#define SEQUENCES 12
+#define OPS 2000
+#define MAX_LEN (BUFFER_SIZE + BUFFER_SIZE / 2)  // Long writes and reads cross the buffer size
+#define MAX_HANDLES 2
+#define LOG_OPS 8                                // Ops printed before a mismatch
+
+// Differential fuzzing: the same random sequence of operations runs on buffered handles and on a
+// reference made of plain descriptors and raw syscalls. Every return value, every byte read and the
+// file contents after each full flush must match. Run as ./test_fuzz [seed [sequences]] to replay.
+
+typedef struct {
+    const char *name;
+    int flags;                  //added to O_RDWR | O_CREAT | O_TRUNC
+    int handles;                //buffered handles open on the file at once
+    int policy;                 //1 = timed, high-water and delimiter flushes
+    int cache;                  //1 = reads go through a shared block cache
+} fuzz_mode_t;
+
+static const fuzz_mode_t modes[] = {
+    { "default",   0,           1, 0, 0 },
+    { "append",    O_APPEND,    1, 0, 0 },
+    { "prepend",   O_PREAPPEND, 1, 0, 0 },
+    { "mmap",      O_MMAPWRITE, 1, 0, 0 },
+    { "rangelock", O_RANGELOCK, 1, 0, 0 },
+    { "nohints",   O_NOHINTS,   1, 0, 0 },
+    { "shared",    O_SHARED,    2, 0, 0 },
+    { "policy",    0,           1, 1, 0 },
+    { "cache",     0,           1, 0, 1 },
+    { "lowmem",    O_LOWMEM | O_SHARED, 2, 0, 0 },
+    { "lowmem+prepend", O_LOWMEM | O_PREAPPEND, 1, 0, 0 },
+    { "lowmem+policy", O_LOWMEM, 1, 1, 0 },
+};
+#define NUM_MODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+enum { OP_WRITE, OP_READ, OP_SEEK, OP_PUTC, OP_GETC, OP_UNGETC, OP_FLUSH, OP_CHECK };
+static const char *op_names[] = { "write", "read", "seek", "putc", "getc", "ungetc", "flush", "check" };
+
+typedef struct {
+    int kind;
+    int h;                      //handle the op runs on
+    size_t len;
+    off_t offset;
+    int whence;
+    int c;                      //putc and ungetc
+} fuzz_op_t;
+
+//the reference: the same file through plain descriptors. Prepended data only moves to the front when
+//the buffered handle flushes it, so the reference keeps it pending until the same points
+typedef struct {
+    int fd[MAX_HANDLES];
+    int prepend;
+    char pending[BUFFER_SIZE];
+    size_t pending_len;
+} ref_t;
+
+static uint64_t rng_state;
+static buffered_cache_t *cache;
+static char cache_name[64];
+static char wbuf[MAX_LEN], rbuf_a[MAX_LEN], rbuf_b[MAX_LEN];
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int ref_flush(ref_t *r) {
+    if (r->pending_len == 0) return 0;
+    struct stat st;
+    if (fstat(r->fd[0], &st) == -1) return -1;
+    char *old = malloc(st.st_size + 1);
+    if (old == NULL || pread(r->fd[0], old, st.st_size, 0) != st.st_size ||
+        pwrite(r->fd[0], r->pending, r->pending_len, 0) != (ssize_t)r->pending_len ||
+        pwrite(r->fd[0], old, st.st_size, r->pending_len) != st.st_size) {
+        free(old);
+        return -1;
+    }
+    free(old);
+    r->pending_len = 0;
+    return 0;
+}
+
+static ssize_t ref_write(ref_t *r, int h, const char *src, size_t len) {
+    if (!r->prepend) return write(r->fd[h], src, len);
+    //a full buffer is prepended on its own before the rest of the write goes in
+    for (size_t done = 0; done < len; ) {
+        if (r->pending_len == BUFFER_SIZE && ref_flush(r) == -1) return -1;
+        size_t n = len - done < BUFFER_SIZE - r->pending_len ? len - done : BUFFER_SIZE - r->pending_len;
+        memcpy(r->pending + r->pending_len, src + done, n);
+        r->pending_len += n;
+        done += n;
+    }
+    return lseek(r->fd[h], len, SEEK_CUR) == -1 ? -1 : (ssize_t)len;
+}
+
+static ssize_t ref_read(ref_t *r, int h, char *dst, size_t len) {
+    if (ref_flush(r) == -1) return -1;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(r->fd[h], dst + got, len - got);
+        if (n <= 0) return n == -1 && got == 0 ? -1 : (ssize_t)got;
+        got += n;
+    }
+    return got;
+}
+
+static off_t ref_seek(ref_t *r, int h, off_t offset, int whence) {
+    if (ref_flush(r) == -1) return -1;
+    return lseek(r->fd[h], offset, whence);
+}
+
+//the whole file into a malloc'd buffer
+static char *slurp(const char *path, off_t *size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    char *data = malloc(st.st_size + 1);
+    if (data == NULL || pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *size = st.st_size;
+    return data;
+}
+
+//1 if the file under test holds what the reference file holds; an mmap handle keeps the file
+//preallocated until close, so past the reference's end it may only have zeros
+static int same_contents(int preallocated) {
+    off_t size, ref_size;
+    char *data = slurp(TEST_FILE, &size);
+    char *ref = slurp(REF_FILE, &ref_size);
+    int ok = data != NULL && ref != NULL && (size == ref_size || (preallocated && size > ref_size)) &&
+             memcmp(data, ref, ref_size) == 0;
+    for (off_t i = ref_size; ok && i < size; i++) {
+        if (data[i] != 0) ok = 0;
+    }
+    free(data);
+    free(ref);
+    return ok;
+}
+
+static fuzz_op_t next_op(const fuzz_mode_t *mode, off_t size_hint, int last_getc, int getc_handle) {
+    fuzz_op_t op = { .h = (int)(rng() % mode->handles) };
+    unsigned roll = rng() % 100;
+    //mostly short transfers, now and then one longer than the buffer
+    op.len = rng() % 10 == 0 ? 1 + rng() % MAX_LEN : 1 + rng() % 64;
+    if (roll < 25) {
+        op.kind = OP_WRITE;
+    } else if (roll < 50) {
+        op.kind = OP_READ;
+    } else if (roll < 62) {
+        op.kind = OP_SEEK;
+        op.whence = rng() % 3 == 0 ? SEEK_SET : rng() % 2 ? SEEK_CUR : SEEK_END;
+        //around the data, with the odd hole past the end and the odd offset before the start
+        op.offset = (off_t)(rng() % (size_hint + 128));
+        if (op.whence != SEEK_SET) op.offset -= size_hint;
+        if (rng() % 50 == 0) op.offset = -1 - (off_t)(rng() % 8);
+    } else if (roll < 74) {
+        op.kind = OP_PUTC;
+        op.c = rng() % 8 == 0 ? '\n' : 'a' + (int)(rng() % 26);
+    } else if (roll < 86) {
+        op.kind = OP_GETC;
+    } else if (roll < 92 && last_getc >= 0) {
+        op.kind = OP_UNGETC;
+        op.h = getc_handle;//pushed back where it was read
+        op.c = last_getc;
+    } else if (roll < 97) {
+        op.kind = OP_FLUSH;
+    } else {
+        op.kind = OP_CHECK;
+    }
+    return op;
+}
+
+static void print_op(const fuzz_op_t *op, int index) {
+    fprintf(stderr, "  #%d %s h=%d", index, op_names[op->kind], op->h);
+    if (op->kind == OP_WRITE || op->kind == OP_READ) fprintf(stderr, " len=%zu", op->len);
+    if (op->kind == OP_SEEK) fprintf(stderr, " offset=%lld whence=%d", (long long)op->offset, op->whence);
+    if (op->kind == OP_PUTC || op->kind == OP_UNGETC) fprintf(stderr, " c=%d", op->c);
+    fprintf(stderr, "\n");
+}
+
+//one sequence on one mode, adds the time spent in each implementation. Returns 1 if they agreed
+static int run_sequence(const fuzz_mode_t *mode, uint64_t seed, long long *buffered_ns, long long *ref_ns) {
+    buffered_file_t *bf[MAX_HANDLES] = { NULL };
+    ref_t ref = { .prepend = (mode->flags & O_PREAPPEND) != 0 };
+    int ref_flags = O_RDWR | O_CREAT | O_TRUNC | (mode->flags & O_APPEND);
+    fuzz_op_t log[LOG_OPS];
+    int ok = 1;
+    int failed_at = -1;
+    rng_state = seed;
+    unlink(TEST_FILE);
+    unlink(REF_FILE);
+
+    long long t0 = now_ns();
+    for (int h = 0; h < mode->handles; h++) {
+        bf[h] = buffered_open(TEST_FILE, O_RDWR | O_CREAT | (h == 0 ? O_TRUNC : 0) | mode->flags, 0644);
+        if (bf[h] == NULL) return 0;
+        if (mode->policy) {
+            buffered_flush_policy_t policy = { .max_age_ms = 2, .high_water = 100, .delimiter = '\n' };
+            if (buffered_set_flush_policy(bf[h], &policy) == -1) return 0;
+        }
+        if (mode->cache && buffered_set_cache(bf[h], cache) == -1) return 0;
+    }
+    long long t1 = now_ns();
+    for (int h = 0; h < mode->handles; h++) {
+        ref.fd[h] = open(REF_FILE, ref_flags & ~(h == 0 ? 0 : O_TRUNC), 0644);
+        if (ref.fd[h] == -1) return 0;
+    }
+    long long t2 = now_ns();
+    *buffered_ns += t1 - t0;
+    *ref_ns += t2 - t1;
+
+    off_t size_hint = 0;
+    int last_getc = -1, getc_handle = 0;
+    for (int i = 0; i < OPS && ok; i++) {
+        fuzz_op_t op = next_op(mode, size_hint, last_getc, getc_handle);
+        log[i % LOG_OPS] = op;
+        last_getc = -1;
+        long long got = 0, want = 0;
+        if (op.kind == OP_WRITE) {
+            for (size_t k = 0; k < op.len; k++) wbuf[k] = rng() % 16 == 0 ? '\n' : 'A' + (int)(rng() % 26);
+        }
+        t0 = now_ns();
+        switch (op.kind) {
+            case OP_WRITE:  got = buffered_write(bf[op.h], wbuf, op.len); break;
+            case OP_READ:   got = buffered_read(bf[op.h], rbuf_a, op.len); break;
+            case OP_SEEK:   got = buffered_seek(bf[op.h], op.offset, op.whence); break;
+            case OP_PUTC:   got = buffered_putc(bf[op.h], op.c); break;
+            case OP_GETC:   got = buffered_getc(bf[op.h]); break;
+            case OP_UNGETC: got = buffered_ungetc(bf[op.h], op.c); break;
+            case OP_FLUSH:  got = buffered_flush(bf[op.h]); break;
+            case OP_CHECK:
+                for (int h = 0; h < mode->handles; h++) got |= buffered_flush(bf[h]);
+                break;
+        }
+        t1 = now_ns();
+        switch (op.kind) {
+            case OP_WRITE:  want = ref_write(&ref, op.h, wbuf, op.len); break;
+            case OP_READ:   want = ref_read(&ref, op.h, rbuf_b, op.len); break;
+            case OP_SEEK:   want = ref_seek(&ref, op.h, op.offset, op.whence); break;
+            case OP_PUTC: {
+                char c = (char)op.c;
+                want = ref_write(&ref, op.h, &c, 1) == 1 ? op.c : -1;
+                break;
+            }
+            case OP_GETC: {
+                unsigned char c;
+                want = ref_read(&ref, op.h, (char *)&c, 1) == 1 ? c : -1;
+                break;
+            }
+            case OP_UNGETC: want = lseek(ref.fd[op.h], -1, SEEK_CUR) == -1 ? -1 : op.c; break;
+            case OP_FLUSH:  want = ref_flush(&ref); break;
+            case OP_CHECK:  want = ref_flush(&ref); break;
+        }
+        t2 = now_ns();
+        *buffered_ns += t1 - t0;
+        *ref_ns += t2 - t1;
+
+        if (got != want || (op.kind == OP_READ && got > 0 && memcmp(rbuf_a, rbuf_b, got) != 0) ||
+            (op.kind == OP_CHECK && !same_contents(mode->flags & O_MMAPWRITE))) {
+            fprintf(stderr, "  mode %s, seed %llu: op %d returned %lld, the reference %lld\n",
+                    mode->name, (unsigned long long)seed, i, got, want);
+            ok = 0;
+            failed_at = i;
+        }
+        if (op.kind == OP_GETC && got >= 0) {
+            last_getc = (int)got;
+            getc_handle = op.h;
+        }
+        if (op.kind == OP_WRITE || op.kind == OP_SEEK) {
+            struct stat st;
+            if (fstat(ref.fd[0], &st) == 0) size_hint = st.st_size + (off_t)ref.pending_len;
+        }
+    }
+    if (failed_at >= 0) {
+        for (int i = failed_at >= LOG_OPS - 1 ? failed_at - LOG_OPS + 1 : 0; i <= failed_at; i++) {
+            print_op(&log[i % LOG_OPS], i);
+        }
+    }
+
+    t0 = now_ns();
+    for (int h = 0; h < mode->handles; h++) {
+        if (buffered_close(bf[h]) == -1) ok = 0;
+    }
+    t1 = now_ns();
+    if (ref_flush(&ref) == -1) ok = 0;
+    for (int h = 0; h < mode->handles; h++) close(ref.fd[h]);
+    t2 = now_ns();
+    *buffered_ns += t1 - t0;
+    *ref_ns += t2 - t1;
+    if (ok && !same_contents(0)) {
+        fprintf(stderr, "  mode %s, seed %llu: the files differ after close\n", mode->name, (unsigned long long)seed);
+        ok = 0;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 0x5eed2049;
+    int sequences = argc > 2 ? atoi(argv[2]) : SEQUENCES;
+    printf("--- Starting differential fuzz tests (seed %llu, %d sequences of %d ops) ---\n",
+           (unsigned long long)seed, sequences, OPS);
+    int overall_status = TEST_PASS;
+
+    snprintf(cache_name, sizeof(cache_name), "/buffered_test_fuzz.%d", (int)getpid());
+    buffered_cache_unlink(cache_name);
+    cache = buffered_cache_attach(cache_name, 256 * CACHE_BLOCK_SIZE);
+    if (!cache) {
+        perror("buffered_cache_attach");
+        return TEST_FAIL;
+    }
+
+    printf("\n%-14s %12s %12s %7s\n", "mode", "buffered ms", "raw ms", "ratio");
+    for (int m = 0; m < NUM_MODES; m++) {
+        long long buffered_ns = 0, ref_ns = 0;
+        int failures = 0;
+        for (int s = 0; s < sequences; s++) {
+            //every mode replays the same sequences; xorshift needs a non-zero state
+            uint64_t sequence_seed = seed + (uint64_t)s * 0x9e3779b97f4a7c15ULL;
+            if (!run_sequence(&modes[m], sequence_seed ? sequence_seed : 1, &buffered_ns, &ref_ns)) failures++;
+        }
+        printf("%-14s %12.2f %12.2f %7.2f\n", modes[m].name, buffered_ns / 1e6, ref_ns / 1e6,
+               ref_ns > 0 ? (double)buffered_ns / ref_ns : 0.0);
+        if (failures) {
+            fprintf(stderr, "FAIL: %s - %d of %d sequences diverged from the reference.\n",
+                    modes[m].name, failures, sequences);
+            overall_status = TEST_FAIL;
+        }
+    }
+
+    buffered_cache_detach(cache);
+    buffered_cache_unlink(cache_name);
+    unlink(TEST_FILE);
+    unlink(REF_FILE);
+    if (overall_status == TEST_PASS) {
+        printf("\nPASS: Every mode matched the raw-syscall reference op for op.\n");
+        printf("\n*** All differential fuzz tests passed! ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,130 @@
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define NUM_HANDLES 200
+#define LINE_SIZE 100
+
+static char names[NUM_HANDLES][64];
+
+static size_t lent_now(void) {
+    size_t lent;
+    buffered_pool_stats(&lent, NULL);
+    return lent;
+}
+
+//flushes the handle after a moment, from another thread
+static void *flush_later(void *arg) {
+    struct timespec ts = { 0, 50 * 1000000L };
+    nanosleep(&ts, NULL);
+    buffered_flush(arg);
+    return NULL;
+}
+
+int main() {
+    printf("--- Starting low-footprint mode tests ---\n");
+    int overall_status = TEST_PASS;
+    buffered_file_t *bf[NUM_HANDLES];
+    char line[LINE_SIZE], got[LINE_SIZE + 1];
+
+    // Test 1: Handles hold a buffer only while they have something pending or left to read
+    printf("\nTEST 1: Idle handles give their buffers back.\n");
+    int status_1 = 1;
+    for (int i = 0; i < NUM_HANDLES; i++) {
+        snprintf(names[i], sizeof(names[i]), "test_lowmem_%d.txt", i);
+        bf[i] = buffered_open(names[i], O_RDWR | O_CREAT | O_TRUNC | O_LOWMEM, 0644);
+        if (!bf[i]) return TEST_FAIL;
+        memset(line, 'a' + i % 26, LINE_SIZE);
+        if (buffered_write(bf[i], line, LINE_SIZE) != LINE_SIZE) status_1 = 0;
+    }
+    size_t pending = lent_now();
+    for (int i = 0; i < NUM_HANDLES; i++) {
+        if (buffered_flush(bf[i]) == -1) status_1 = 0;
+    }
+    size_t flushed = lent_now();
+    for (int i = 0; i < NUM_HANDLES; i++) {
+        memset(line, 'a' + i % 26, LINE_SIZE);
+        if (buffered_seek(bf[i], 0, SEEK_SET) != 0 || buffered_read(bf[i], got, LINE_SIZE + 1) != LINE_SIZE ||
+            memcmp(got, line, LINE_SIZE) != 0) {
+            status_1 = 0;
+        }
+    }
+    size_t drained = lent_now();
+    if (pending != NUM_HANDLES * (size_t)BUFFER_SIZE || flushed != 0 || drained != 0) status_1 = 0;
+    if (!status_1) {
+        fprintf(stderr, "FAIL: Test 1 - %zu bytes lent while pending, %zu after flushing, %zu after reading.\n",
+                pending, flushed, drained);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - %d handles held %zu bytes while writing and none once idle.\n", NUM_HANDLES, pending);
+    }
+
+    // Test 2: Reads and writes on one handle take turns on a single buffer
+    printf("\nTEST 2: One buffer per active handle.\n");
+    int status_2 = 1;
+    buffered_seek(bf[0], 0, SEEK_SET);
+    if (buffered_read(bf[0], got, 10) != 10 || lent_now() != BUFFER_SIZE) status_2 = 0;//the rest is still buffered
+    if (buffered_write(bf[0], "0123456789", 10) != 10 || lent_now() != BUFFER_SIZE) status_2 = 0;
+    buffered_seek(bf[0], 0, SEEK_SET);
+    if (buffered_read(bf[0], got, 25) != 25 || memcmp(got, "aaaaaaaaaa0123456789aaaaa", 25) != 0) status_2 = 0;
+    //the byte just read can be pushed back even after the read drained the window
+    buffered_seek(bf[0], LINE_SIZE - 1, SEEK_SET);
+    if (buffered_read(bf[0], got, 1) != 1 || lent_now() != 0 || buffered_ungetc(bf[0], 'a') != 'a' ||
+        buffered_getc(bf[0]) != 'a' || buffered_getc(bf[0]) != -1) {
+        status_2 = 0;
+    }
+    if (!status_2) {
+        fprintf(stderr, "FAIL: Test 2 - The directions did not share the buffer correctly.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - A read-then-write handle held one buffer and read its own write.\n");
+    }
+
+    // Test 3: At the cap a handle waits for a buffer, or fails when it cannot wait
+    printf("\nTEST 3: The pool limit applies backpressure.\n");
+    int status_3 = 1;
+    buffered_set_pool_limit(2 * BUFFER_SIZE, 0);
+    buffered_write(bf[1], "x", 1);
+    buffered_write(bf[2], "y", 1);
+    buffered_error_t err;
+    if (buffered_write(bf[3], "z", 1) != -1 || errno != ENOBUFS ||
+        buffered_error(bf[3], &err) != ENOBUFS || err.op != BUFFERED_OP_WRITE) {
+        status_3 = 0;
+    }
+    buffered_clearerr(bf[3]);
+    if (buffered_flush(bf[1]) == -1 || buffered_write(bf[3], "z", 1) != 1) status_3 = 0;
+    //with a wait the write goes through once another thread flushes
+    buffered_set_pool_limit(2 * BUFFER_SIZE, 5000);
+    pthread_t thread;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pthread_create(&thread, NULL, flush_later, bf[2]) != 0) return TEST_FAIL;
+    if (buffered_write(bf[4], "w", 1) != 1) status_3 = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_join(thread, NULL);
+    double waited = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (waited < 40) status_3 = 0;
+    buffered_set_pool_limit(0, 0);
+    if (!status_3) {
+        fprintf(stderr, "FAIL: Test 3 - The limit was not enforced (waited %.1f ms).\n", waited);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - ENOBUFS without a wait, %.0f ms of backpressure with one.\n", waited);
+    }
+
+    for (int i = 0; i < NUM_HANDLES; i++) {
+        if (buffered_close(bf[i]) == -1) overall_status = TEST_FAIL;
+        remove(names[i]);
+    }
+    if (lent_now() != 0) overall_status = TEST_FAIL;
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All low-footprint mode tests passed! ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE  //for pipe2
+#include "buffered_open.h"
+#include "buffered_reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define NUM_STREAMS 200
+#define LARGE_WRITE (1024 * 1024)
+
+static int echoed = 0;
+
+// Echo whatever arrived back to the peer, reading until the stream runs dry
+static void echo_cb(buffered_reactor_t *r, buffered_file_t *bf, int events, void *arg) {
+    (void)arg;
+    if (events & BUFFERED_EV_READ) {
+        char buf[256];
+        ssize_t n;
+        while ((n = buffered_read(bf, buf, sizeof(buf))) > 0) {
+            buffered_write(bf, buf, n);
+        }
+        buffered_reactor_update(r, bf);
+    }
+    if (events & BUFFERED_EV_WRITE) {
+        echoed++;
+    }
+    if (events & (BUFFERED_EV_EOF | BUFFERED_EV_ERROR)) {
+        buffered_reactor_remove(r, bf);
+    }
+}
+
+static buffered_file_t *pair[2];
+static buffered_file_t *survivor = NULL;
+static int pair_calls = 0;
+
+// Whichever of the two handles is dispatched first removes and closes the other one
+static void close_other_cb(buffered_reactor_t *r, buffered_file_t *bf, int events, void *arg) {
+    (void)events;
+    (void)arg;
+    pair_calls++;
+    buffered_file_t *other = bf == pair[0] ? pair[1] : pair[0];
+    buffered_reactor_remove(r, other);
+    buffered_close(other);
+    buffered_reactor_remove(r, bf);
+    survivor = bf;
+}
+
+int main() {
+    printf("--- Starting non-blocking stream and reactor tests ---\n");
+    int overall_status = TEST_PASS;
+    signal(SIGPIPE, SIG_IGN);  // a peer going away must show up as an error, not kill us
+
+    // Test 1: Empty non-blocking pipe reports EAGAIN instead of blocking or EOF
+    printf("\nTEST 1: Read from an empty non-blocking pipe.\n");
+    int p[2];
+    if (pipe2(p, O_NONBLOCK) == -1) { perror("pipe2"); return TEST_FAIL; }
+    buffered_file_t *rd = buffered_open_fd(p[0], 0);
+    buffered_file_t *wr = buffered_open_fd(p[1], 0);
+    if (!rd || !wr) return TEST_FAIL;
+    char buf[64];
+    ssize_t n = buffered_read(rd, buf, sizeof(buf));
+    if (n != -1 || errno != EAGAIN) {
+        fprintf(stderr, "FAIL: Test 1 - Expected -1/EAGAIN, got %zd (errno %d).\n", n, errno);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - Got EAGAIN.\n");
+    }
+
+    // Test 2: A short read returns what is there, then EAGAIN again
+    printf("\nTEST 2: Partial read from a pipe holding 5 bytes.\n");
+    if (write(p[1], "hello", 5) != 5) { perror("write"); return TEST_FAIL; }
+    n = buffered_read(rd, buf, sizeof(buf));
+    if (n != 5 || memcmp(buf, "hello", 5) != 0 || buffered_read(rd, buf, sizeof(buf)) != -1 || errno != EAGAIN) {
+        fprintf(stderr, "FAIL: Test 2 - Expected 5 bytes then EAGAIN, got %zd.\n", n);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - Got 5 bytes, then EAGAIN.\n");
+    }
+
+    // Test 3: Writing more than the pipe holds returns a short count instead of blocking
+    printf("\nTEST 3: Writing %d bytes into a pipe nobody drains.\n", LARGE_WRITE);
+    char *large = calloc(1, LARGE_WRITE);
+    if (!large) { perror("calloc"); return TEST_FAIL; }
+    n = buffered_write(wr, large, LARGE_WRITE);
+    if (n <= 0 || n >= LARGE_WRITE) {
+        fprintf(stderr, "FAIL: Test 3 - Expected a short write, got %zd.\n", n);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - Short write of %zd bytes.\n", n);
+    }
+    free(large);
+    buffered_close(wr);  // the pipe is still full, the final flush gives up with EAGAIN
+    buffered_close(rd);
+
+    // Test 4: One reactor echoing on many socket pairs
+    printf("\nTEST 4: Reactor echoing on %d socket pairs.\n", NUM_STREAMS);
+    buffered_reactor_t *r = buffered_reactor_create();
+    if (!r) return TEST_FAIL;
+    int peers[NUM_STREAMS];
+    buffered_file_t *handles[NUM_STREAMS];
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) { perror("socketpair"); return TEST_FAIL; }
+        peers[i] = sv[0];
+        handles[i] = buffered_open_fd(sv[1], 0);
+        if (!handles[i] || buffered_reactor_add(r, handles[i], echo_cb, NULL) == -1) return TEST_FAIL;
+        char msg[32];
+        int len = snprintf(msg, sizeof(msg), "ping-%d", i);
+        if (write(peers[i], msg, len) != len) { perror("write"); return TEST_FAIL; }
+    }
+    for (int rounds = 0; echoed < NUM_STREAMS && rounds < 1000; rounds++) {
+        if (buffered_reactor_run(r, 100) == -1) break;
+    }
+    int status_4 = echoed == NUM_STREAMS ? TEST_PASS : TEST_FAIL;
+    for (int i = 0; i < NUM_STREAMS && status_4 == TEST_PASS; i++) {
+        char expected[32];
+        int len = snprintf(expected, sizeof(expected), "ping-%d", i);
+        n = read(peers[i], buf, sizeof(buf));
+        if (n != len || memcmp(buf, expected, len) != 0) status_4 = TEST_FAIL;
+    }
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        close(peers[i]);
+    }
+    // The peers are gone, every handle sees EOF and unregisters itself
+    for (int rounds = 0; rounds < 10; rounds++) {
+        buffered_reactor_run(r, 10);
+    }
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        if (buffered_reactor_remove(r, handles[i]) != -1) status_4 = TEST_FAIL;
+        buffered_close(handles[i]);
+    }
+    buffered_reactor_destroy(r);
+    if (status_4 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 4 - Echoed %d of %d streams.\n", echoed, NUM_STREAMS);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 4 - All %d streams echoed and closed.\n", NUM_STREAMS);
+    }
+
+    // Test 5: A handle closed by an earlier callback of the same round is not dispatched
+    printf("\nTEST 5: Closing another ready handle from a callback.\n");
+    r = buffered_reactor_create();
+    int fds[2][2];
+    if (!r || pipe2(fds[0], O_NONBLOCK) == -1 || pipe2(fds[1], O_NONBLOCK) == -1) return TEST_FAIL;
+    for (int i = 0; i < 2; i++) {
+        pair[i] = buffered_open_fd(fds[i][0], O_RDONLY);
+        if (!pair[i] || buffered_reactor_add(r, pair[i], close_other_cb, NULL) == -1) return TEST_FAIL;
+        if (write(fds[i][1], "x", 1) != 1) return TEST_FAIL;//both are ready in the same round
+    }
+    int dispatched = buffered_reactor_run(r, 1000);
+    if (survivor) buffered_close(survivor);
+    buffered_reactor_destroy(r);
+    close(fds[0][1]);
+    close(fds[1][1]);
+    if (dispatched != 1 || pair_calls != 1) {
+        fprintf(stderr, "FAIL: Test 5 - %d callbacks for two handles, one of them closed by the other.\n", pair_calls);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 5 - Only the first of the two handles was dispatched.\n");
+    }
+
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All stream and reactor tests passed! ***\n");
+    } else {
+        fprintf(stderr, "\n*** FAIL: Some stream and reactor tests failed. ***\n");
+    }
+    return overall_status;
+}
@@ -147,6 +147,63 @@ int main() {
 
     if (buffered_close(bf) == -1) overall_status = TEST_FAIL;
 
+    // Test 5: Read-modify-write keeps the read window coherent
+    printf("\nTEST 5: Read, overwrite in place, read again.\n");
+    if (prepare_test_file(TEST_FILE, PATTERN_SIZE) == TEST_FAIL) return TEST_FAIL;
+    bf = buffered_open(TEST_FILE, O_RDWR, 0);
+    if (!bf) { overall_status = TEST_FAIL; goto cleanup; }
+
+    bytes_read = buffered_read(bf, read_buf, 10);
+    overall_status |= check_read("Test 5 (Read before write)", read_buf, bytes_read, 10, '0');
+    if (buffered_write(bf, "XXXXX", 5) != 5) { overall_status = TEST_FAIL; goto cleanup; }
+    // The rest of the window must still be served, and the write must not have clobbered it
+    bytes_read = buffered_read(bf, read_buf, 5);
+    if (bytes_read != 5 || memcmp(read_buf, "56789", 5) != 0) {
+        fprintf(stderr, "FAIL: Test 5 - Read after write returned stale or shifted data.\n");
+        overall_status = TEST_FAIL;
+    }
+    if (buffered_close(bf) == -1) overall_status = TEST_FAIL;
+
+    bf = buffered_open(TEST_FILE, O_RDONLY, 0);
+    if (!bf) { overall_status = TEST_FAIL; goto cleanup; }
+    bytes_read = buffered_read(bf, read_buf, 20);
+    if (bytes_read != 20 || memcmp(read_buf, "0123456789XXXXX56789", 20) != 0) {
+        fprintf(stderr, "FAIL: Test 5 - File content after read-modify-write is wrong.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 5 - Write patched the cached window in place.\n");
+    }
+    if (buffered_close(bf) == -1) overall_status = TEST_FAIL;
+
+    // Test 6: Byte functions, getc across a refill, ungetc of the byte just read, putc after reading
+    printf("\nTEST 6: buffered_getc / buffered_ungetc / buffered_putc.\n");
+    if (prepare_test_file(TEST_FILE, PATTERN_SIZE) == TEST_FAIL) return TEST_FAIL;
+    bf = buffered_open(TEST_FILE, O_RDWR, 0);
+    if (!bf) { overall_status = TEST_FAIL; goto cleanup; }
+    int status_6 = TEST_PASS;
+    for (size_t i = 0; i < BUFFER_SIZE + 5; i++) {
+        if (buffered_getc(bf) != '0' + (int)(i % 10)) { status_6 = TEST_FAIL; break; }
+    }
+    int c6 = buffered_getc(bf);  // byte BUFFER_SIZE + 5
+    if (buffered_ungetc(bf, c6) != c6 || buffered_getc(bf) != c6) status_6 = TEST_FAIL;
+    if (buffered_ungetc(bf, 'Z') != -1) status_6 = TEST_FAIL;  // not the byte before the cursor
+    if (buffered_putc(bf, '#') != '#' || buffered_putc(bf, '#') != '#') status_6 = TEST_FAIL;
+    int after_6 = buffered_getc(bf);  // the byte after the two overwritten ones
+    if (after_6 != '0' + (int)((BUFFER_SIZE + 8) % 10)) status_6 = TEST_FAIL;
+    if (buffered_close(bf) == -1) status_6 = TEST_FAIL;
+    bf = buffered_open(TEST_FILE, O_RDONLY, 0);
+    if (!bf) { overall_status = TEST_FAIL; goto cleanup; }
+    bytes_read = buffered_read(bf, read_buf, BUFFER_SIZE + 9);
+    if (bytes_read != BUFFER_SIZE + 9 || read_buf[BUFFER_SIZE + 6] != '#' || read_buf[BUFFER_SIZE + 7] != '#')
+        status_6 = TEST_FAIL;
+    if (buffered_close(bf) == -1) status_6 = TEST_FAIL;
+    if (status_6 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 6 - Byte functions returned wrong bytes or left the file wrong.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 6 - Byte functions agree with the file.\n");
+    }
+
 cleanup:
     remove(TEST_FILE);
     if (overall_status == TEST_PASS) {
@@ -0,0 +1,148 @@
+#include "buffered_open.h"
+#include "buffered_record.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_FILE "test_record.dat"
+#define NUM_RECORDS 10000
+
+//checks that the reader is at record n: key n * 10 and payload "record n"
+static int expect_record(buffered_record_t *rf, int n) {
+    char buf[32], expected[32];
+    uint64_t key;
+    size_t len;
+    if (buffered_record_next(rf, &key, buf, sizeof(buf) - 1, &len) != 1) return 0;
+    buf[len] = '\0';
+    snprintf(expected, sizeof(expected), "record %d", n);
+    return key == (uint64_t)n * 10 && strcmp(buf, expected) == 0;
+}
+
+//a fresh file of NUM_RECORDS records with its index and footer, returns its size or -1
+static off_t write_records(void) {
+    buffered_record_t *rf = buffered_record_create(TEST_FILE, 0644);
+    if (!rf) return -1;
+    for (int i = 0; i < NUM_RECORDS; i++) {
+        char payload[32];
+        int len = snprintf(payload, sizeof(payload), "record %d", i);
+        if (buffered_record_append(rf, (uint64_t)i * 10, payload, len) == -1) return -1;
+    }
+    if (buffered_record_close(rf) == -1) return -1;
+    FILE *fp = fopen(TEST_FILE, "r");
+    if (!fp || fseeko(fp, 0, SEEK_END) == -1) return -1;
+    off_t size = ftello(fp);
+    fclose(fp);
+    return size;
+}
+
+//the file opens with all NUM_RECORDS records and seeks land on them
+static int all_records(void) {
+    buffered_record_t *rf = buffered_record_open(TEST_FILE);
+    int ok = rf && buffered_record_count(rf) == NUM_RECORDS && buffered_record_seek(rf, NUM_RECORDS - 1) == 0 &&
+             expect_record(rf, NUM_RECORDS - 1) && buffered_record_next(rf, NULL, NULL, 0, NULL) == 0;
+    buffered_record_close(rf);
+    return ok;
+}
+
+int main() {
+    printf("--- Starting record file tests ---\n");
+    int overall_status = TEST_PASS;
+    off_t data_size = 0;
+
+    // Test 1: Write records, reopen and seek by record number
+    printf("\nTEST 1: %d records, seek to record N.\n", NUM_RECORDS);
+    buffered_record_t *rf = buffered_record_create(TEST_FILE, 0644);
+    if (!rf) return TEST_FAIL;
+    for (int i = 0; i < NUM_RECORDS; i++) {
+        char payload[32];
+        int len = snprintf(payload, sizeof(payload), "record %d", i);
+        if (buffered_record_append(rf, (uint64_t)i * 10, payload, len) == -1) return TEST_FAIL;
+        data_size += RECORD_HEADER_SIZE + len;
+    }
+    if (buffered_record_append(rf, 5, "late", 4) != -1) {//keys must not go backwards
+        fprintf(stderr, "FAIL: Test 1 - Accepted a decreasing key.\n");
+        overall_status = TEST_FAIL;
+    }
+    if (buffered_record_close(rf) == -1) return TEST_FAIL;
+    rf = buffered_record_open(TEST_FILE);
+    if (!rf) return TEST_FAIL;
+    int status_1 = buffered_record_count(rf) == NUM_RECORDS && expect_record(rf, 0) && expect_record(rf, 1);
+    int probes[] = {5000, 63, 64, 65, NUM_RECORDS - 1, 1};
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+        if (buffered_record_seek(rf, probes[i]) == -1 || !expect_record(rf, probes[i])) status_1 = 0;
+    }
+    if (buffered_record_seek(rf, NUM_RECORDS) == -1 || buffered_record_next(rf, NULL, NULL, 0, NULL) != 0) status_1 = 0;
+    if (!status_1) {
+        fprintf(stderr, "FAIL: Test 1 - Wrong record after seek.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - Seeks landed on the right records.\n");
+    }
+
+    // Test 2: Seek by key and too small a buffer
+    printf("\nTEST 2: Seek to the first key >= K.\n");
+    int status_2 = buffered_record_seek_key(rf, 12345) == 1235 && expect_record(rf, 1235) &&
+                   buffered_record_seek_key(rf, 0) == 0 && expect_record(rf, 0) &&
+                   buffered_record_seek_key(rf, 640) == 64 && expect_record(rf, 64) &&
+                   buffered_record_seek_key(rf, (uint64_t)NUM_RECORDS * 10) == NUM_RECORDS;
+    char tiny[4];
+    size_t need = 0;
+    buffered_record_seek(rf, 7);
+    if (buffered_record_next(rf, NULL, tiny, sizeof(tiny), &need) != -1 || errno != EMSGSIZE || need != 8 ||
+        !expect_record(rf, 7)) {
+        status_2 = 0;
+    }
+    buffered_record_close(rf);
+    if (!status_2) {
+        fprintf(stderr, "FAIL: Test 2 - Wrong record after key seek.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - Key seeks and short buffers behaved.\n");
+    }
+
+    // Test 3: A file whose writer died before the index is indexed by scanning it
+    printf("\nTEST 3: Missing index and footer.\n");
+    if (truncate(TEST_FILE, data_size - 3) == -1) return TEST_FAIL;//the last record is cut short too
+    rf = buffered_record_open(TEST_FILE);
+    int status_3 = rf && buffered_record_count(rf) == NUM_RECORDS - 1 &&
+                   buffered_record_seek(rf, 4321) == 0 && expect_record(rf, 4321);
+    buffered_record_close(rf);
+    if (!status_3) {
+        fprintf(stderr, "FAIL: Test 3 - Could not recover the records.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - Recovered %d whole records.\n", NUM_RECORDS - 1);
+    }
+
+    // Test 4: An index or footer cut short is not read as records, a footer with the wrong count is not trusted
+    printf("\nTEST 4: Damaged index and footer.\n");
+    int status_4 = 1;
+    off_t full = write_records();
+    off_t cuts[] = {full - 5, data_size + 30, data_size + 1};//inside the footer, inside and at the start of the index
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        if (full == -1 || truncate(TEST_FILE, cuts[i]) == -1 || !all_records()) status_4 = 0;
+        full = write_records();
+    }
+    FILE *fp = fopen(TEST_FILE, "r+");
+    uint64_t bad_count = NUM_RECORDS * 2;
+    if (!fp || fseeko(fp, full - 8, SEEK_SET) == -1 || fwrite(&bad_count, 8, 1, fp) != 1) status_4 = 0;
+    if (fp) fclose(fp);
+    if (!all_records()) status_4 = 0;
+    if (!status_4) {
+        fprintf(stderr, "FAIL: Test 4 - A damaged trailer changed the records.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 4 - Every damaged trailer still gave %d records.\n", NUM_RECORDS);
+    }
+
+    remove(TEST_FILE);
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All record file tests passed! ***\n");
+    } else {
+        fprintf(stderr, "\n*** FAIL: Some record file tests failed. ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,144 @@
+#include "buffered_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_FILE "test_scan.txt"
+#define NUM_LINES 300000
+#define LONG_LINE (3 * 1024 * 1024)
+
+//what the callbacks found, added up under a lock since they run in several threads
+typedef struct {
+    pthread_mutex_t lock;
+    long lines;
+    long long sum;          //of the line numbers
+    long long bytes;
+    int bad;                //a chunk that did not end after a newline or held a broken line
+} scan_totals_t;
+
+static int count_lines(const char *data, size_t len, off_t offset, int worker, void *arg) {
+    (void)offset;
+    (void)worker;
+    scan_totals_t *t = arg;
+    long lines = 0;
+    long long sum = 0;
+    int bad = len == 0 || data[len - 1] != '\n';
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) break;
+        //a line is its number, a space and n % 50 dots, apart from the long line of nines
+        if ((size_t)(nl - p) != LONG_LINE) {
+            long n = atol(p);
+            char expected[80];
+            int l = snprintf(expected, sizeof(expected), "%ld ", n);
+            if (nl - p != l + n % 50) bad = 1;
+            sum += n;
+        }
+        lines++;
+        p = nl + 1;
+    }
+    pthread_mutex_lock(&t->lock);
+    t->lines += lines;
+    t->sum += sum;
+    t->bytes += len;
+    t->bad |= bad;
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+static int count_bytes(const char *data, size_t len, off_t offset, int worker, void *arg) {
+    (void)data;
+    (void)offset;
+    (void)worker;
+    scan_totals_t *t = arg;
+    pthread_mutex_lock(&t->lock);
+    t->bytes += len;
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+static int stop_early(const char *data, size_t len, off_t offset, int worker, void *arg) {
+    (void)data;
+    (void)len;
+    (void)offset;
+    (void)worker;
+    (void)arg;
+    return 7;
+}
+
+int main() {
+    printf("--- Starting parallel scan tests ---\n");
+    int overall_status = TEST_PASS;
+
+    //lines of varying length, and one longer than a worker's buffer in the middle
+    FILE *fp = fopen(TEST_FILE, "w");
+    if (!fp) return TEST_FAIL;
+    long long file_size = 0, expected_sum = 0;
+    for (long i = 0; i < NUM_LINES; i++) {
+        if (i == NUM_LINES / 2) {
+            char *big = malloc(LONG_LINE + 1);
+            memset(big, '9', LONG_LINE);
+            big[LONG_LINE] = '\n';
+            fwrite(big, 1, LONG_LINE + 1, fp);
+            free(big);
+            file_size += LONG_LINE + 1;
+            continue;
+        }
+        file_size += fprintf(fp, "%ld %.*s\n", i, (int)(i % 50), "..................................................");
+        expected_sum += i;
+    }
+    fclose(fp);
+
+    // Test 1: Every line reaches the callback once and whole, for several thread counts
+    printf("\nTEST 1: Newline-aligned chunks across 1, 3 and 8 workers.\n");
+    int status_1 = 1;
+    int threads[] = {1, 3, 8};
+    for (int k = 0; k < 3; k++) {
+        scan_totals_t t = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0};
+        if (buffered_parallel_scan(TEST_FILE, threads[k], '\n', count_lines, &t) != 0) status_1 = 0;
+        if (t.lines != NUM_LINES || t.sum != expected_sum || t.bytes != file_size || t.bad) status_1 = 0;
+        if (!status_1) {
+            fprintf(stderr, "FAIL: Test 1 - %d workers: %ld lines, %lld bytes, bad %d.\n",
+                    threads[k], t.lines, t.bytes, t.bad);
+            break;
+        }
+    }
+    if (!status_1) {
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - %d lines, none cut, with every worker count.\n", NUM_LINES);
+    }
+
+    // Test 2: Without a delimiter the file is still covered exactly once
+    printf("\nTEST 2: Plain chunks without a delimiter.\n");
+    scan_totals_t t2 = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0};
+    if (buffered_parallel_scan(TEST_FILE, 4, -1, count_bytes, &t2) != 0 || t2.bytes != file_size) {
+        fprintf(stderr, "FAIL: Test 2 - %lld of %lld bytes.\n", t2.bytes, file_size);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - All %lld bytes delivered.\n", file_size);
+    }
+
+    // Test 3: A callback stops the scan and its value comes back, a missing file gives ENOENT
+    printf("\nTEST 3: Stopping early and errors.\n");
+    int res = buffered_parallel_scan(TEST_FILE, 4, '\n', stop_early, NULL);
+    int missing = buffered_parallel_scan("no_such_file.txt", 4, '\n', stop_early, NULL);
+    if (res != 7 || missing != -1 || errno != ENOENT) {
+        fprintf(stderr, "FAIL: Test 3 - Returned %d and %d.\n", res, missing);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - The callback's 7 and ENOENT came back.\n");
+    }
+
+    unlink(TEST_FILE);
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All parallel scan tests passed! ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,127 @@
+#include "buffered_open.h"
+#include "buffered_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define NUM_FILES 64
+#define MAX_OPEN 8
+#define ROUNDS 20
+
+int main() {
+    printf("--- Starting handle table tests ---\n");
+    int overall_status = TEST_PASS;
+    char names[NUM_FILES][32];
+    int handles[NUM_FILES];
+
+    buffered_table_t *t = buffered_table_create(MAX_OPEN);
+    if (!t) return TEST_FAIL;
+
+    // Test 1: More writers than open fds, every handle keeps its place across evictions
+    printf("\nTEST 1: %d files through %d fds, %d interleaved rounds.\n", NUM_FILES, MAX_OPEN, ROUNDS);
+    for (int f = 0; f < NUM_FILES; f++) {
+        snprintf(names[f], sizeof(names[f]), "test_table_%d.txt", f);
+        handles[f] = buffered_table_open(t, names[f], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (handles[f] == -1) return TEST_FAIL;
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int f = 0; f < NUM_FILES; f++) {
+            char rec[16];
+            int len = snprintf(rec, sizeof(rec), "%02d:%02d\n", f, r);
+            if (buffered_table_write(t, handles[f], rec, len) != len) return TEST_FAIL;
+        }
+    }
+    buffered_table_stats_t stats;
+    buffered_table_stats(t, &stats);
+    int status_1 = TEST_PASS;
+    if (stats.open_now > MAX_OPEN || stats.reopens == 0 || stats.evictions == 0) status_1 = TEST_FAIL;
+    for (int f = 0; f < NUM_FILES; f++) {
+        if (buffered_table_close(t, handles[f]) == -1) status_1 = TEST_FAIL;
+        FILE *fp = fopen(names[f], "r");
+        char line[16], expected[16];
+        for (int r = 0; r < ROUNDS; r++) {
+            snprintf(expected, sizeof(expected), "%02d:%02d\n", f, r);
+            if (!fp || !fgets(line, sizeof(line), fp) || strcmp(line, expected) != 0) {
+                status_1 = TEST_FAIL;
+                break;
+            }
+        }
+        if (fp) fclose(fp);
+    }
+    if (status_1 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 1 - Wrong content or counters (open %d, reopens %lu, evictions %lu).\n",
+                stats.open_now, stats.reopens, stats.evictions);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - %lu accesses, %lu hits, %lu reopens.\n", stats.accesses, stats.hits, stats.reopens);
+    }
+
+    // Test 2: A reader resumes at its offset after being evicted, and O_TRUNC is not applied again
+    printf("\nTEST 2: Reading resumes after eviction.\n");
+    int reader = buffered_table_open(t, names[0], O_RDONLY, 0);
+    char buf[8] = {0};
+    int status_2 = TEST_PASS;
+    if (buffered_table_read(t, reader, buf, 6) != 6 || strcmp(buf, "00:00\n") != 0) status_2 = TEST_FAIL;
+    int writer = buffered_table_open(t, names[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (int f = 2; f < 2 + MAX_OPEN; f++) {//push the reader out of the cache
+        handles[f] = buffered_table_open(t, names[f], O_RDONLY, 0);
+    }
+    buffered_table_write(t, writer, "x", 1);
+    memset(buf, 0, sizeof(buf));
+    if (buffered_table_read(t, reader, buf, 6) != 6 || strcmp(buf, "00:01\n") != 0) status_2 = TEST_FAIL;
+    for (int f = 2; f < 2 + MAX_OPEN; f++) {
+        buffered_table_get(t, handles[f]);
+    }
+    buffered_table_write(t, writer, "y", 1);
+    buffered_table_close(t, writer);
+    FILE *fp = fopen(names[1], "r");
+    char line[16] = {0};
+    if (!fp || !fgets(line, sizeof(line), fp) || strcmp(line, "xy") != 0) status_2 = TEST_FAIL;
+    if (fp) fclose(fp);
+    if (status_2 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 2 - Offset lost or file truncated again.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - Reader and writer resumed where they stopped.\n");
+    }
+
+    // Test 3: A handle holding a lock is passed over for eviction, and all pinned means EMFILE
+    printf("\nTEST 3: Pinned handles stay open.\n");
+    int status_3 = TEST_PASS;
+    buffered_table_t *small = buffered_table_create(2);
+    int locked = buffered_table_open(small, names[0], O_RDWR, 0);
+    buffered_file_t *lbf = buffered_table_get(small, locked);
+    if (!lbf || buffered_lock(lbf, BUFFERED_LOCK_EXCLUSIVE, 0, 0) == -1) status_3 = TEST_FAIL;
+    for (int f = 1; f < 4; f++) {//each open has to evict, never the locked handle
+        handles[f] = buffered_table_open(small, names[f], O_RDONLY, 0);
+        if (handles[f] == -1 || buffered_table_get(small, locked) != lbf) status_3 = TEST_FAIL;
+    }
+    if (buffered_set_commit_batch(buffered_table_get(small, handles[3]), 2) == -1) status_3 = TEST_FAIL;
+    errno = 0;
+    if (buffered_table_open(small, names[4], O_RDONLY, 0) != -1 || errno != EMFILE) status_3 = TEST_FAIL;
+    buffered_unlock(lbf, 0, 0);
+    if (buffered_table_open(small, names[4], O_RDONLY, 0) == -1 || buffered_table_get(small, handles[3]) == NULL) {
+        status_3 = TEST_FAIL;
+    }
+    if (buffered_table_destroy(small) == -1) status_3 = TEST_FAIL;
+    if (status_3 == TEST_FAIL) {
+        fprintf(stderr, "FAIL: Test 3 - A pinned handle was evicted or the table did not refuse.\n");
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - The locked handle stayed open and a full pinned table returned EMFILE.\n");
+    }
+
+    if (buffered_table_destroy(t) == -1) overall_status = TEST_FAIL;
+    for (int f = 0; f < NUM_FILES; f++) {
+        remove(names[f]);
+    }
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All handle table tests passed! ***\n");
+    } else {
+        fprintf(stderr, "\n*** FAIL: Some handle table tests failed. ***\n");
+    }
+    return overall_status;
+}
@@ -0,0 +1,127 @@
+#include "buffered_open.h"
+#include "buffered_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_FILE "test_trace.txt"
+#define TRACE_FILE "test_trace.trace"
+#define THREAD_WRITES 10000
+
+static void *writer_thread(void *arg) {
+    buffered_file_t *bf = arg;
+    for (int i = 0; i < THREAD_WRITES; i++) {
+        buffered_write(bf, "x", 1);
+    }
+    return NULL;
+}
+
+int main() {
+    printf("--- Starting I/O trace tests ---\n");
+    int overall_status = TEST_PASS;
+
+    // Test 1: Calls and the syscalls under them are recorded, internal calls are not
+    printf("\nTEST 1: Trace a write, flush, seek, read, lock and transaction.\n");
+    if (buffered_trace_start(TRACE_FILE) == -1) return TEST_FAIL;
+    buffered_file_t *bf = buffered_open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!bf) return TEST_FAIL;
+    char buf[16];
+    buffered_write(bf, "hello world", 11);
+    buffered_flush(bf);
+    buffered_seek(bf, 3LL << 30, SEEK_SET);//a result that does not fit in 32 bits
+    buffered_seek(bf, 6, SEEK_SET);
+    buffered_read(bf, buf, 5);
+    buffered_lock(bf, BUFFERED_LOCK_SHARED, 0, 5);
+    buffered_unlock(bf, 0, 5);
+    buffered_begin(bf);
+    buffered_abort(bf);
+    buffered_close(bf);
+
+    // Test 2: A second thread's ring ends up in the same file, without losing records
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_TRUNC);
+    if (!bf) return TEST_FAIL;
+    pthread_t thread;
+    pthread_create(&thread, NULL, writer_thread, bf);
+    pthread_join(thread, NULL);
+    buffered_close(bf);
+    buffered_trace_stop();
+
+    FILE *fp = fopen(TRACE_FILE, "rb");
+    trace_header_t header;
+    trace_record_t r;
+    int counts[64] = {0}, threads_seen[2] = {0}, far_seek = 0;
+    if (!fp || fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC) return TEST_FAIL;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (r.op < 64) counts[r.op]++;
+        if (r.op == TRACE_WRITE) threads_seen[r.size == 1] = 1;
+        if (r.op == TRACE_READ && (r.offset != 6 || r.size != 5 || r.result != 5)) overall_status = TEST_FAIL;
+        if (r.op == TRACE_SEEK && r.offset == 3LL << 30) far_seek = r.result == 3LL << 30;
+        if (r.op == TRACE_LOCK_SHARED && (r.offset != 0 || r.size != 5 || r.result != 0)) overall_status = TEST_FAIL;
+    }
+    fclose(fp);
+    if (counts[TRACE_OPEN] != 2 || counts[TRACE_CLOSE] != 2 || counts[TRACE_FLUSH] != 1 || counts[TRACE_SEEK] != 2 || !far_seek ||
+        counts[TRACE_LOCK_SHARED] != 1 || counts[TRACE_UNLOCK] != 1 || counts[TRACE_BEGIN] != 1 || counts[TRACE_ABORT] != 1 ||
+        counts[TRACE_READ] != 1 || counts[TRACE_SYS_PWRITE] < 1 || counts[TRACE_SYS_PREAD] != 1) {
+        fprintf(stderr, "FAIL: Test 1 - Unexpected record counts (open %d flush %d pwrite %d pread %d).\n",
+                counts[TRACE_OPEN], counts[TRACE_FLUSH], counts[TRACE_SYS_PWRITE], counts[TRACE_SYS_PREAD]);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 1 - Calls and syscalls recorded once each.\n");
+    }
+    if (counts[TRACE_WRITE] != 1 + THREAD_WRITES || !threads_seen[0] || !threads_seen[1] ||
+        counts[TRACE_DROPPED] != 0) {
+        fprintf(stderr, "FAIL: Test 2 - Expected %d writes, got %d.\n", 1 + THREAD_WRITES, counts[TRACE_WRITE]);
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 2 - All %d writes of the second thread recorded.\n", THREAD_WRITES);
+    }
+
+    // Test 3: A trace file that stops taking writes mid-record loses the newest records, not the oldest
+    printf("\nTEST 3: Trace file size limit hit in the middle of a record.\n");
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = sizeof(trace_header_t) + 100 * sizeof(trace_record_t) + sizeof(trace_record_t) / 2;
+    signal(SIGXFSZ, SIG_IGN);//writes past the limit then fail with EFBIG
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_TRUNC);
+    if (!bf || setrlimit(RLIMIT_FSIZE, &limit) == -1 || buffered_trace_start(TRACE_FILE) == -1) return TEST_FAIL;
+    for (int i = 0; i < 2 * TRACE_RING_SIZE; i++) {
+        buffered_write(bf, "y", 1);
+    }
+    buffered_trace_stop();
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    buffered_close(bf);
+    int status_3 = buffered_trace_dropped() > 0;
+    uint64_t whole = 0, first = 0;
+    fp = fopen(TRACE_FILE, "rb");
+    if (!fp || fread(&header, sizeof(header), 1, fp) != 1) status_3 = 0;
+    while (fp && fread(&r, sizeof(r), 1, fp) == 1) {
+        if (whole == 0) first = r.seq;//the thread's ring kept counting since the earlier tests
+        if (r.seq != first + whole || r.op != TRACE_WRITE) status_3 = 0;//every record, in order, none overwritten
+        whole++;
+    }
+    if (fp) fclose(fp);
+    if (whole != 100) status_3 = 0;
+    if (!status_3) {
+        fprintf(stderr, "FAIL: Test 3 - %llu records in the file, %llu dropped.\n", (unsigned long long)whole,
+                (unsigned long long)buffered_trace_dropped());
+        overall_status = TEST_FAIL;
+    } else {
+        printf("PASS: Test 3 - The first %llu records kept, %llu counted as dropped.\n", (unsigned long long)whole,
+               (unsigned long long)buffered_trace_dropped());
+    }
+
+    remove(TEST_FILE);
+    remove(TRACE_FILE);
+    if (overall_status == TEST_PASS) {
+        printf("\n*** All I/O trace tests passed! ***\n");
+    } else {
+        fprintf(stderr, "\n*** FAIL: Some I/O trace tests failed. ***\n");
+    }
+    return overall_status;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 #define TEST_FILE "test_output.txt"
@@ -49,6 +50,15 @@ int verify_file_content(const char *expected_content) {
     return matches;
 }
 
+static int errors_reported = 0;
+
+static void count_error(buffered_file_t *bf, const buffered_error_t *err, void *arg) {
+    (void)bf;
+    (void)err;
+    (void)arg;
+    errors_reported++;
+}
+
 int main() {
     printf("--- Starting buffered_write tests ---\n");
 
@@ -147,6 +157,272 @@ int main() {
 
     if (verify_file_content(expected_3) == TEST_FAIL) return TEST_FAIL;
 
+    // Test 4: O_APPEND records, including one bigger than the buffer, must land whole and in order
+    remove(TEST_FILE);
+    printf("\nTEST 4: Appending records of %d, %d and %d bytes with O_APPEND.\n", 3000, 3000, BUFFER_SIZE + 1000);
+    size_t sizes_4[3] = {3000, 3000, BUFFER_SIZE + 1000};
+    char fill_4[3] = {'a', 'b', 'c'};
+    size_t total_4 = sizes_4[0] + sizes_4[1] + sizes_4[2];
+    char *expected_4 = malloc(total_4 + 1);
+    char *record_4 = malloc(sizes_4[2]);
+    if (!expected_4 || !record_4) {
+        perror("malloc failed for append records");
+        free(expected_4);
+        free(record_4);
+        return TEST_FAIL;
+    }
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (!bf) { free(expected_4); free(record_4); return TEST_FAIL; }
+    size_t off_4 = 0;
+    for (int r = 0; r < 3; r++) {
+        memset(record_4, fill_4[r], sizes_4[r]);
+        memcpy(expected_4 + off_4, record_4, sizes_4[r]);
+        off_4 += sizes_4[r];
+        if (buffered_write(bf, record_4, sizes_4[r]) != (ssize_t)sizes_4[r]) {
+            perror("TEST 4 buffered_write failed");
+            buffered_close(bf);
+            free(expected_4);
+            free(record_4);
+            return TEST_FAIL;
+        }
+    }
+    expected_4[total_4] = '\0';
+    if (buffered_close(bf) == -1) {
+        perror("TEST 4 buffered_close failed");
+        free(expected_4);
+        free(record_4);
+        return TEST_FAIL;
+    }
+    result = verify_file_content(expected_4);
+    free(expected_4);
+    free(record_4);
+    if (result == TEST_FAIL) return TEST_FAIL;
+
+    // Test 5: O_MMAPWRITE grows the mapping past one chunk and truncates to the logical size on close
+    remove(TEST_FILE);
+    size_t mmap_size = MMAP_CHUNK_SIZE + 123;
+    printf("\nTEST 5: Writing %zu bytes through O_MMAPWRITE.\n", mmap_size);
+    char *mmap_data = malloc(mmap_size);
+    char *mmap_back = malloc(mmap_size);
+    if (!mmap_data || !mmap_back) {
+        perror("malloc failed for mmap data");
+        free(mmap_data);
+        free(mmap_back);
+        return TEST_FAIL;
+    }
+    for (size_t i = 0; i < mmap_size; i++) {
+        mmap_data[i] = 'A' + (i % 26);
+    }
+    bf = buffered_open(TEST_FILE, O_RDWR | O_CREAT | O_MMAPWRITE, 0644);
+    if (!bf) { free(mmap_data); free(mmap_back); return TEST_FAIL; }
+    int status_5 = TEST_PASS;
+    for (size_t off = 0; off < mmap_size; off += 1000) {
+        size_t n = mmap_size - off < 1000 ? mmap_size - off : 1000;
+        if (buffered_write(bf, mmap_data + off, n) != (ssize_t)n) {
+            perror("TEST 5 buffered_write failed");
+            status_5 = TEST_FAIL;
+            break;
+        }
+    }
+    if (buffered_close(bf) == -1) {
+        perror("TEST 5 buffered_close failed");
+        status_5 = TEST_FAIL;
+    }
+    FILE *fp5 = fopen(TEST_FILE, "r");
+    if (status_5 == TEST_PASS && fp5) {
+        size_t got = fread(mmap_back, 1, mmap_size, fp5);
+        if (got != mmap_size || fgetc(fp5) != EOF || memcmp(mmap_back, mmap_data, mmap_size) != 0) {
+            printf("Verification FAILED: mmap written file differs or was not truncated (read %zu bytes).\n", got);
+            status_5 = TEST_FAIL;
+        } else {
+            printf("Verification SUCCESS: File contents match the expected total (%zu bytes).\n", mmap_size);
+        }
+    } else {
+        status_5 = TEST_FAIL;
+    }
+    if (fp5) fclose(fp5);
+    free(mmap_data);
+    free(mmap_back);
+    if (status_5 == TEST_FAIL) return TEST_FAIL;
+
+    // TEST 6: Two handles on the same file see each other's writes and flush together
+    printf("\nTEST 6: Two handles on one file, reads coherent and prepends combined.\n");
+    buffered_file_t *h1 = buffered_open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC | O_SHARED, 0644);
+    buffered_file_t *h2 = buffered_open(TEST_FILE, O_RDWR | O_SHARED);
+    if (!h1 || !h2) return TEST_FAIL;
+    int status_6 = TEST_PASS;
+    char got6[32] = {0};
+    buffered_write(h1, "0123456789", 10);
+    if (buffered_read(h2, got6, 10) != 10 || memcmp(got6, "0123456789", 10) != 0) status_6 = TEST_FAIL;
+    buffered_write(h2, "abcde", 5);//h2 continues at offset 10
+    buffered_write(h1, "XY", 2);//h1 overwrites nothing, it is at 10 too
+    memset(got6, 0, sizeof(got6));
+    buffered_file_t *h3 = buffered_open(TEST_FILE, O_RDONLY | O_SHARED);
+    if (!h3 || buffered_read(h3, got6, 15) != 15 || memcmp(got6, "0123456789XYcde", 15) != 0) status_6 = TEST_FAIL;
+    buffered_close(h3);
+    buffered_close(h1);
+    buffered_close(h2);
+    h1 = buffered_open(TEST_FILE, O_RDWR | O_PREAPPEND | O_SHARED);
+    h2 = buffered_open(TEST_FILE, O_RDWR | O_PREAPPEND | O_SHARED);
+    if (!h1 || !h2) return TEST_FAIL;
+    buffered_write(h1, "[1]", 3);
+    buffered_write(h2, "[2]", 3);
+    buffered_flush(h1);//flushes both in one rewrite, h2's newer prepend ends up in front
+    if (h2->write_buffer_pos != 0) status_6 = TEST_FAIL;
+    buffered_close(h1);
+    buffered_close(h2);
+    FILE *fp6 = fopen(TEST_FILE, "r");
+    memset(got6, 0, sizeof(got6));
+    if (!fp6 || fread(got6, 1, sizeof(got6) - 1, fp6) != 21 || strcmp(got6, "[2][1]0123456789XYcde") != 0) {
+        status_6 = TEST_FAIL;
+    }
+    if (fp6) fclose(fp6);
+    if (status_6 == TEST_FAIL) {
+        printf("Verification FAILED: shared handles disagree (got '%s').\n", got6);
+        return TEST_FAIL;
+    }
+    printf("Verification SUCCESS: Shared handles stayed coherent.\n");
+
+    // TEST 7: Transactions publish by rename, aborts leave no trace, commits are batched
+    printf("\nTEST 7: Transactional prepends with batched commits.\n");
+    struct stat st_before, st_after;
+    int status_7 = TEST_PASS;
+    bf = buffered_open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC | O_PREAPPEND, 0644);
+    if (!bf) return TEST_FAIL;
+    buffered_write(bf, "base", 4);
+    buffered_flush(bf);
+    buffered_begin(bf);
+    buffered_write(bf, "junk", 4);
+    buffered_abort(bf);
+    stat(TEST_FILE, &st_before);
+    buffered_set_commit_batch(bf, 3);
+    const char *txns[] = {"a", "b", "c", "d"};
+    for (int i = 0; i < 4; i++) {
+        buffered_begin(bf);
+        buffered_write(bf, txns[i], 1);
+        buffered_write(bf, "-", 1);
+        if (buffered_commit(bf) == -1) status_7 = TEST_FAIL;
+        stat(TEST_FILE, &st_after);
+        //the file is replaced exactly when the third commit publishes the batch
+        if ((i == 2) != (st_after.st_ino != st_before.st_ino)) status_7 = TEST_FAIL;
+        st_before = st_after;
+    }
+    buffered_close(bf);//publishes the fourth
+    FILE *fp7 = fopen(TEST_FILE, "r");
+    char got7[32] = {0};
+    if (!fp7 || fread(got7, 1, sizeof(got7) - 1, fp7) != 12 || strcmp(got7, "d-c-b-a-base") != 0) status_7 = TEST_FAIL;
+    if (fp7) fclose(fp7);
+    if (status_7 == TEST_FAIL) {
+        printf("Verification FAILED: transactions published wrongly (got '%s').\n", got7);
+        return TEST_FAIL;
+    }
+    //a sibling's pending write lands in the copy, and the sibling keeps writing to the published file
+    buffered_file_t *t1 = buffered_open(TEST_FILE, O_RDWR | O_TRUNC | O_SHARED);
+    buffered_file_t *t2 = buffered_open(TEST_FILE, O_RDWR | O_SHARED);
+    if (!t1 || !t2) return TEST_FAIL;
+    buffered_begin(t1);
+    buffered_write(t2, "0123", 4);
+    buffered_seek(t1, 4, SEEK_SET);
+    buffered_write(t1, "tx", 2);
+    if (buffered_commit(t1) == -1) status_7 = TEST_FAIL;
+    buffered_seek(t2, 6, SEEK_SET);
+    buffered_write(t2, "56", 2);
+    buffered_close(t2);
+    buffered_close(t1);
+    fp7 = fopen(TEST_FILE, "r");
+    memset(got7, 0, sizeof(got7));
+    if (!fp7 || fread(got7, 1, sizeof(got7) - 1, fp7) != 8 || strcmp(got7, "0123tx56") != 0) status_7 = TEST_FAIL;
+    if (fp7) fclose(fp7);
+    if (status_7 == TEST_FAIL) {
+        printf("Verification FAILED: a shared handle lost writes across a publish (got '%s').\n", got7);
+        return TEST_FAIL;
+    }
+    printf("Verification SUCCESS: Committed prepends published in batches, abort dropped, siblings followed.\n");
+
+    // TEST 8: Flush policies bound how long data stays invisible to a reader of the file
+    printf("\nTEST 8: Flush on delimiter, high-water mark and maximum age.\n");
+    struct stat st8;
+    int status_8 = TEST_PASS;
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (!bf) return TEST_FAIL;
+    buffered_flush_policy_t policy = { .max_age_ms = 0, .high_water = 8, .delimiter = '\n', .coalesce_ms = 0 };
+    if (buffered_set_flush_policy(bf, &policy) == -1) status_8 = TEST_FAIL;
+    buffered_write(bf, "line one", 5);//"line "
+    stat(TEST_FILE, &st8);
+    if (st8.st_size != 0) status_8 = TEST_FAIL;
+    buffered_write(bf, "1\n", 2);//the newline sends it
+    stat(TEST_FILE, &st8);
+    if (st8.st_size != 7) status_8 = TEST_FAIL;
+    for (int i = 0; i < 8; i++) buffered_putc(bf, 'x');//the high-water mark sends these
+    stat(TEST_FILE, &st8);
+    if (st8.st_size != 15) status_8 = TEST_FAIL;
+    //with only a high-water mark, bytes put right after a write still count towards it
+    buffered_flush_policy_t high_water_only = { .max_age_ms = 0, .high_water = 8, .delimiter = -1, .coalesce_ms = 0 };
+    buffered_set_flush_policy(bf, &high_water_only);
+    buffered_write(bf, "abc", 3);
+    for (int i = 0; i < 5; i++) buffered_putc(bf, 'y');
+    stat(TEST_FILE, &st8);
+    if (st8.st_size != 23) status_8 = TEST_FAIL;
+
+    //a line without a newline goes out on its own once it is 20 ms old
+    policy.max_age_ms = 20;
+    policy.high_water = 0;
+    buffered_set_flush_policy(bf, &policy);
+    buffered_write(bf, "tail", 4);
+    stat(TEST_FILE, &st8);
+    if (st8.st_size != 23) status_8 = TEST_FAIL;
+    for (int i = 0; i < 100 && st8.st_size != 27; i++) {
+        usleep(10000);
+        stat(TEST_FILE, &st8);
+    }
+    if (st8.st_size != 27) status_8 = TEST_FAIL;
+    if (buffered_close(bf) == -1) status_8 = TEST_FAIL;
+    //a background flush would reach into the other O_SHARED handles, so only untimed policies are taken
+    bf = buffered_open(TEST_FILE, O_WRONLY | O_SHARED);
+    if (!bf) return TEST_FAIL;
+    if (buffered_set_flush_policy(bf, &policy) != -1 || errno != EINVAL) status_8 = TEST_FAIL;
+    if (buffered_set_flush_policy(bf, &high_water_only) == -1) status_8 = TEST_FAIL;
+    if (buffered_close(bf) == -1) status_8 = TEST_FAIL;
+    if (status_8 == TEST_FAIL || verify_file_content("line 1\nxxxxxxxxabcyyyyytail") == TEST_FAIL) {
+        printf("Verification FAILED: flush policy did not flush on time.\n");
+        return TEST_FAIL;
+    }
+    printf("Verification SUCCESS: Lines, full batches and old data all reached the file.\n");
+
+    // TEST 9: Failures land on the handle and in a rate-limited handler, never on stderr
+    printf("\nTEST 9: Structured errors on a full device.\n");
+    int status_9 = TEST_PASS;
+    FILE *err_capture = tmpfile();
+    int saved_stderr = dup(2);
+    fflush(stderr);
+    dup2(fileno(err_capture), 2);
+    buffered_set_error_handler(count_error, NULL, 2);
+    bf = buffered_open("/dev/full", O_WRONLY);
+    if (!bf) return TEST_FAIL;
+    char chunk[1024];
+    memset(chunk, 'e', sizeof(chunk));
+    for (int i = 0; i < 40; i++) buffered_write(bf, chunk, sizeof(chunk));//from the 5th on, each fails to flush
+    buffered_error_t err;
+    if (buffered_error(bf, &err) != ENOSPC || err.op != BUFFERED_OP_FLUSH || err.offset != 0 || err.count < 9) {
+        status_9 = TEST_FAIL;
+    }
+    if (errors_reported != 2) status_9 = TEST_FAIL;//the rest of the burst was over the limit
+    buffered_clearerr(bf);
+    if (buffered_error(bf, NULL) != 0) status_9 = TEST_FAIL;
+    bf->write_buffer_pos = 0;//drop what /dev/full cannot take, so close succeeds
+    if (buffered_close(bf) == -1) status_9 = TEST_FAIL;
+    buffered_set_error_handler(NULL, NULL, 0);
+    fflush(stderr);
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    if (ftell(err_capture) != 0 || fseek(err_capture, 0, SEEK_END) != 0 || ftell(err_capture) != 0) status_9 = TEST_FAIL;
+    fclose(err_capture);
+    if (status_9 == TEST_FAIL) {
+        printf("Verification FAILED: errors not recorded as expected (%d handler calls).\n", errors_reported);
+        return TEST_FAIL;
+    }
+    printf("Verification SUCCESS: ENOSPC recorded on the handle, reported twice, nothing on stderr.\n");
+
     printf("\n*** All buffered_write tests passed! ***\n");
     return TEST_PASS;
 